@@ -0,0 +1,228 @@
+/*
+ * Arena (region) allocator on top of mm and memlib
+ *
+ * An arena hands out memory by bumping a pointer through large chunks. Objects carry no boundary tags and are never
+ * freed one at a time, so allocation is a compare and an add; the whole arena is reclaimed at once.
+ *
+ * MM_ARENA_HEAP: chunks are blocks of the default mm heap, kept in a singly linked list
+ * [NEXT:---OBJECTS---]		=> Chunk format
+ * Reset rewinds to the first chunk and keeps the others for reuse, release returns every chunk with mm_free.
+ *
+ * MM_ARENA_SBRK: chunks are taken straight from a memlib region of the arena's own with mem_region_sbrk, so they are
+ * contiguous and the arena is one growing run of memory. Reset rewinds the bump pointer, release unmaps the region.
+ * The default memlib region can't be used here: the mm heap relies on owning every byte up to its brk.
+ *
+ * Either way the chunk size is how much the arena grows by at a time, and the capacity the most it may hold in all
+ * (the size of the region an SBRK arena reserves up front).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+#include "arena.h"
+#include "mm.h"
+#include "memlib.h"
+
+#define ARENA_ALIGN		8					//alignment of every object
+#define ARENA_ROUND(n)		(((n) + (ARENA_ALIGN-1)) & ~(size_t)(ARENA_ALIGN-1))	//round up to ARENA_ALIGN
+#define ARENA_CHUNKSIZE		(64*1024)				//default chunk size
+#define ARENA_CAPACITY		((size_t)64 << 20)			//default capacity of an SBRK arena
+
+/* Header at the start of every MM_ARENA_HEAP chunk */
+typedef struct arena_chunk {
+	struct arena_chunk *next;		/* Next chunk, retained across resets */
+	size_t size;				/* Usable bytes after this header */
+} arena_chunk_t;
+
+#define CHUNK_HDRSIZE		ARENA_ROUND(sizeof(arena_chunk_t))
+#define CHUNK_START(c)		((char *)(c) + CHUNK_HDRSIZE)	//first object byte of chunk c
+
+struct mm_arena {
+	char *ptr;				/* Next free byte */
+	char *end;				/* End of the current chunk */
+	size_t chunksize;			/* Bytes requested per chunk */
+	size_t capacity;			/* Most bytes of chunks the arena may hold, 0 for no limit */
+	size_t held;				/* Bytes of chunks held */
+	int source;				/* MM_ARENA_HEAP or MM_ARENA_SBRK */
+	arena_chunk_t *first;			/* MM_ARENA_HEAP: chunk list */
+	arena_chunk_t *cur;			/* MM_ARENA_HEAP: chunk ptr points into */
+	mem_region_t *region;			/* MM_ARENA_SBRK: the arena's region */
+	char *base;				/* MM_ARENA_SBRK: first object byte */
+};
+
+static void *arena_grow(mm_arena_t *a, size_t size);
+
+
+/* 
+ * Function Name:	mm_arena_create
+ * Argument:		Chunk size in bytes (0 for a default of 64KB), capacity in bytes (0 for a default of 64MB for
+			MM_ARENA_SBRK, no limit for MM_ARENA_HEAP), chunk source (MM_ARENA_HEAP or MM_ARENA_SBRK)
+ * Return Type: 	Pointer to the new arena, NULL if no memory
+ * Description:		Create an empty arena. An SBRK arena reserves a region of the capacity (holding the arena itself too)
+			and extends it a chunk at a time; a HEAP arena takes each chunk from the mm heap.
+ */
+
+mm_arena_t *mm_arena_create(size_t chunksize, size_t capacity, int source)
+{
+	mm_arena_t *a;
+	mem_region_t *region;
+
+	if (chunksize == 0)
+		chunksize = ARENA_CHUNKSIZE;
+
+	if (source == MM_ARENA_SBRK)
+	{
+		if (capacity == 0)
+			capacity = ARENA_CAPACITY;
+		if ((region = mem_region_create(capacity)) == NULL)
+			return NULL;
+		if ((a = mem_region_sbrk(region, ARENA_ROUND(sizeof(mm_arena_t)))) == (void *)-1)
+		{
+			mem_region_destroy(region);
+			return NULL;
+		}
+		memset(a, 0, sizeof(*a));
+		a->region = region;
+		a->base = a->ptr = a->end = (char *)mem_region_hi(region) + 1;
+		a->held = a->base - (char *)mem_region_lo(region);
+	}
+	else
+	{
+		if ((a = mm_malloc(sizeof(mm_arena_t))) == NULL)
+			return NULL;
+		memset(a, 0, sizeof(*a));
+	}
+	a->chunksize = chunksize;
+	a->capacity = capacity;
+	a->source = source;
+	return a;
+}
+
+
+/* 
+ * Function Name:	mm_arena_alloc
+ * Argument:		Arena, size of the object in bytes
+ * Return Type: 	Pointer to ARENA_ALIGN aligned memory, NULL if the arena can't grow
+ * Description:		Bump allocate from the current chunk, only going to arena_grow when it is used up
+ */
+
+void *mm_arena_alloc(mm_arena_t *a, size_t size)
+{
+	char *p = a->ptr;
+
+	size = ARENA_ROUND(size);
+	if (size > (size_t)(a->end - p))
+		return arena_grow(a, size);
+	a->ptr = p + size;
+	return p;
+}
+
+
+/* 
+ * Function Name:	arena_grow
+ * Argument:		Arena, rounded size of the object that didn't fit
+ * Return Type: 	Pointer to the object, NULL if no memory
+ * Description:		Move to the next retained chunk if the object fits there, otherwise get a new chunk (at least big enough for
+			the object) and link it in after the current one. An SBRK arena simply extends its region, by a
+			chunk or, if that is more than the room left, by just what the object needs.
+ */
+
+static void *arena_grow(mm_arena_t *a, size_t size)
+{
+	arena_chunk_t *c;
+	size_t csize, need, room = a->capacity > a->held ? a->capacity - a->held : 0;
+	char *p;
+
+	if (a->source == MM_ARENA_SBRK)
+	{
+		need = size - (a->end - a->ptr);
+		csize = MAX(a->chunksize, need);
+		if (csize > room)
+			csize = need;
+		if (csize > room || csize > INT_MAX || mem_region_sbrk(a->region, csize) == (void *)-1)
+			return NULL;
+		a->held += csize;
+		a->end += csize;
+	}
+	else if (a->cur && a->cur->next && a->cur->next->size >= size)
+	{
+		a->cur = a->cur->next;
+		a->ptr = CHUNK_START(a->cur);
+		a->end = a->ptr + a->cur->size;
+	}
+	else
+	{
+		csize = MAX(a->chunksize, size + CHUNK_HDRSIZE);
+		if (a->capacity != 0 && csize > room)
+			return NULL;
+		if ((c = mm_malloc(csize)) == NULL)
+			return NULL;
+		a->held += csize;
+		c->size = csize - CHUNK_HDRSIZE;
+		if (a->cur)
+		{
+			c->next = a->cur->next;
+			a->cur->next = c;
+		}
+		else
+		{
+			c->next = a->first;
+			a->first = c;
+		}
+		a->cur = c;
+		a->ptr = CHUNK_START(c);
+		a->end = a->ptr + c->size;
+	}
+
+	p = a->ptr;
+	a->ptr = p + size;
+	return p;
+}
+
+
+/* 
+ * Function Name:	mm_arena_reset
+ * Argument:		Arena
+ * Return Type: 	void
+ * Description:		Free every object in the arena in O(1) by rewinding the bump pointer to the start. The chunks are kept and
+			refilled by later allocations.
+ */
+
+void mm_arena_reset(mm_arena_t *a)
+{
+	if (a->source == MM_ARENA_SBRK)
+	{
+		a->ptr = a->base;
+		return;
+	}
+	a->cur = a->first;
+	a->ptr = a->first ? CHUNK_START(a->first) : NULL;
+	a->end = a->first ? a->ptr + a->first->size : NULL;
+}
+
+
+/* 
+ * Function Name:	mm_arena_release
+ * Argument:		Arena
+ * Return Type: 	void
+ * Description:		Free every object and give the arena's memory back: one munmap for an SBRK arena, one mm_free per chunk
+			(not per object) for a HEAP arena. The arena can't be used afterwards.
+ */
+
+void mm_arena_release(mm_arena_t *a)
+{
+	arena_chunk_t *c, *next;
+
+	if (a->source == MM_ARENA_SBRK)
+	{
+		mem_region_destroy(a->region);
+		return;
+	}
+	for (c = a->first; c != NULL; c = next)
+	{
+		next = c->next;
+		mm_free(c);
+	}
+	mm_free(a);
+}
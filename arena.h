@@ -0,0 +1,16 @@
+#include <stdio.h>
+
+/*
+ * Arenas: bump-pointer allocation with no per-object header, footer or free.
+ * Everything allocated in an arena is reclaimed at once by mm_arena_reset (keep the memory for reuse)
+ * or mm_arena_release (give it back).
+ */
+typedef struct mm_arena mm_arena_t;
+
+#define MM_ARENA_HEAP		0			//chunks come from the default mm heap (mm_malloc)
+#define MM_ARENA_SBRK		1			//chunks come from a private memlib region (mem_region_sbrk)
+
+extern mm_arena_t *mm_arena_create(size_t chunksize, size_t capacity, int source);
+extern void *mm_arena_alloc(mm_arena_t *a, size_t size);
+extern void mm_arena_reset(mm_arena_t *a);
+extern void mm_arena_release(mm_arena_t *a);
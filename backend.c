@@ -0,0 +1,214 @@
+/*
+ * backend.c - the allocators mdriver can compare, behind one table of
+ *     functions (backend.h).
+ *
+ * The built-in mm backends share the default memlib region, so each
+ * run starts by emptying it and calling mm_init. An mm build from a
+ * shared object has its own memlib and region: its mem_init runs when
+ * it is opened, and its mem_reset_brk and mm_init before each run.
+ * The small object tier can't be reset, but its footprint is that of
+ * the span allocator it takes pages from. Other shared objects are
+ * mallocs that can't be reset and whose footprint is unknown; a
+ * balanced trace leaves them as it found them. A shared object is
+ * opened RTLD_LOCAL, so it serves only mdriver's calls through the
+ * table, and a symbol only counts if the object itself defines it, not
+ * a library it depends on.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <malloc.h>
+
+#include "backend.h"
+#include "mm.h"
+#include "memlib.h"
+#include "small.h"
+#include "span.h"
+
+/*
+ * The built-in mm package
+ */
+static int mm_backend_init(backend_t *b)
+{
+    mem_reset_brk();
+    mm_heap_policy(NULL, b->policy);
+    return mm_init();
+}
+
+static size_t mm_footprint(void)
+{
+    return mem_heapsize();
+}
+
+/*
+ * The libc allocator
+ */
+static size_t libc_usable_size(void *ptr)
+{
+    return malloc_usable_size(ptr);
+}
+
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+static size_t libc_footprint(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    return mi.arena + mi.hblkhd;
+}
+#define LIBC_FOOTPRINT libc_footprint
+#else
+#define LIBC_FOOTPRINT NULL
+#endif
+
+/*
+ * The small object tier, which has no realloc of its own: always move
+ */
+static void *small_realloc(void *ptr, size_t size)
+{
+    size_t old = mm_small_usable_size(ptr);
+    void *p;
+
+    if ((p = mm_small_malloc(size)) != NULL && ptr != NULL) {
+	memcpy(p, ptr, old < size ? old : size);
+	mm_small_free(ptr);
+    }
+    return p;
+}
+
+/*
+ * An mm build in a shared object
+ */
+static int so_mm_init(backend_t *b)
+{
+    b->mem_reset_brk();
+    return b->mm_init();
+}
+
+/*
+ * own_sym - Look up name in the object behind handle, NULL if that
+ *     object doesn't define it itself
+ */
+static void *own_sym(void *handle, const char *name)
+{
+    struct link_map *lm;
+    Dl_info info;
+    void *sym;
+
+    if ((sym = dlsym(handle, name)) == NULL ||
+	dlinfo(handle, RTLD_DI_LINKMAP, &lm) != 0 ||
+	dladdr(sym, &info) == 0 || strcmp(info.dli_fname, lm->l_name) != 0)
+	return NULL;
+    return sym;
+}
+
+/*
+ * open_so - Open a shared object backend. Returns 0, or -1 with a
+ *     message in err.
+ */
+static int open_so(const char *path, backend_t *b, char *err, size_t errlen)
+{
+    void (*mem_init_fn)(void);
+
+    if ((b->handle = dlopen(path, RTLD_NOW | RTLD_LOCAL)) == NULL) {
+	snprintf(err, errlen, "%s", dlerror());
+	return -1;
+    }
+
+    if (own_sym(b->handle, "mm_malloc") != NULL) {
+	mem_init_fn = own_sym(b->handle, "mem_init");
+	b->mem_reset_brk = own_sym(b->handle, "mem_reset_brk");
+	b->mm_init = own_sym(b->handle, "mm_init");
+	b->malloc = own_sym(b->handle, "mm_malloc");
+	b->free = own_sym(b->handle, "mm_free");
+	b->realloc = own_sym(b->handle, "mm_realloc");
+	b->footprint = own_sym(b->handle, "mem_heapsize");
+	if (mem_init_fn == NULL || b->mem_reset_brk == NULL ||
+	    b->mm_init == NULL || b->free == NULL || b->realloc == NULL) {
+	    snprintf(err, errlen, "%s: not a complete mm build", path);
+	    goto fail;
+	}
+	mem_init_fn();
+	b->init = so_mm_init;
+	return 0;
+    }
+
+    b->malloc = own_sym(b->handle, "malloc");
+    b->free = own_sym(b->handle, "free");
+    b->realloc = own_sym(b->handle, "realloc");
+    b->usable_size = own_sym(b->handle, "malloc_usable_size");
+    if (b->malloc == NULL || b->free == NULL || b->realloc == NULL) {
+	snprintf(err, errlen, "%s: defines neither mm_malloc nor malloc, free and realloc", path);
+	goto fail;
+    }
+    return 0;
+
+fail:
+    dlclose(b->handle);
+    b->handle = NULL;
+    return -1;
+}
+
+/*
+ * backend_open - Set up b from a spec (see backend.h); policy is what
+ *     "mm" gets. Returns 0, or -1 with a message in err.
+ */
+int backend_open(const char *spec, int policy, backend_t *b, char *err, size_t errlen)
+{
+    memset(b, 0, sizeof(*b));
+    snprintf(b->name, sizeof(b->name), "%s", spec);
+
+    if (strncmp(spec, "mm", 2) == 0 && strchr(spec, '/') == NULL &&
+	strstr(spec, ".so") == NULL) {
+	if (strcmp(spec, "mm") == 0)
+	    b->policy = policy;
+	else if (strcmp(spec, "mm-lifo") == 0)
+	    b->policy = MM_POLICY_LIFO;
+	else if (strcmp(spec, "mm-address") == 0)
+	    b->policy = MM_POLICY_ADDRESS;
+	else if (strcmp(spec, "mm-best") == 0)
+	    b->policy = MM_POLICY_BEST;
+	else {
+	    snprintf(err, errlen, "%s: unknown mm variant", spec);
+	    return -1;
+	}
+	b->init = mm_backend_init;
+	b->malloc = mm_malloc;
+	b->free = mm_free;
+	b->realloc = mm_realloc;
+	b->footprint = mm_footprint;
+	return 0;
+    }
+
+    if (strcmp(spec, "small") == 0) {
+	b->malloc = mm_small_malloc;
+	b->free = mm_small_free;
+	b->realloc = small_realloc;
+	b->usable_size = mm_small_usable_size;
+	b->footprint = span_heapsize;
+	return 0;
+    }
+
+    if (strcmp(spec, "libc") == 0) {
+	b->malloc = malloc;
+	b->free = free;
+	b->realloc = realloc;
+	b->usable_size = libc_usable_size;
+	b->footprint = LIBC_FOOTPRINT;
+	return 0;
+    }
+
+    return open_so(spec, b, err, errlen);
+}
+
+/*
+ * backend_close - Release what backend_open set up
+ */
+void backend_close(backend_t *b)
+{
+    if (b->handle != NULL)
+	dlclose(b->handle);
+    b->handle = NULL;
+}
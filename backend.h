@@ -0,0 +1,35 @@
+#include <stddef.h>
+
+/*
+ * Allocator backends: what mdriver replays a trace on. A backend is
+ * the built-in mm package with one of its free block policies, the
+ * small object tier, the libc allocator, or a shared object opened
+ * with dlopen, which is either another build of the mm package (it
+ * defines mm_malloc, see "make mm-<name>.so") or a malloc such as
+ * jemalloc or mimalloc.
+ */
+typedef struct backend {
+    char name[64];
+    int (*init)(struct backend *b);        /* start an empty heap; NULL if the backend can't */
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    size_t (*usable_size)(void *ptr);      /* NULL if unknown */
+    size_t (*footprint)(void);             /* heap bytes held now, NULL if unknown */
+    int policy;                            /* built-in mm: MM_POLICY_* */
+    void (*mem_reset_brk)(void);           /* mm build: its mem_reset_brk ... */
+    int (*mm_init)(void);                  /* ... and mm_init */
+    void *handle;                          /* from dlopen, NULL if built in */
+} backend_t;
+
+/*
+ * Backend specs:
+ *     mm                the mm package with the given default policy
+ *     mm-lifo, mm-address, mm-best
+ *                       the mm package with that policy
+ *     small             the small object tier (small.c)
+ *     libc              the C library's malloc
+ *     <path>.so         a shared object, as above
+ */
+int backend_open(const char *spec, int policy, backend_t *b, char *err, size_t errlen);
+void backend_close(backend_t *b);
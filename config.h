@@ -19,20 +19,20 @@
  * will use for testing. Modify this if you want to add or delete
  * traces from the driver's test suite. For example, if you don't want
  * your students to implement realloc, you can delete the last two
- * traces.
+ * traces. All of them ship with the driver; the -gen- traces were made
+ * by tracegen (see the README) in place of the lab's coalescing and
+ * realloc traces, which don't.
  */
 #define DEFAULT_TRACEFILES \
   "amptjp-bal.rep",\
   "cccp-bal.rep",\
-  "cp-decl-bal.rep",\
   "expr-bal.rep",\
-  "coalescing-bal.rep",\
+  "coalescing-gen-bal.rep",\
   "random-bal.rep",\
-  "random2-bal.rep",\
+  "random-bal2.rep",\
   "binary-bal.rep",\
-  "binary2-bal.rep",\
-  "realloc-bal.rep",\
-  "realloc2-bal.rep"
+  "realloc-gen-bal.rep",\
+  "realloc2-gen-bal.rep"
 
 /*
  * This constant gives the estimated performance of the libc malloc
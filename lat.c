@@ -0,0 +1,102 @@
+/*
+ * lat.c - latency histograms for timing single allocator calls.
+ *
+ * Ticks are converted to nanoseconds with a rate measured against the
+ * monotonic clock, rather than with the nominal TSC frequency, which
+ * the kernel does not export; the rate only needs to be good to a
+ * percent or so, well inside a histogram bucket.
+ */
+#include <string.h>
+#include <time.h>
+
+#include "lat.h"
+
+double lat_ns_per_tick = 1.0;
+uint64_t lat_overhead = 0;
+
+/* nanoseconds on the monotonic clock */
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * lat_calibrate - Measure lat_ns_per_tick over about 50ms, and
+ *     lat_overhead as the smallest interval between two tick reads
+ */
+void lat_calibrate(void)
+{
+    uint64_t t0, t1, c0, c1, min = UINT64_MAX;
+    int i;
+
+    for (i = 0; i < 1000; i++) {
+	c0 = lat_ticks();
+	c1 = lat_ticks();
+	if (c1 - c0 < min)
+	    min = c1 - c0;
+    }
+    lat_overhead = min;
+
+    t0 = now_ns();
+    c0 = lat_ticks();
+    while ((t1 = now_ns()) - t0 < 50000000)
+	;
+    c1 = lat_ticks();
+    lat_ns_per_tick = (double)(t1 - t0) / (double)(c1 - c0);
+}
+
+/*
+ * lat_reset - Empty a histogram
+ */
+void lat_reset(lat_hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+/*
+ * lat_merge - Add the samples of src to dst
+ */
+void lat_merge(lat_hist_t *dst, const lat_hist_t *src)
+{
+    int i;
+
+    for (i = 0; i < LAT_BUCKETS; i++)
+	dst->count[i] += src->count[i];
+    dst->n += src->n;
+    if (src->max > dst->max)
+	dst->max = src->max;
+}
+
+/*
+ * lat_percentile - Return the pct-th percentile (0 < pct <= 100) of
+ *     the samples in nanoseconds: the upper bound of the bucket it
+ *     falls in, or the exact maximum if that is lower. 0 if empty.
+ */
+double lat_percentile(const lat_hist_t *h, double pct)
+{
+    uint64_t rank, seen = 0, hi;
+    int i, e;
+
+    if (h->n == 0)
+	return 0;
+    rank = (uint64_t)(pct / 100.0 * h->n + 0.5);
+    if (rank < 1)
+	rank = 1;
+    for (i = 0; i < LAT_BUCKETS; i++)
+	if ((seen += h->count[i]) >= rank)
+	    break;
+
+    /* Largest value that lands in bucket i */
+    if (i < LAT_SUB)
+	hi = i;
+    else {
+	e = (i >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+	hi = ((uint64_t)(LAT_SUB + (i & (LAT_SUB - 1)) + 1) << (e - LAT_SUB_BITS)) - 1;
+    }
+    if (hi > h->max)
+	hi = h->max;
+    return hi * lat_ns_per_tick;
+}
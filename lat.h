@@ -0,0 +1,62 @@
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Per-operation latency: a cheap tick counter (the TSC on x86, the
+ * monotonic clock in ns elsewhere) and log-linear histograms of tick
+ * counts in the style of HDR histograms. Each power of two is split
+ * into 2^LAT_SUB_BITS equal buckets, so a percentile read back from a
+ * histogram is within 1/16 of the true value at any magnitude.
+ */
+#define LAT_SUB_BITS  4
+#define LAT_SUB       (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS   ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+typedef struct {
+    uint64_t count[LAT_BUCKETS];  /* samples per bucket */
+    uint64_t n;                   /* samples */
+    uint64_t max;                 /* largest sample, exact */
+} lat_hist_t;
+
+extern double lat_ns_per_tick;    /* set by lat_calibrate */
+extern uint64_t lat_overhead;     /* ticks of a back-to-back lat_ticks pair */
+
+/* lat_ticks - read the tick counter */
+static inline uint64_t lat_ticks(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned hi, lo;
+
+    asm volatile("rdtsc" : "=a" (lo), "=d" (hi) : : "memory");
+    return ((uint64_t)hi << 32) | lo;
+#else
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/* lat_record - add the interval start..end, less the timer overhead */
+static inline void lat_record(lat_hist_t *h, uint64_t start, uint64_t end)
+{
+    uint64_t v = end - start;
+    int e;
+
+    v = (v > lat_overhead) ? v - lat_overhead : 0;
+    if (v < LAT_SUB)
+	h->count[v]++;
+    else {
+	e = 63 - __builtin_clzll(v);
+	h->count[((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+		 ((v >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1))]++;
+    }
+    h->n++;
+    if (v > h->max)
+	h->max = v;
+}
+
+void lat_calibrate(void);
+void lat_reset(lat_hist_t *h);
+void lat_merge(lat_hist_t *dst, const lat_hist_t *src);
+double lat_percentile(const lat_hist_t *h, double pct);
@@ -0,0 +1,287 @@
+/*
+ * Lifetime predictor for mm_malloc
+ *
+ * Blocks that live long pin the space of short-lived neighbours, so mm_malloc can place predicted long-lived blocks in
+ * the MM_HINT_LONG heap without the caller saying so. Predictions are made per (call site, size class): a hash of the
+ * return addresses of the innermost frames above the allocator, and the log2 bucket of the request size. One frame is
+ * the return address of mm_malloc's caller, which costs nothing; a program that allocates through wrappers (xmalloc,
+ * operator new, the LD_PRELOAD shim) needs more, at the price of a walk of the unwinder (about 1us).
+ *
+ * Time is counted in allocations. One allocation in LT_SAMPLE_RATE is sampled: its pointer, site entry and birth time go
+ * into a small table hashed by pointer. When a sampled block is freed, its age decides whether it counts as short
+ * (under LT_SHORT_AGE allocations) or long for its site. A sample still live after LT_SHORT_AGE counts as long once a
+ * newer sample needs its slot. Counts are halved every LT_DECAY samples, so predictions follow program phases. A site
+ * entry recycled for another site gets a new generation, and samples of the old one are dropped uncounted.
+ *
+ * A site predicts long once it has LT_MIN_SAMPLES samples and at least 3 in 4 of them were long. Everything else stays
+ * in the default heap.
+ *
+ * Like the default heap itself, the predictor is not thread safe: callers serialize it (mm.c under mem_lock, the shim
+ * under its lock).
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unwind.h>
+
+#include "lifetime.h"
+#include "mm.h"
+
+#define LT_SITES		1024				//site entries (a power of 2)
+#define LT_SAMPLES		256				//live samples (a power of 2)
+#define LT_SAMPLE_RATE		16				//sample one allocation in this many
+#define LT_SHORT_AGE		4096				//allocations a short-lived block lives at most
+#define LT_MIN_SAMPLES		8				//samples before a site is trusted
+#define LT_DECAY		64				//samples per site before its counts are halved
+#define LT_MAX_FRAMES		8				//most frames hashed into a site
+
+#define LT_HASH(x)		((unsigned int)(((size_t)(x) * 0x9e3779b97f4a7c15ULL) >> 40))	//mix a word
+
+typedef struct site {
+	void *pc;				/* Call site, NULL for an empty entry */
+	int sizeclass;				/* log2 bucket of the request size */
+	unsigned int nshort;			/* Samples that died young */
+	unsigned int nlong;			/* Samples that lived long */
+	unsigned int gen;			/* Bumped each time the entry is recycled */
+} site_t;
+
+typedef struct sample {
+	void *bp;				/* Sampled block, NULL for an empty slot */
+	site_t *site;				/* Its site entry ... */
+	unsigned int gen;			/* ... while the entry has this generation */
+	unsigned long birth;			/* Allocation clock when it was allocated */
+} sample_t;
+
+typedef struct walk {
+	int skip;				/* Frames still to skip */
+	int frames;				/* Frames still to hash */
+	size_t hash;
+	size_t first;				/* Return address of the first frame hashed */
+} walk_t;
+
+static site_t sites[LT_SITES];
+static sample_t samples[LT_SAMPLES];
+static unsigned long clock_now;			/* Allocations seen */
+
+static site_t *find_site(void *pc, size_t size, int create);
+static void count(sample_t *smp);
+static _Unwind_Reason_Code walk_frame(struct _Unwind_Context *ctx, void *arg);
+
+
+/* 
+ * Function Name:	lifetime_site
+ * Argument:		Frames to hash (1 to LT_MAX_FRAMES), frames to skip above the caller
+ * Return Type: 	Site key: the caller's return address for one frame, else a hash of the return addresses of that many
+			frames, starting with the caller's (skip 0)
+ * Description:		Walk the stack with the unwinder. One frame gives the same key as __builtin_return_address(skip) in
+			the caller, so a caller after just that should use the builtin and skip the walk.
+ */
+
+void *lifetime_site(int frames, int skip)
+{
+	walk_t w;
+
+	w.skip = skip + 2;			/* This frame, and the caller's own IP */
+	w.frames = frames < 1 ? 1 : frames > LT_MAX_FRAMES ? LT_MAX_FRAMES : frames;
+	w.hash = 0;
+	w.first = 0;
+	_Unwind_Backtrace(walk_frame, &w);
+	if (frames <= 1)
+		return (void *)(w.first ? w.first : 1);
+	return (void *)(w.hash ? w.hash : 1);
+}
+
+
+/* 
+ * Function Name:	lifetime_predict
+ * Argument:		Call site, request size
+ * Return Type: 	MM_HINT_LONG if the site's blocks of this size class mostly live long, MM_HINT_NONE otherwise
+ * Description:		Look up the site's history; unknown sites and sites with too few samples predict nothing
+ */
+
+int lifetime_predict(void *site, size_t size)
+{
+	site_t *s = find_site(site, size, 0);
+	unsigned int n;
+
+	if (s == NULL || (n = s->nshort + s->nlong) < LT_MIN_SAMPLES)
+		return MM_HINT_NONE;
+	return s->nlong * 4 >= n * 3 ? MM_HINT_LONG : MM_HINT_NONE;
+}
+
+
+/* 
+ * Function Name:	lifetime_record
+ * Argument:		Call site, request size, block returned for it (or NULL)
+ * Return Type: 	void
+ * Description:		Tick the allocation clock and sample every LT_SAMPLE_RATE-th block. A slot held by a sample younger
+			than LT_SHORT_AGE is left alone; an older one is counted long and replaced.
+ */
+
+void lifetime_record(void *site, size_t size, void *bp)
+{
+	sample_t *smp;
+	site_t *s;
+
+	if (++clock_now % LT_SAMPLE_RATE != 0 || bp == NULL)
+		return;
+	smp = &samples[LT_HASH(bp) & (LT_SAMPLES - 1)];
+	if (smp->bp != NULL)
+	{
+		if (clock_now - smp->birth < LT_SHORT_AGE)
+			return;
+		count(smp);
+	}
+	if ((s = find_site(site, size, 1)) == NULL)
+		return;
+	smp->bp = bp;
+	smp->site = s;
+	smp->gen = s->gen;
+	smp->birth = clock_now;
+}
+
+
+/* 
+ * Function Name:	lifetime_realloc
+ * Argument:		Old and new address of a resized block, NULL if the resize freed it
+ * Return Type: 	void
+ * Description:		A sampled block keeps its birth time when it moves; one freed by the resize is counted as by
+			lifetime_free
+ */
+
+void lifetime_realloc(void *oldbp, void *newbp)
+{
+	sample_t *smp = &samples[LT_HASH(oldbp) & (LT_SAMPLES - 1)];
+	sample_t *dst;
+
+	if (oldbp == newbp || smp->bp != oldbp || smp->bp == NULL)
+		return;
+	if (newbp == NULL)
+	{
+		lifetime_free(oldbp);
+		return;
+	}
+	smp->bp = NULL;
+	dst = &samples[LT_HASH(newbp) & (LT_SAMPLES - 1)];
+	if (dst->bp != NULL)
+		count(dst);
+	*dst = *smp;
+	dst->bp = newbp;
+}
+
+
+/* 
+ * Function Name:	lifetime_free
+ * Argument:		Block being freed
+ * Return Type: 	void
+ * Description:		If the block was sampled, count its age for its site and free the slot
+ */
+
+void lifetime_free(void *bp)
+{
+	sample_t *smp = &samples[LT_HASH(bp) & (LT_SAMPLES - 1)];
+
+	if (bp == NULL || smp->bp != bp)
+		return;
+	count(smp);
+	smp->bp = NULL;
+}
+
+
+/* 
+ * Function Name:	lifetime_reset
+ * Argument:		None
+ * Return Type: 	void
+ * Description:		Forget the live samples, whose blocks went away with the heap. Site history is kept: the program's
+			call sites behave the same in the next heap.
+ */
+
+void lifetime_reset(void)
+{
+	memset(samples, 0, sizeof(samples));
+}
+
+
+/* 
+ * Function Name:	find_site
+ * Argument:		Call site, request size, whether to create a missing entry
+ * Return Type: 	Site entry, NULL if missing (and not created)
+ * Description:		Open addressing with linear probing over LT_SITES entries. When the probe window is full, the last
+			entry in it is recycled for the new site under a new generation.
+ */
+
+static site_t *find_site(void *pc, size_t size, int create)
+{
+	int sizeclass = 0, i;
+	unsigned int h;
+	site_t *s = NULL;
+
+	while (size >>= 1)
+		sizeclass++;
+	h = LT_HASH(pc) ^ sizeclass;
+	for (i = 0; i < 8; i++)
+	{
+		s = &sites[(h + i) & (LT_SITES - 1)];
+		if (s->pc == pc && s->sizeclass == sizeclass)
+			return s;
+		if (s->pc == NULL)
+			break;
+	}
+	if (!create)
+		return NULL;
+	if (s->pc != NULL)
+		s->gen++;
+	s->pc = pc;
+	s->sizeclass = sizeclass;
+	s->nshort = s->nlong = 0;
+	return s;
+}
+
+
+/* 
+ * Function Name:	count
+ * Argument:		Sample whose block died or whose slot is taken over
+ * Return Type: 	void
+ * Description:		Add the sample, long if it is LT_SHORT_AGE old, to its site's counts, halving both every LT_DECAY
+			samples. A sample of a recycled site entry belongs to no site any more and is dropped.
+ */
+
+static void count(sample_t *smp)
+{
+	site_t *s = smp->site;
+
+	if (s->gen != smp->gen)
+		return;
+	if (clock_now - smp->birth >= LT_SHORT_AGE)
+		s->nlong++;
+	else
+		s->nshort++;
+	if (s->nshort + s->nlong >= LT_DECAY)
+	{
+		s->nshort /= 2;
+		s->nlong /= 2;
+	}
+}
+
+
+/* 
+ * Function Name:	walk_frame
+ * Argument:		Unwinder context of one frame, the walk
+ * Return Type: 	_URC_END_OF_STACK once enough frames are hashed, _URC_NO_REASON to go on
+ * Description:		Skip or hash the frame's return address
+ */
+
+static _Unwind_Reason_Code walk_frame(struct _Unwind_Context *ctx, void *arg)
+{
+	walk_t *w = arg;
+
+	if (w->skip > 0)
+	{
+		w->skip--;
+		return _URC_NO_REASON;
+	}
+	if (w->first == 0)
+		w->first = _Unwind_GetIP(ctx);
+	w->hash = (w->hash ^ _Unwind_GetIP(ctx)) * 0x9e3779b97f4a7c15ULL;
+	return --w->frames > 0 ? _URC_NO_REASON : _URC_END_OF_STACK;
+}
@@ -0,0 +1,12 @@
+#include <stdio.h>
+
+/*
+ * Online lifetime prediction per (call site, size class), learned from sampled blocks.
+ * Used by mm_malloc once mm_predict is called, and by the LD_PRELOAD shim with MM_PREDICT set.
+ */
+extern void *lifetime_site(int frames, int skip);
+extern int lifetime_predict(void *site, size_t size);
+extern void lifetime_record(void *site, size_t size, void *bp);
+extern void lifetime_realloc(void *oldbp, void *newbp);
+extern void lifetime_free(void *bp);
+extern void lifetime_reset(void);
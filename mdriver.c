@@ -7,6 +7,7 @@
  * Copyright (c) 2002, R. Bryant and D. O'Hallaron, All rights reserved.
  * May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -14,12 +15,20 @@
 #include <string.h>
 #include <assert.h>
 #include <float.h>
+#include <stdint.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "mm.h"
 #include "memlib.h"
 #include "fsecs.h"
 #include "config.h"
+#include "trace.h"
+#include "lat.h"
+#include "backend.h"
 
 /**********************
  * Constants and macros
@@ -29,27 +38,40 @@
 #define MAXLINE     1024 /* max string size */
 #define HDRLINES       4 /* number of header lines in a trace file */
 #define LINENUM(i) (i+5) /* cnvt trace request nums to linenums (origin 1) */
+#define STREAM_RUNS    3 /* timed replays of a streamed trace, best one counts */
 
 /* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p)  ((((unsigned int)(p)) % ALIGNMENT) == 0)
+#define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
 
 /****************************** 
  * The key compound data types 
  *****************************/
 
-/* Records the extent of each block's payload */
+/* Records the extent of each block's payload, as a node of a treap keyed by lo */
 typedef struct range_t {
     char *lo;              /* low payload address */
     char *hi;              /* high payload address */
-    struct range_t *next;  /* next list element */
+    struct range_t *left;  /* ranges below lo */
+    struct range_t *right; /* ranges above hi */
 } range_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/* Size classes that latency is broken down by (-L): < 64, 512, 4K, 32K and larger */
+#define LAT_SIZES  5
+
+/* Latency histograms of one trace, by op type and size class */
 typedef struct {
-    enum {ALLOC, FREE, REALLOC} type; /* type of request */
-    int index;                        /* index for free() to use later */
-    int size;                         /* byte size of alloc/realloc request */
-} traceop_t;
+    lat_hist_t h[3][LAT_SIZES];
+} latency_t;
+
+/* Treap priority of a range, hashed from its address */
+#define RANGE_PRIO(p)  ((unsigned int)((unsigned long)((p)->lo) >> 3) * 2654435761u)
+
+/* 
+ * Characterizes a single trace operation (allocator request). This is
+ * the binary trace record, so a binary trace is replayed in place.
+ */
+typedef trace_op_t traceop_t;
+enum {ALLOC = TRACE_ALLOC, FREE = TRACE_FREE, REALLOC = TRACE_REALLOC};
 
 /* Holds the information for one trace file*/
 typedef struct {
@@ -60,6 +82,7 @@ typedef struct {
     traceop_t *ops;      /* array of requests */
     char **blocks;       /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes; /* ... and a corresponding array of payload sizes */
+    trace_file_t file;   /* the loaded trace file that ops points into */
 } trace_t;
 
 /* 
@@ -70,8 +93,49 @@ typedef struct {
 typedef struct {
     trace_t *trace;  
     range_t *ranges;
+    backend_t *backend; /* allocator under test, for eval_backend_speed */
 } speed_t;
 
+/* 
+ * A live block of a streamed trace. Streamed traces keep their blocks 
+ * in a hash table of live ids instead of arrays indexed by every id.
+ */
+typedef struct {
+    int id;          /* block id, IDMAP_EMPTY for a free slot */
+    int size;        /* payload size */
+    char *p;         /* payload */
+} live_t;
+
+typedef struct {
+    live_t *slots;   /* open addressing, linear probing */
+    size_t mask;     /* number of slots - 1, a power of two */
+    size_t count;    /* live ids */
+} idmap_t;
+
+/* 
+ * Parameters of a multi-threaded replay (-T). Trace thread t runs on 
+ * replay thread t % nthreads, in trace order. An op on a block waits 
+ * until the ops before it on that block are done, so a block freed by 
+ * another thread than the one that allocated it is freed after the 
+ * allocation. Each thread waits only on ops earlier in the trace, so 
+ * the replay cannot deadlock.
+ */
+typedef struct {
+    trace_t *trace;
+    int nthreads;    /* replay threads */
+    int *seq;        /* per op: number of earlier ops on its block */
+    int *done;       /* per block id: number of its ops completed */
+    lat_hist_t *hist; /* per replay thread: latency of its ops, NULL if untimed */
+} mt_t;
+
+typedef struct {
+    mt_t *mt;
+    int me;          /* replay thread number */
+} mt_arg_t;
+
+#define IDMAP_EMPTY  -1
+#define IDMAP_HASH(map, id) (((unsigned int)(id) * 2654435761u) & (map)->mask)
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct {
     /* defined for both libc malloc and student malloc package (mm.c) */
@@ -79,12 +143,28 @@ typedef struct {
     int valid;       /* was the trace processed correctly by the allocator? */
     double secs;     /* number of secs needed to run the trace */
 
-    /* defined only for the student malloc package */
-    double util;     /* space utilization for this trace (always 0 for libc) */
+    /* 
+     * Space utilization for this trace. For a backend other than the 
+     * built-in mm package it is -1 if the footprint is unknown, and only 
+     * approximate for libc malloc, which counts the memory it held 
+     * before the trace as used by others.
+     */
+    double util;
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t; 
 
+/* 
+ * Shared by the worker processes of a parallel evaluation (-j), in an 
+ * anonymous shared mapping. Each worker takes the next trace not yet 
+ * taken until none are left, and writes its stats in place.
+ */
+typedef struct {
+    int next;        /* next trace to evaluate */
+    int errors;      /* errors found by all the workers */
+    stats_t stats[]; /* per trace */
+} par_t;
+
 /********************
  * Global variables
  *******************/
@@ -100,6 +180,24 @@ static char *default_tracefiles[] = {
     DEFAULT_TRACEFILES, NULL
 };
 
+/* If set, stream the traces through the mm package instead of loading them (-S) */
+static int stream = 0;
+
+/* If set, also replay the traces on 1, 2, 4 ... this many threads (-T) */
+static int mt_threads = 0;
+
+/* If set, time each request of the traces and report its latency percentiles (-L) */
+static int latency = 0;
+
+/* Evaluate the traces in this many worker processes (-j) */
+static int jobs = 1;
+
+/* Free block policy of the mm package (-o) */
+static int policy = MM_POLICY_LIFO;
+
+/* Output formats of a backend comparison (-F) */
+enum {FMT_TABLE, FMT_CSV, FMT_JSON};
+
 
 /********************* 
  * Function prototypes 
@@ -110,20 +208,44 @@ static int add_range(range_t **ranges, char *lo, int size,
 		     int tracenum, int opnum);
 static void remove_range(range_t **ranges, char *lo);
 static void clear_ranges(range_t **ranges);
+static range_t *range_floor(range_t *t, char *addr);
+static range_t *range_insert(range_t *t, range_t *p);
+static range_t *range_delete(range_t *t, char *lo);
+
+/* these functions map the live ids of a streamed trace to their blocks */
+static void idmap_init(idmap_t *map);
+static live_t *idmap_get(idmap_t *map, int id);
+static live_t *idmap_put(idmap_t *map, int id);
+static void idmap_del(idmap_t *map, live_t *e);
+static void idmap_free(idmap_t *map);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(char *tracedir, char *filename);
 static void free_trace(trace_t *trace);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
-static int eval_libc_valid(trace_t *trace, int tracenum);
-static void eval_libc_speed(void *ptr);
+static int eval_backend_valid(backend_t *b, trace_t *trace, int tracenum, 
+			      stats_t *stats);
+static void eval_backend_speed(void *ptr);
+static void eval_backends(backend_t *backends, int nbackends, 
+			  char **tracefiles, int num_tracefiles, int format);
+static void print_json_string(const char *s);
 
 /* Routines for evaluating correctnes, space utilization, and speed 
    of the student's malloc package in mm.c */
 static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges);
 static double eval_mm_util(trace_t *trace, int tracenum, range_t **ranges);
 static void eval_mm_speed(void *ptr);
+static void eval_mm_trace(char *name, int tracenum, stats_t *stats);
+static void eval_mm_parallel(char **tracefiles, int n, stats_t *stats);
+static int eval_mm_stream_valid(char *path, int tracenum, range_t **ranges,
+				stats_t *stats);
+static double eval_mm_stream_speed(char *path);
+static void eval_mm_mt(trace_t *trace, char *name, int max_threads);
+static void eval_mm_mt_speed(void *ptr);
+static void *mt_replay(void *ptr);
+static void eval_latency(backend_t *b, trace_t *trace, latency_t *lat);
+static void print_latency(char *name, latency_t *lat);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats);
@@ -142,7 +264,6 @@ int main(int argc, char **argv)
     char **tracefiles = NULL;  /* null-terminated array of trace file names */
     int num_tracefiles = 0;    /* the number of traces in that array */
     trace_t *trace = NULL;     /* stores a single trace file in memory */
-    range_t *ranges = NULL;    /* keeps track of block extents for one trace */
     stats_t *libc_stats = NULL;/* libc stats for each trace */
     stats_t *mm_stats = NULL;  /* mm (i.e. student) stats for each trace */
     speed_t speed_params;      /* input parameters to the xx_speed routines */ 
@@ -150,6 +271,14 @@ int main(int argc, char **argv)
     int team_check = 1;  /* If set, check team structure (reset by -a) */
     int run_libc = 0;    /* If set, run libc malloc (set by -l) */
     int autograder = 0;  /* If set, emit summary info for autograder (-g) */
+    char *heapfile = NULL; /* If set, map the heap from this file (-p) */
+    char *heapshm = NULL;  /* If set, map the heap from this shm object (-s) */
+    char **backend_specs = NULL; /* allocators to compare (-B) */
+    backend_t *backends = NULL;  /* ... opened once -o is known */
+    int nbackends = 0;
+    int format = FMT_TABLE;     /* how to print the comparison (-F) */
+    backend_t libc;             /* the libc backend (-l) */
+    char err[MAXLINE];
 
     /* temporaries used to compute the performance index */
     double secs, ops, util, avg_mm_util, avg_mm_throughput, p1, p2, perfindex;
@@ -158,7 +287,7 @@ int main(int argc, char **argv)
     /* 
      * Read and interpret the command line arguments 
      */
-    while ((c = getopt(argc, argv, "f:t:hvVgal")) != EOF) {
+    while ((c = getopt(argc, argv, "f:t:hvVgaLlp:s:o:ST:B:F:j:")) != EOF) {
         switch (c) {
 	case 'g': /* Generate summary info for the autograder */
 	    autograder = 1;
@@ -184,6 +313,61 @@ int main(int argc, char **argv)
         case 'l': /* Run libc malloc */
             run_libc = 1;
             break;
+        case 'p': /* Map the simulated heap from a file */
+            heapfile = optarg;
+            break;
+        case 's': /* Map the simulated heap from a shared memory object */
+            heapshm = optarg;
+            break;
+        case 'o': /* Free block policy of the heap under test */
+            if (!strcmp(optarg, "lifo"))
+                policy = MM_POLICY_LIFO;
+            else if (!strcmp(optarg, "address"))
+                policy = MM_POLICY_ADDRESS;
+            else if (!strcmp(optarg, "best"))
+                policy = MM_POLICY_BEST;
+            else {
+                usage();
+                exit(1);
+            }
+            mm_heap_policy(NULL, policy);
+            break;
+        case 'B': /* Compare this allocator backend */
+            if ((backend_specs = realloc(backend_specs, 
+				    (nbackends + 1) * sizeof(char *))) == NULL)
+		unix_error("ERROR: realloc failed in main");
+            backend_specs[nbackends++] = optarg;
+            break;
+        case 'F': /* Output format of the comparison */
+            if (!strcmp(optarg, "table"))
+                format = FMT_TABLE;
+            else if (!strcmp(optarg, "csv"))
+                format = FMT_CSV;
+            else if (!strcmp(optarg, "json"))
+                format = FMT_JSON;
+            else {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'S': /* Stream the traces through the mm package */
+            stream = 1;
+            break;
+        case 'T': /* Replay on up to this many threads as well */
+            if ((mt_threads = atoi(optarg)) < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'j': /* Evaluate the traces in this many processes */
+            if ((jobs = atoi(optarg)) < 1) {
+                usage();
+                exit(1);
+            }
+            break;
+        case 'L': /* Report per-request latency percentiles */
+            latency = 1;
+            break;
         case 'v': /* Print per-trace performance breakdown */
             verbose = 1;
             break;
@@ -199,6 +383,29 @@ int main(int argc, char **argv)
         }
     }
 	
+    /* Open the backends, now that "mm" can get the final -o policy */
+    if (nbackends > 0 &&
+	(backends = malloc(nbackends * sizeof(backend_t))) == NULL)
+	unix_error("ERROR: malloc failed in main");
+    for (i = 0; i < nbackends; i++)
+	if (backend_open(backend_specs[i], policy, &backends[i], 
+			 err, sizeof(err)) < 0) {
+	    fprintf(stderr, "Backend %s: %s\n", backend_specs[i], err);
+	    exit(1);
+	}
+
+    /* A mapped heap is shared, so the workers can't each have their own */
+    if (jobs > 1 && (heapfile != NULL || heapshm != NULL)) {
+	fprintf(stderr, "-j can't be used with -p or -s\n");
+	exit(1);
+    }
+
+    /* The multi-threaded replay and the latency run need the whole trace */
+    if (stream && (mt_threads > 0 || latency)) {
+	fprintf(stderr, "-S can't be used with -T or -L\n");
+	exit(1);
+    }
+
     /* 
      * Check and print team info 
      */
@@ -232,11 +439,40 @@ int main(int argc, char **argv)
     if (tracefiles == NULL) {
         tracefiles = default_tracefiles;
         num_tracefiles = sizeof(default_tracefiles) / sizeof(char *) - 1;
-	printf("Using default tracefiles in %s\n", tracedir);
+	if (format == FMT_TABLE)
+	    printf("Using default tracefiles in %s\n", tracedir);
     }
 
-    /* Initialize the timing package */
+    /* Initialize the timing package, and the tick counter for -S */
     init_fsecs();
+    if (stream)
+	lat_calibrate();
+
+    /* Initialize the simulated memory system in memlib.c */
+    if (heapfile != NULL) {
+	if (mem_init_file(heapfile) < 0) {
+	    sprintf(msg, "Could not map heap file %s", heapfile);
+	    unix_error(msg);
+	}
+    }
+    else if (heapshm != NULL) {
+	if (mem_init_shm(heapshm) < 0) {
+	    sprintf(msg, "Could not map shared memory heap %s", heapshm);
+	    unix_error(msg);
+	}
+    }
+    else
+	mem_init(); 
+
+    /*
+     * With -B, compare the backends side by side instead
+     */
+    if (nbackends > 0) {
+	eval_backends(backends, nbackends, tracefiles, num_tracefiles, format);
+	for (i=0; i < nbackends; i++)
+	    backend_close(&backends[i]);
+	exit(errors == 0 ? 0 : 1);
+    }
 
     /*
      * Optionally run and evaluate the libc malloc package 
@@ -249,6 +485,7 @@ int main(int argc, char **argv)
 	libc_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
 	if (libc_stats == NULL)
 	    unix_error("libc_stats calloc in main failed");
+	backend_open("libc", policy, &libc, err, sizeof(err));
 	
 	/* Evaluate the libc malloc package using the K-best scheme */
 	for (i=0; i < num_tracefiles; i++) {
@@ -256,12 +493,16 @@ int main(int argc, char **argv)
 	    libc_stats[i].ops = trace->num_ops;
 	    if (verbose > 1)
 		printf("Checking libc malloc for correctness, ");
-	    libc_stats[i].valid = eval_libc_valid(trace, i);
+	    libc_stats[i].valid = eval_backend_valid(&libc, trace, i, 
+						     &libc_stats[i]);
+	    if (libc_stats[i].util < 0)
+		libc_stats[i].util = 0;
 	    if (libc_stats[i].valid) {
 		speed_params.trace = trace;
+		speed_params.backend = &libc;
 		if (verbose > 1)
 		    printf("and performance.\n");
-		libc_stats[i].secs = fsecs(eval_libc_speed, &speed_params);
+		libc_stats[i].secs = fsecs(eval_backend_speed, &speed_params);
 	    }
 	    free_trace(trace);
 	}
@@ -283,29 +524,13 @@ int main(int argc, char **argv)
     mm_stats = (stats_t *)calloc(num_tracefiles, sizeof(stats_t));
     if (mm_stats == NULL)
 	unix_error("mm_stats calloc in main failed");
-    
-    /* Initialize the simulated memory system in memlib.c */
-    mem_init(); 
 
     /* Evaluate student's mm malloc package using the K-best scheme */
-    for (i=0; i < num_tracefiles; i++) {
-	trace = read_trace(tracedir, tracefiles[i]);
-	mm_stats[i].ops = trace->num_ops;
-	if (verbose > 1)
-	    printf("Checking mm_malloc for correctness, ");
-	mm_stats[i].valid = eval_mm_valid(trace, i, &ranges);
-	if (mm_stats[i].valid) {
-	    if (verbose > 1)
-		printf("efficiency, ");
-	    mm_stats[i].util = eval_mm_util(trace, i, &ranges);
-	    speed_params.trace = trace;
-	    speed_params.ranges = ranges;
-	    if (verbose > 1)
-		printf("and performance.\n");
-	    mm_stats[i].secs = fsecs(eval_mm_speed, &speed_params);
-	}
-	free_trace(trace);
-    }
+    if (jobs > 1 && num_tracefiles > 1)
+	eval_mm_parallel(tracefiles, num_tracefiles, mm_stats);
+    else
+	for (i=0; i < num_tracefiles; i++)
+	    eval_mm_trace(tracefiles[i], i, &mm_stats[i]);
 
     /* Display the mm results in a compact table */
     if (verbose) {
@@ -314,6 +539,43 @@ int main(int argc, char **argv)
 	printf("\n");
     }
 
+    /* 
+     * Optionally measure how the mm package scales with threads 
+     */
+    if (mt_threads > 0 && errors == 0) {
+	if (latency)
+	    lat_calibrate();
+	printf("Thread scaling for mm malloc:\n");
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    eval_mm_mt(trace, tracefiles[i], mt_threads);
+	    free_trace(trace);
+	}
+	printf("\n");
+    }
+
+    /* 
+     * Optionally time each request in a replay of its own 
+     */
+    if (latency && errors == 0) {
+	latency_t *lat;
+	backend_t mm;
+
+	if ((lat = malloc(sizeof(latency_t))) == NULL)
+	    unix_error("malloc failed in main");
+	backend_open("mm", policy, &mm, err, sizeof(err));
+	lat_calibrate();
+	printf("Latency for mm malloc (ns):\n");
+	for (i=0; i < num_tracefiles; i++) {
+	    trace = read_trace(tracedir, tracefiles[i]);
+	    eval_latency(&mm, trace, lat);
+	    print_latency(tracefiles[i], lat);
+	    free_trace(trace);
+	}
+	printf("\n");
+	free(lat);
+    }
+
     /* 
      * Accumulate the aggregate statistics for the student's mm package 
      */
@@ -367,16 +629,18 @@ int main(int argc, char **argv)
 
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps 
+ * The following routines manipulate the range tree, which keeps 
  * track of the extent of every allocated block payload. We use the 
- * range list to detect any overlapping allocated blocks.
+ * range tree to detect any overlapping allocated blocks. Payloads 
+ * never overlap, so only the range with the highest lo at or below 
+ * a new payload's hi can overlap it, and each check is O(log n).
  ****************************************************************/
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of 
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list. 
+ *     we create a range struct for this block and add it to the range tree. 
  */
 static int add_range(range_t **ranges, char *lo, int size, 
 		     int tracenum, int opnum)
@@ -405,26 +669,23 @@ static int add_range(range_t **ranges, char *lo, int size,
     }
 
     /* The payload must not overlap any other payloads */
-    for (p = *ranges;  p != NULL;  p = p->next) {
-        if ((lo >= p->lo && lo <= p-> hi) ||
-            (hi >= p->lo && hi <= p->hi)) {
-	    sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
-		    lo, hi, p->lo, p->hi);
-	    malloc_error(tracenum, opnum, msg);
-	    return 0;
-        }
+    if ((p = range_floor(*ranges, hi)) != NULL && p->hi >= lo) {
+	sprintf(msg, "Payload (%p:%p) overlaps another payload (%p:%p)\n",
+		lo, hi, p->lo, p->hi);
+	malloc_error(tracenum, opnum, msg);
+	return 0;
     }
 
     /* 
      * Everything looks OK, so remember the extent of this block 
-     * by creating a range struct and adding it the range list.
+     * by creating a range struct and adding it the range tree.
      */
     if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
 	unix_error("malloc error in add_range");
-    p->next = *ranges;
     p->lo = lo;
     p->hi = hi;
-    *ranges = p;
+    p->left = p->right = NULL;
+    *ranges = range_insert(*ranges, p);
     return 1;
 }
 
@@ -433,19 +694,7 @@ static int add_range(range_t **ranges, char *lo, int size,
  */
 static void remove_range(range_t **ranges, char *lo)
 {
-    range_t *p;
-    range_t **prevpp = ranges;
-    int size;
-
-    for (p = *ranges;  p != NULL; p = p->next) {
-        if (p->lo == lo) {
-	    *prevpp = p->next;
-            size = p->hi - p->lo + 1;
-            free(p);
-            break;
-        }
-        prevpp = &(p->next);
-    }
+    *ranges = range_delete(*ranges, lo);
 }
 
 /*
@@ -453,33 +702,217 @@ static void remove_range(range_t **ranges, char *lo)
  */
 static void clear_ranges(range_t **ranges)
 {
-    range_t *p;
-    range_t *pnext;
+    range_t *p = *ranges;
 
-    for (p = *ranges;  p != NULL;  p = pnext) {
-        pnext = p->next;
-        free(p);
-    }
+    if (p == NULL)
+	return;
+    clear_ranges(&p->left);
+    clear_ranges(&p->right);
+    free(p);
     *ranges = NULL;
 }
 
+/*
+ * range_floor - Return the range with the highest lo at or below addr,
+ *     or NULL if there is none
+ */
+static range_t *range_floor(range_t *t, char *addr)
+{
+    range_t *floor = NULL;
+
+    while (t != NULL) {
+	if (t->lo <= addr) {
+	    floor = t;
+	    t = t->right;
+	}
+	else
+	    t = t->left;
+    }
+    return floor;
+}
+
+/*
+ * range_insert - Insert range p into the treap rooted at t, rotating 
+ *     it up past ancestors of lower priority. Returns the new root.
+ */
+static range_t *range_insert(range_t *t, range_t *p)
+{
+    range_t *c;
+
+    if (t == NULL)
+	return p;
+    if (p->lo < t->lo) {
+	t->left = c = range_insert(t->left, p);
+	if (RANGE_PRIO(c) > RANGE_PRIO(t)) {
+	    t->left = c->right;
+	    c->right = t;
+	    return c;
+	}
+    }
+    else {
+	t->right = c = range_insert(t->right, p);
+	if (RANGE_PRIO(c) > RANGE_PRIO(t)) {
+	    t->right = c->left;
+	    c->left = t;
+	    return c;
+	}
+    }
+    return t;
+}
+
+/*
+ * range_delete - Free the range starting at lo in the treap rooted at t,
+ *     rotating it down until it is a leaf. Returns the new root.
+ */
+static range_t *range_delete(range_t *t, char *lo)
+{
+    range_t *c;
+
+    if (t == NULL)
+	return NULL;
+    if (lo < t->lo) {
+	t->left = range_delete(t->left, lo);
+	return t;
+    }
+    if (lo > t->lo) {
+	t->right = range_delete(t->right, lo);
+	return t;
+    }
+    if (t->left == NULL || t->right == NULL) {
+	c = (t->left != NULL) ? t->left : t->right;
+	free(t);
+	return c;
+    }
+    if (RANGE_PRIO(t->left) > RANGE_PRIO(t->right)) {
+	c = t->left;
+	t->left = c->right;
+	c->right = range_delete(t, lo);
+    }
+    else {
+	c = t->right;
+	t->right = c->left;
+	c->left = range_delete(t, lo);
+    }
+    return c;
+}
+
+
+/*****************************************************************
+ * The following routines manipulate the id map of a streamed 
+ * trace. It only holds live ids, so its size follows the live 
+ * block count rather than the number of ids in the trace.
+ ****************************************************************/
+
+/*
+ * idmap_init - Make an empty id map
+ */
+static void idmap_init(idmap_t *map)
+{
+    size_t i;
+
+    map->mask = 1023;
+    map->count = 0;
+    if ((map->slots = malloc((map->mask + 1) * sizeof(live_t))) == NULL)
+	unix_error("malloc failed in idmap_init");
+    for (i = 0; i <= map->mask; i++)
+	map->slots[i].id = IDMAP_EMPTY;
+}
+
+/*
+ * idmap_get - Return the entry of a live id, or NULL
+ */
+static live_t *idmap_get(idmap_t *map, int id)
+{
+    size_t i;
+
+    for (i = IDMAP_HASH(map, id); map->slots[i].id != IDMAP_EMPTY;
+	 i = (i + 1) & map->mask)
+	if (map->slots[i].id == id)
+	    return &map->slots[i];
+    return NULL;
+}
+
+/*
+ * idmap_put - Return the entry of id, adding it if it is not live. 
+ *     The table doubles when it gets half full.
+ */
+static live_t *idmap_put(idmap_t *map, int id)
+{
+    live_t *old, *e;
+    size_t i, oldmask;
+
+    if ((e = idmap_get(map, id)) != NULL)
+	return e;
+
+    if (2 * (map->count + 1) > map->mask + 1) {
+	old = map->slots;
+	oldmask = map->mask;
+	map->mask = 2 * oldmask + 1;
+	if ((map->slots = malloc((map->mask + 1) * sizeof(live_t))) == NULL)
+	    unix_error("malloc failed in idmap_put");
+	for (i = 0; i <= map->mask; i++)
+	    map->slots[i].id = IDMAP_EMPTY;
+	map->count = 0;
+	for (i = 0; i <= oldmask; i++)
+	    if (old[i].id != IDMAP_EMPTY)
+		*idmap_put(map, old[i].id) = old[i];
+	free(old);
+    }
+
+    for (i = IDMAP_HASH(map, id); map->slots[i].id != IDMAP_EMPTY;
+	 i = (i + 1) & map->mask)
+	;
+    e = &map->slots[i];
+    e->id = id;
+    e->size = 0;
+    e->p = NULL;
+    map->count++;
+    return e;
+}
+
+/*
+ * idmap_del - Remove an entry, shifting back the entries after it 
+ *     in its probe run so that no tombstones are needed
+ */
+static void idmap_del(idmap_t *map, live_t *e)
+{
+    size_t hole = e - map->slots, i, home;
+
+    map->count--;
+    for (i = (hole + 1) & map->mask; map->slots[i].id != IDMAP_EMPTY;
+	 i = (i + 1) & map->mask) {
+	/* Move slot i into the hole unless its home lies after the hole */
+	home = IDMAP_HASH(map, map->slots[i].id);
+	if (((i - home) & map->mask) >= ((i - hole) & map->mask)) {
+	    map->slots[hole] = map->slots[i];
+	    hole = i;
+	}
+    }
+    map->slots[hole].id = IDMAP_EMPTY;
+}
+
+/*
+ * idmap_free - Release the id map
+ */
+static void idmap_free(idmap_t *map)
+{
+    free(map->slots);
+    map->slots = NULL;
+}
+
 
 /**********************************************
  * The following routines manipulate tracefiles
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file (text .rep or binary, see trace.h)
+ *     and store it in memory
  */
 static trace_t *read_trace(char *tracedir, char *filename)
 {
-    FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
     char path[MAXLINE];
-    unsigned index, size;
-    unsigned max_index = 0;
-    unsigned op_index;
 
     if (verbose > 1)
 	printf("Reading tracefile: %s\n", filename);
@@ -488,22 +921,18 @@ static trace_t *read_trace(char *tracedir, char *filename)
     if ((trace = (trace_t *) malloc(sizeof(trace_t))) == NULL)
 	unix_error("malloc 1 failed in read_trance");
 	
-    /* Read the trace file header */
+    /* Load the trace: a binary trace is mapped, a text one parsed */
     strcpy(path, tracedir);
     strcat(path, filename);
-    if ((tracefile = fopen(path, "r")) == NULL) {
-	sprintf(msg, "Could not open %s in read_trace", path);
+    if (trace_load(path, &trace->file) < 0) {
+	sprintf(msg, "Could not read %s in read_trace", path);
 	unix_error(msg);
     }
-    fscanf(tracefile, "%d", &(trace->sugg_heapsize)); /* not used */
-    fscanf(tracefile, "%d", &(trace->num_ids));     
-    fscanf(tracefile, "%d", &(trace->num_ops));     
-    fscanf(tracefile, "%d", &(trace->weight));        /* not used */
-    
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops = 
-	 (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-	unix_error("malloc 2 failed in read_trace");
+    trace->sugg_heapsize = trace->file.sugg_heapsize; /* not used */
+    trace->num_ids = trace->file.num_ids;
+    trace->num_ops = trace->file.num_ops;
+    trace->weight = trace->file.weight;               /* not used */
+    trace->ops = trace->file.ops;
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = 
@@ -515,53 +944,17 @@ static trace_t *read_trace(char *tracedir, char *filename)
 	 (size_t *)malloc(trace->num_ids * sizeof(size_t))) == NULL)
 	unix_error("malloc 4 failed in read_trace");
     
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF) {
-	switch(type[0]) {
-	case 'a':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = ALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'r':
-	    fscanf(tracefile, "%u %u", &index, &size);
-	    trace->ops[op_index].type = REALLOC;
-	    trace->ops[op_index].index = index;
-	    trace->ops[op_index].size = size;
-	    max_index = (index > max_index) ? index : max_index;
-	    break;
-	case 'f':
-	    fscanf(tracefile, "%ud", &index);
-	    trace->ops[op_index].type = FREE;
-	    trace->ops[op_index].index = index;
-	    break;
-	default:
-	    printf("Bogus type character (%c) in tracefile %s\n", 
-		   type[0], path);
-	    exit(1);
-	}
-	op_index++;
-	
-    }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
-    
     return trace;
 }
 
 /*
- * free_trace - Free the trace record and the three arrays it points
- *              to, all of which were allocated in read_trace().
+ * free_trace - Free the trace record, its ops and the two block
+ *              arrays, all of which were set up in read_trace().
  */
 void free_trace(trace_t *trace)
 {
-    free(trace->ops);         /* free the three arrays... */
-    free(trace->blocks);      
+    trace_unload(&trace->file); /* unmap or free the ops... */
+    free(trace->blocks);      /* ... the two block arrays... */
     free(trace->block_sizes);
     free(trace);              /* and the trace record itself... */
 }
@@ -653,7 +1046,7 @@ static int eval_mm_valid(trace_t *trace, int tracenum, range_t **ranges)
 	    oldsize = trace->block_sizes[index];
 	    if (size < oldsize) oldsize = size;
 	    for (j = 0; j < oldsize; j++) {
-	      if (newp[j] != (index & 0xFF)) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
 		malloc_error(tracenum, i, "mm_realloc did not preserve the "
 			     "data from old block");
 		return 0;
@@ -826,68 +1219,662 @@ static void eval_mm_speed(void *ptr)
 }
 
 /*
- * eval_libc_valid - We run this function to make sure that the
- *    libc malloc can run to completion on the set of traces.
- *    We'll be conservative and terminate if any libc malloc call fails.
- *
+ * eval_mm_trace - Check the mm malloc package on a trace, and measure 
+ *    its utilization and speed there
  */
-static int eval_libc_valid(trace_t *trace, int tracenum)
+static void eval_mm_trace(char *name, int tracenum, stats_t *stats)
 {
-    int i, newsize;
-    char *p, *newp, *oldp;
+    trace_t *trace;
+    range_t *ranges = NULL;  /* keeps track of block extents */
+    speed_t speed_params;    /* input parameters to the xx_speed routines */
+    char path[MAXLINE];      /* trace being streamed (-S) */
+    double secs;
+    int i;
+
+    if (stream) {
+	strcpy(path, tracedir);
+	strcat(path, name);
+	if (verbose > 1)
+	    printf("Streaming tracefile: %s\n", name);
+	stats->valid = eval_mm_stream_valid(path, tracenum, &ranges, stats);
+	if (stats->valid) {
+	    for (i = 0; i < STREAM_RUNS; i++)
+		if ((secs = eval_mm_stream_speed(path)) < stats->secs || i == 0)
+		    stats->secs = secs;
+	}
+	clear_ranges(&ranges);
+	return;
+    }
+    trace = read_trace(tracedir, name);
+    stats->ops = trace->num_ops;
+    if (verbose > 1)
+	printf("Checking mm_malloc for correctness, ");
+    stats->valid = eval_mm_valid(trace, tracenum, &ranges);
+    if (stats->valid) {
+	if (verbose > 1)
+	    printf("efficiency, ");
+	stats->util = eval_mm_util(trace, tracenum, &ranges);
+	speed_params.trace = trace;
+	speed_params.ranges = ranges;
+	if (verbose > 1)
+	    printf("and performance.\n");
+	stats->secs = fsecs(eval_mm_speed, &speed_params);
+    }
+    clear_ranges(&ranges);
+    free_trace(trace);
+}
+
+/*
+ * eval_mm_parallel - Evaluate the traces as eval_mm_trace does, in 
+ *    up to jobs forked worker processes. Worker w is pinned to the 
+ *    w-th CPU mdriver may run on, there are no more workers than such 
+ *    CPUs, and each has its own copy of the simulated heap, so the 
+ *    workers' timings don't disturb each other beyond what they share 
+ *    in the caches and memory. A worker that fails leaves the traces it 
+ *    took invalid, and counts as an error.
+ */
+static void eval_mm_parallel(char **tracefiles, int n, stats_t *stats)
+{
+    par_t *par;
+    size_t len = sizeof(par_t) + n * sizeof(stats_t);
+    cpu_set_t allowed, one;
+    int w, i, cpu, ncpus, status, nworkers = (jobs < n) ? jobs : n;
+    int forked_errors = errors;  /* what each worker inherits */
+    pid_t pid;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+	nworkers = 1;
+    else if ((ncpus = CPU_COUNT(&allowed)) < nworkers)
+	nworkers = ncpus;
+    if (nworkers < 2) {
+	for (i = 0; i < n; i++)
+	    eval_mm_trace(tracefiles[i], i, &stats[i]);
+	return;
+    }
+
+    par = mmap(NULL, len, PROT_READ | PROT_WRITE, 
+	       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (par == MAP_FAILED)
+	unix_error("mmap failed in eval_mm_parallel");
+
+    fflush(stdout);              /* or the workers print it again */
+    for (w = 0; w < nworkers; w++) {
+	if ((pid = fork()) < 0)
+	    unix_error("fork failed in eval_mm_parallel");
+	if (pid > 0)
+	    continue;
+
+	/* The worker: pin it, then take traces until none are left */
+	for (cpu = 0, i = w; ; cpu++)
+	    if (CPU_ISSET(cpu, &allowed) && i-- == 0)
+		break;
+	CPU_ZERO(&one);
+	CPU_SET(cpu, &one);
+	sched_setaffinity(0, sizeof(one), &one);
+	while ((i = __atomic_fetch_add(&par->next, 1, __ATOMIC_RELAXED)) < n)
+	    eval_mm_trace(tracefiles[i], i, &par->stats[i]);
+	__atomic_fetch_add(&par->errors, errors - forked_errors, __ATOMIC_RELAXED);
+	fflush(stdout);
+	_exit(0);
+    }
+
+    while ((pid = wait(&status)) > 0 || (pid < 0 && errno == EINTR))
+	if (pid > 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+	    printf("ERROR: worker %d failed (status 0x%x)\n", (int)pid, status);
+	    errors++;
+	}
+    errors += par->errors;
+    memcpy(stats, par->stats, n * sizeof(stats_t));
+    munmap(par, len);
+}
+
+/* lat_size - The size class of a request for size bytes */
+static int lat_size(size_t size)
+{
+    int c;
+
+    for (c = 0; c < LAT_SIZES - 1 && size >= (size_t)64 << (3 * c); c++)
+	;
+    return c;
+}
+
+/*
+ * eval_latency - Replay a trace once on a backend, timing each request
+ *    on its own with the tick counter, into histograms by op type and 
+ *    size class (of the new size for a realloc, of the block for a 
+ *    free). The trace has already been checked on the backend.
+ */
+static void eval_latency(backend_t *b, trace_t *trace, latency_t *lat)
+{
+    int i, j, index, size;
+    char *p;
+    uint64_t t0, t1;
+
+    for (i = 0; i < 3; i++)
+	for (j = 0; j < LAT_SIZES; j++)
+	    lat_reset(&lat->h[i][j]);
+
+    if (b->init != NULL && b->init(b) < 0) 
+	app_error("init failed in eval_latency");
 
     for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
         switch (trace->ops[i].type) {
 
         case ALLOC: /* malloc */
-	    if ((p = malloc(trace->ops[i].size)) == NULL) {
-		malloc_error(tracenum, i, "libc malloc failed");
-		unix_error("System message");
+	    t0 = lat_ticks();
+	    p = b->malloc(size);
+	    t1 = lat_ticks();
+            if (p == NULL)
+		app_error("malloc error in eval_latency");
+	    lat_record(&lat->h[ALLOC][lat_size(size)], t0, t1);
+            trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+            break;
+
+	case REALLOC: /* realloc */
+	    t0 = lat_ticks();
+	    p = b->realloc(trace->blocks[index], size);
+	    t1 = lat_ticks();
+            if (p == NULL)
+		app_error("realloc error in eval_latency");
+	    lat_record(&lat->h[REALLOC][lat_size(size)], t0, t1);
+            trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+            break;
+
+        case FREE: /* free */
+	    p = trace->blocks[index];
+	    t0 = lat_ticks();
+            b->free(p);
+	    t1 = lat_ticks();
+	    lat_record(&lat->h[FREE][lat_size(trace->block_sizes[index])], 
+		       t0, t1);
+            break;
+
+	default:
+	    app_error("Nonexistent request type in eval_latency");
+        }
+    }
+}
+
+/*
+ * print_latency - Print p50/p99/p99.9/max for each op type of a trace,
+ *    over all sizes and then by size class
+ */
+static void print_latency(char *name, latency_t *lat)
+{
+    static char *types[3] = {"malloc", "free", "realloc"};
+    static char *sizes[LAT_SIZES] = {"<64", "<512", "<4K", "<32K", ">=32K"};
+    lat_hist_t all;
+    int i, j;
+
+    printf("%s:\n", name);
+    printf("%-8s%7s%10s%8s%8s%8s%10s\n", 
+	   "op", "size", "ops", "p50", "p99", "p99.9", "max");
+    for (i = 0; i < 3; i++) {
+	lat_reset(&all);
+	for (j = 0; j < LAT_SIZES; j++)
+	    lat_merge(&all, &lat->h[i][j]);
+	if (all.n == 0)
+	    continue;
+	for (j = -1; j < LAT_SIZES; j++) {
+	    lat_hist_t *h = (j < 0) ? &all : &lat->h[i][j];
+
+	    if (h->n == 0)
+		continue;
+	    printf("%-8s%7s%10lu%8.0f%8.0f%8.0f%10.0f\n", 
+		   (j < 0) ? types[i] : "", (j < 0) ? "all" : sizes[j], 
+		   (unsigned long)h->n, lat_percentile(h, 50), 
+		   lat_percentile(h, 99), lat_percentile(h, 99.9), 
+		   lat_percentile(h, 100));
+	}
+    }
+}
+
+/*
+ * eval_mm_stream_valid - Check the mm malloc package for correctness 
+ *    and measure its space utilization in one pass over a streamed 
+ *    trace. The checks are those of eval_mm_valid, the utilization 
+ *    that of eval_mm_util. Sets stats->ops and stats->util.
+ */
+static int eval_mm_stream_valid(char *path, int tracenum, range_t **ranges,
+				stats_t *stats)
+{
+    trace_stream_t *ts;
+    trace_file_t tf;
+    trace_op_t *ops;
+    idmap_t live;
+    live_t *e;
+    int i, j, n, index, size, oldsize, opnum = 0, valid = 0;
+    long long total_size = 0, max_total_size = 0;
+    char *p, *newp;
+
+    if ((ts = trace_stream_open(path, &tf)) == NULL) {
+	sprintf(msg, "Could not open %s in eval_mm_stream_valid", path);
+	unix_error(msg);
+    }
+    stats->ops = tf.num_ops;
+    idmap_init(&live);
+
+    /* Reset the heap and free any records in the range list */
+    mem_reset_brk();
+    clear_ranges(ranges);
+    if (mm_init() < 0) {
+	malloc_error(tracenum, 0, "mm_init failed.");
+	goto out;
+    }
+
+    while ((n = trace_stream_next(ts, &ops)) > 0) {
+	for (i = 0;  i < n;  i++, opnum++) {
+	    index = ops[i].index;
+	    size = ops[i].size;
+
+	    switch (ops[i].type) {
+
+	    case ALLOC: /* mm_malloc */
+		if ((p = mm_malloc(size)) == NULL) {
+		    malloc_error(tracenum, opnum, "mm_malloc failed.");
+		    goto out;
+		}
+		if (add_range(ranges, p, size, tracenum, opnum) == 0)
+		    goto out;
+		memset(p, index & 0xFF, size);
+		e = idmap_put(&live, index);
+		e->p = p;
+		e->size = size;
+		total_size += size;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		e = idmap_put(&live, index);
+		if ((newp = mm_realloc(e->p, size)) == NULL) {
+		    malloc_error(tracenum, opnum, "mm_realloc failed.");
+		    goto out;
+		}
+		remove_range(ranges, e->p);
+		if (add_range(ranges, newp, size, tracenum, opnum) == 0)
+		    goto out;
+		oldsize = (size < e->size) ? size : e->size;
+		for (j = 0; j < oldsize; j++) {
+		    if ((unsigned char)newp[j] != (index & 0xFF)) {
+			malloc_error(tracenum, opnum, "mm_realloc did not "
+				     "preserve the data from old block");
+			goto out;
+		    }
+		}
+		memset(newp, index & 0xFF, size);
+		total_size += size - e->size;
+		e->p = newp;
+		e->size = size;
+		break;
+
+	    case FREE: /* mm_free */
+		if ((e = idmap_get(&live, index)) == NULL)
+		    break;      /* free of a block that is not live */
+		remove_range(ranges, e->p);
+		mm_free(e->p);
+		total_size -= e->size;
+		idmap_del(&live, e);
+		break;
+
+	    default:
+		app_error("Nonexistent request type in eval_mm_stream_valid");
 	    }
-	    trace->blocks[trace->ops[i].index] = p;
+	    if (total_size > max_total_size)
+		max_total_size = total_size;
+	}
+    }
+    if (n < 0) {
+	sprintf(msg, "Malformed trace %s", path);
+	app_error(msg);
+    }
+    if (opnum != tf.num_ops) {
+	sprintf(msg, "Trace %s has %d requests, header says %d",
+		path, opnum, tf.num_ops);
+	app_error(msg);
+    }
+
+    stats->util = (double)max_total_size / (double)mem_heapsize();
+    valid = 1;
+ out:
+    idmap_free(&live);
+    trace_stream_close(ts);
+    return valid;
+}
+
+/*
+ * eval_mm_stream_speed - eval_mm_speed for a streamed trace. The trace 
+ *    is read again on each run, by the stream's reader thread while the 
+ *    mm package replays the previous chunk, so fcyc() would time the 
+ *    reading too: only the replay of each chunk is timed, with the tick 
+ *    counter. Returns the seconds spent replaying.
+ */
+static double eval_mm_stream_speed(char *path)
+{
+    trace_stream_t *ts;
+    trace_file_t tf;
+    trace_op_t *ops;
+    idmap_t live;
+    live_t *e;
+    int i, n;
+    char *p;
+    uint64_t t0, ticks = 0;
+
+    if ((ts = trace_stream_open(path, &tf)) == NULL)
+	unix_error("trace_stream_open failed in eval_mm_stream_speed");
+    idmap_init(&live);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_stream_speed");
+
+    while ((n = trace_stream_next(ts, &ops)) > 0) {
+	t0 = lat_ticks();
+	for (i = 0;  i < n;  i++)
+	    switch (ops[i].type) {
+
+	    case ALLOC: /* mm_malloc */
+		if ((p = mm_malloc(ops[i].size)) == NULL)
+		    app_error("mm_malloc error in eval_mm_stream_speed");
+		idmap_put(&live, ops[i].index)->p = p;
+		break;
+
+	    case REALLOC: /* mm_realloc */
+		e = idmap_put(&live, ops[i].index);
+		if ((p = mm_realloc(e->p, ops[i].size)) == NULL)
+		    app_error("mm_realloc error in eval_mm_stream_speed");
+		e->p = p;
+		break;
+
+	    case FREE: /* mm_free */
+		if ((e = idmap_get(&live, ops[i].index)) != NULL) {
+		    mm_free(e->p);
+		    idmap_del(&live, e);
+		}
+		break;
+
+	    default:
+		app_error("Nonexistent request type in eval_mm_stream_speed");
+	    }
+	ticks += lat_ticks() - t0;
+    }
+
+    idmap_free(&live);
+    trace_stream_close(ts);
+    return ticks * lat_ns_per_tick / 1e9;
+}
+
+/*
+ * eval_mm_mt - Replay a thread-tagged trace on 1, 2, 4 ... max_threads 
+ *    threads and print the throughput and the mean time per request 
+ *    seen by a thread at each thread count. There are no more replay 
+ *    threads than threads in the trace: the rest would sit idle, and 
+ *    count in the time per request without making any. With -L, each 
+ *    thread count is replayed once more with every request timed, and 
+ *    the latency percentiles of all the threads' requests are added.
+ */
+static void eval_mm_mt(trace_t *trace, char *name, int max_threads)
+{
+    mt_t mt;
+    lat_hist_t *hist = NULL, all;
+    int i, k, *count;
+    double secs;
+
+    /* Number each op among the ops on its block */
+    if ((mt.seq = malloc(trace->num_ops * sizeof(int))) == NULL ||
+	(mt.done = malloc(trace->num_ids * sizeof(int))) == NULL ||
+	(count = calloc(trace->num_ids, sizeof(int))) == NULL)
+	unix_error("malloc failed in eval_mm_mt");
+    for (i = 0; i < trace->num_ops; i++)
+	mt.seq[i] = count[trace->ops[i].index]++;
+    free(count);
+    mt.trace = trace;
+    mt.hist = NULL;
+    if (max_threads > trace->file.num_threads && trace->file.num_threads > 0)
+	max_threads = trace->file.num_threads;
+    if (latency && (hist = malloc(max_threads * sizeof(lat_hist_t))) == NULL)
+	unix_error("malloc failed in eval_mm_mt");
+
+    printf("%s (%d threads in trace):\n", name, trace->file.num_threads);
+    printf("%8s%10s%8s%10s", "threads", "secs", "Kops", "ns/op");
+    if (hist != NULL)
+	printf("%8s%8s%8s%10s", "p50", "p99", "p99.9", "max");
+    printf("\n");
+    mem_threads(1);
+    for (k = 1; ; k = (2 * k < max_threads) ? 2 * k : max_threads) {
+	mt.nthreads = k;
+	secs = fsecs(eval_mm_mt_speed, &mt);
+	printf("%8d%10.6f%8.0f%10.0f", k, secs,
+	       (trace->num_ops / 1e3) / secs, secs * k * 1e9 / trace->num_ops);
+	if (hist != NULL) {
+	    for (i = 0; i < k; i++)
+		lat_reset(&hist[i]);
+	    mt.hist = hist;
+	    eval_mm_mt_speed(&mt);
+	    mt.hist = NULL;
+	    lat_reset(&all);
+	    for (i = 0; i < k; i++)
+		lat_merge(&all, &hist[i]);
+	    printf("%8.0f%8.0f%8.0f%10.0f", lat_percentile(&all, 50),
+		   lat_percentile(&all, 99), lat_percentile(&all, 99.9),
+		   lat_percentile(&all, 100));
+	}
+	printf("\n");
+	if (k == max_threads)
 	    break;
+    }
+    mem_threads(0);
+    free(hist);
+    free(mt.seq);
+    free(mt.done);
+}
 
-	case REALLOC: /* realloc */
-            newsize = trace->ops[i].size;
-	    oldp = trace->blocks[trace->ops[i].index];
-	    if ((newp = realloc(oldp, newsize)) == NULL) {
-		malloc_error(tracenum, i, "libc realloc failed");
-		unix_error("System message");
+/*
+ * eval_mm_mt_speed - Run one multi-threaded replay, timed by fcyc()
+ */
+static void eval_mm_mt_speed(void *ptr)
+{
+    mt_t *mt = ptr;
+    pthread_t tids[mt->nthreads];
+    mt_arg_t args[mt->nthreads];
+    int i;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (mm_init() < 0) 
+	app_error("mm_init failed in eval_mm_mt_speed");
+    memset(mt->done, 0, mt->trace->num_ids * sizeof(int));
+
+    for (i = 0; i < mt->nthreads; i++) {
+	args[i].mt = mt;
+	args[i].me = i;
+	if (pthread_create(&tids[i], NULL, mt_replay, &args[i]) != 0)
+	    unix_error("pthread_create failed in eval_mm_mt_speed");
+    }
+    for (i = 0; i < mt->nthreads; i++)
+	pthread_join(tids[i], NULL);
+}
+
+/*
+ * mt_replay - Body of a replay thread: run the ops of the trace threads 
+ *    mapped to it, each after the ops before it on the same block, and 
+ *    time each op into the thread's own histogram if there are any
+ */
+static void *mt_replay(void *ptr)
+{
+    mt_t *mt = ((mt_arg_t *)ptr)->mt;
+    int me = ((mt_arg_t *)ptr)->me;
+    trace_t *trace = mt->trace;
+    lat_hist_t *h = (mt->hist != NULL) ? &mt->hist[me] : NULL;
+    trace_op_t *op;
+    uint64_t t0 = 0;
+    char *p;
+    int i;
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	op = &trace->ops[i];
+	if (op->tid % mt->nthreads != me)
+	    continue;
+
+	/* Wait for the previous op on this block, if another thread has it */
+	while (__atomic_load_n(&mt->done[op->index], __ATOMIC_ACQUIRE) != mt->seq[i])
+	    sched_yield();
+
+	if (h != NULL)
+	    t0 = lat_ticks();
+	switch (op->type) {
+
+	case ALLOC: /* mm_malloc */
+	    if ((p = mm_malloc(op->size)) == NULL)
+		app_error("mm_malloc error in mt_replay");
+	    trace->blocks[op->index] = p;
+	    break;
+
+	case REALLOC: /* mm_realloc */
+	    if ((p = mm_realloc(trace->blocks[op->index], op->size)) == NULL)
+		app_error("mm_realloc error in mt_replay");
+	    trace->blocks[op->index] = p;
+	    break;
+
+	case FREE: /* mm_free */
+	    mm_free(trace->blocks[op->index]);
+	    break;
+
+	default:
+	    app_error("Nonexistent request type in mt_replay");
+	}
+	if (h != NULL)
+	    lat_record(h, t0, lat_ticks());
+	__atomic_store_n(&mt->done[op->index], mt->seq[i] + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * eval_backend_valid - Check that a backend runs a trace to completion
+ *    and measure its space utilization on the way. Each block must be
+ *    aligned and hold its size (as far as the backend can tell), and a
+ *    realloc must preserve the data of the block, as in eval_mm_valid;
+ *    blocks aren't checked for overlap, which needs to know where the
+ *    heap is. Utilization is the peak of the payload bytes live over
+ *    the peak of the footprint. A backend that can't be reset keeps
+ *    what earlier traces left in its footprint, so its utilization is 
+ *    only a lower bound; a footprint smaller than the payload can't be 
+ *    trusted, and leaves the utilization unknown. Sets stats->ops and 
+ *    stats->util.
+ */
+static int eval_backend_valid(backend_t *b, trace_t *trace, int tracenum,
+			      stats_t *stats)
+{
+    int i, j, index, size, oldsize;
+    char *p, *newp;
+    size_t total = 0, max_total = 0, peak = 0, foot;
+
+    stats->ops = trace->num_ops;
+    stats->util = -1;
+    if (b->init != NULL && b->init(b) < 0) {
+	malloc_error(tracenum, 0, "init failed.");
+	return 0;
+    }
+
+    for (i = 0;  i < trace->num_ops;  i++) {
+	index = trace->ops[i].index;
+	size = trace->ops[i].size;
+
+        switch (trace->ops[i].type) {
+
+        case ALLOC: /* malloc */
+	    if ((p = b->malloc(size)) == NULL) {
+		malloc_error(tracenum, i, "malloc failed.");
+		return 0;
 	    }
-	    trace->blocks[trace->ops[i].index] = newp;
+	    if (!IS_ALIGNED(p)) {
+		malloc_error(tracenum, i, "Payload address is not aligned.");
+		return 0;
+	    }
+	    if (b->usable_size != NULL && b->usable_size(p) < (size_t)size) {
+		malloc_error(tracenum, i, "Payload is smaller than requested.");
+		return 0;
+	    }
+	    memset(p, index & 0xFF, size);
+	    trace->blocks[index] = p;
+	    trace->block_sizes[index] = size;
+	    total += size;
 	    break;
-	    
+
+        case REALLOC: /* realloc */
+	    if ((newp = b->realloc(trace->blocks[index], size)) == NULL) {
+		malloc_error(tracenum, i, "realloc failed.");
+		return 0;
+	    }
+	    if (!IS_ALIGNED(newp)) {
+		malloc_error(tracenum, i, "Payload address is not aligned.");
+		return 0;
+	    }
+	    if (b->usable_size != NULL && b->usable_size(newp) < (size_t)size) {
+		malloc_error(tracenum, i, "Payload is smaller than requested.");
+		return 0;
+	    }
+	    oldsize = trace->block_sizes[index];
+	    total += size - oldsize;
+	    if (size < oldsize) oldsize = size;
+	    for (j = 0; j < oldsize; j++) {
+	      if ((unsigned char)newp[j] != (index & 0xFF)) {
+		malloc_error(tracenum, i, "realloc did not preserve the "
+			     "data from old block");
+		return 0;
+	      }
+	    }
+	    memset(newp, index & 0xFF, size);
+	    trace->blocks[index] = newp;
+	    trace->block_sizes[index] = size;
+	    break;
+
         case FREE: /* free */
-	    free(trace->blocks[trace->ops[i].index]);
+	    b->free(trace->blocks[index]);
+	    total -= trace->block_sizes[index];
 	    break;
 
 	default:
-	    app_error("invalid operation type  in eval_libc_valid");
+	    app_error("Nonexistent request type in eval_backend_valid");
 	}
+
+	if (total > max_total)
+	    max_total = total;
+	if (b->footprint != NULL && (foot = b->footprint()) > peak)
+	    peak = foot;
     }
 
+    if (b->footprint != NULL && peak >= max_total && peak > 0)
+	stats->util = (double)max_total / peak;
     return 1;
 }
 
-/* 
- * eval_libc_speed - This is the function that is used by fcyc() to
- *    measure the running time of the libc malloc package on the set
- *    of traces.
+/*
+ * eval_backend_speed - This is the function that is used by fcyc() to
+ *    measure the running time of a backend on a trace.
  */
-static void eval_libc_speed(void *ptr)
+static void eval_backend_speed(void *ptr)
 {
     int i;
     int index, size, newsize;
     char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
+    backend_t *b = ((speed_t *)ptr)->backend;
+
+    if (b->init != NULL && b->init(b) < 0)
+	app_error("init failed in eval_backend_speed");
 
     for (i = 0;  i < trace->num_ops;  i++) {
         switch (trace->ops[i].type) {
         case ALLOC: /* malloc */
 	    index = trace->ops[i].index;
 	    size = trace->ops[i].size;
-	    if ((p = malloc(size)) == NULL)
-		unix_error("malloc failed in eval_libc_speed");
+	    if ((p = b->malloc(size)) == NULL)
+		unix_error("malloc failed in eval_backend_speed");
 	    trace->blocks[index] = p;
 	    break;
 
@@ -895,21 +1882,155 @@ static void eval_libc_speed(void *ptr)
 	    index = trace->ops[i].index;
 	    newsize = trace->ops[i].size;
 	    oldp = trace->blocks[index];
-	    if ((newp = realloc(oldp, newsize)) == NULL)
-		unix_error("realloc failed in eval_libc_speed\n");
-	    
+	    if ((newp = b->realloc(oldp, newsize)) == NULL)
+		unix_error("realloc failed in eval_backend_speed");
+
 	    trace->blocks[index] = newp;
 	    break;
-	    
+
         case FREE: /* free */
 	    index = trace->ops[i].index;
 	    block = trace->blocks[index];
-	    free(block);
+	    b->free(block);
 	    break;
 	}
     }
 }
 
+/*
+ * print_json_string - Print s as a quoted JSON string
+ */
+static void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++) {
+	if (*s == '"' || *s == '\\')
+	    printf("\\%c", *s);
+	else if ((unsigned char)*s < 0x20)
+	    printf("\\u%04x", (unsigned char)*s);
+	else
+	    putchar(*s);
+    }
+    putchar('"');
+}
+
+/*
+ * eval_backends - Run each trace on each backend (-B): check it and
+ *    measure its utilization, throughput and request latency, and
+ *    print one row per backend and trace as a table, CSV or JSON.
+ */
+static void eval_backends(backend_t *backends, int nbackends,
+			  char **tracefiles, int num_tracefiles, int format)
+{
+    int i, j, k, l, row = 0;
+    trace_t *trace;
+    stats_t stats;
+    speed_t speed_params;
+    latency_t *lat;
+    lat_hist_t all;
+    double kops, p50, p99, p999, max;
+
+    if ((lat = malloc(sizeof(latency_t))) == NULL)
+	unix_error("malloc failed in eval_backends");
+    lat_calibrate();
+
+    if (format == FMT_TABLE)
+	printf("%-16s%-24s%6s%6s%9s%11s%8s%8s%8s%8s%10s\n", "backend", "trace",
+	       "valid", "util", "ops", "secs", "Kops",
+	       "p50", "p99", "p99.9", "max");
+    else if (format == FMT_CSV)
+	printf("backend,trace,valid,ops,secs,kops,util,"
+	       "p50_ns,p99_ns,p999_ns,max_ns\n");
+    else
+	printf("[");
+
+    for (i = 0; i < nbackends; i++) {
+	for (j = 0; j < num_tracefiles; j++, row++) {
+	    trace = read_trace(tracedir, tracefiles[j]);
+	    memset(&stats, 0, sizeof(stats));
+	    if (verbose > 1)
+		printf("Checking %s on %s\n", backends[i].name, tracefiles[j]);
+	    stats.valid = eval_backend_valid(&backends[i], trace, j, &stats);
+	    kops = p50 = p99 = p999 = max = 0;
+	    if (stats.valid) {
+		speed_params.trace = trace;
+		speed_params.backend = &backends[i];
+		stats.secs = fsecs(eval_backend_speed, &speed_params);
+		kops = (stats.ops / 1e3) / stats.secs;
+		eval_latency(&backends[i], trace, lat);
+		lat_reset(&all);
+		for (k = 0; k < 3; k++)
+		    for (l = 0; l < LAT_SIZES; l++)
+			lat_merge(&all, &lat->h[k][l]);
+		p50 = lat_percentile(&all, 50);
+		p99 = lat_percentile(&all, 99);
+		p999 = lat_percentile(&all, 99.9);
+		max = lat_percentile(&all, 100);
+	    }
+	    free_trace(trace);
+
+	    switch (format) {
+	    case FMT_TABLE:
+		printf("%-16s%-24s%6s", backends[i].name, tracefiles[j],
+		       stats.valid ? "yes" : "no");
+		if (!stats.valid) {
+		    printf("%6s%9.0f%11s%8s%8s%8s%8s%10s\n", "-", stats.ops,
+			   "-", "-", "-", "-", "-", "-");
+		    break;
+		}
+		if (stats.util < 0)
+		    printf("%6s", "-");
+		else
+		    printf("%5.0f%%", stats.util * 100.0);
+		printf("%9.0f%11.6f%8.0f%8.0f%8.0f%8.0f%10.0f\n",
+		       stats.ops, stats.secs, kops, p50, p99, p999, max);
+		break;
+
+	    case FMT_CSV: /* fields of an invalid run, and an unknown util, are empty */
+		printf("%s,%s,%d,%.0f", backends[i].name, tracefiles[j],
+		       stats.valid, stats.ops);
+		if (!stats.valid) {
+		    printf(",,,,,,,\n");
+		    break;
+		}
+		printf(",%.6f,%.1f,", stats.secs, kops);
+		if (stats.util >= 0)
+		    printf("%.4f", stats.util);
+		printf(",%.0f,%.0f,%.0f,%.0f\n", p50, p99, p999, max);
+		break;
+
+	    case FMT_JSON: /* ... and null */
+		printf("%s\n  {\"backend\": ", row ? "," : "");
+		print_json_string(backends[i].name);
+		printf(", \"trace\": ");
+		print_json_string(tracefiles[j]);
+		printf(", \"valid\": %s, \"ops\": %.0f",
+		       stats.valid ? "true" : "false", stats.ops);
+		if (!stats.valid) {
+		    printf(", \"secs\": null, \"kops\": null, \"util\": null, "
+			   "\"p50_ns\": null, \"p99_ns\": null, "
+			   "\"p999_ns\": null, \"max_ns\": null}");
+		    break;
+		}
+		printf(", \"secs\": %.6f, \"kops\": %.1f, \"util\": ",
+		       stats.secs, kops);
+		if (stats.util < 0)
+		    printf("null");
+		else
+		    printf("%.4f", stats.util);
+		printf(", \"p50_ns\": %.0f, \"p99_ns\": %.0f, "
+		       "\"p999_ns\": %.0f, \"max_ns\": %.0f}",
+		       p50, p99, p999, max);
+		break;
+	    }
+	}
+    }
+
+    if (format == FMT_JSON)
+	printf("\n]\n");
+    free(lat);
+}
+
 /*************************************
  * Some miscellaneous helper routines
  ************************************/
@@ -1004,13 +2125,23 @@ void malloc_error(int tracenum, int opnum, char *msg)
  */
 static void usage(void) 
 {
-    fprintf(stderr, "Usage: mdriver [-hvVal] [-f <file>] [-t <dir>]\n");
+    fprintf(stderr, "Usage: mdriver [-hvValLS] [-f <file>] [-t <dir>] [-o <policy>] [-T <n>] [-j <n>] [-p <heapfile>] [-s <shmname>] [-B <backend> ... [-F <fmt>]]\n");
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-a         Don't check the team structure.\n");
+    fprintf(stderr, "\t-B <spec>  Compare this backend instead, repeatable: mm, mm-lifo,\n");
+    fprintf(stderr, "\t           mm-address, mm-best, small, libc or a <path>.so.\n");
+    fprintf(stderr, "\t-F <fmt>   Print the comparison as table (default), csv or json.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file.\n");
     fprintf(stderr, "\t-g         Generate summary info for autograder.\n");
     fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate the traces in <n> processes, one per CPU.\n");
+    fprintf(stderr, "\t-L         Report per-request latency percentiles (per thread count with -T).\n");
     fprintf(stderr, "\t-l         Run libc malloc as well.\n");
+    fprintf(stderr, "\t-o <pol>   Free block policy: lifo (default), address or best.\n");
+    fprintf(stderr, "\t-p <file>  Map the heap from <file> instead of malloc.\n");
+    fprintf(stderr, "\t-S         Stream the traces through mm malloc instead of loading them.\n");
+    fprintf(stderr, "\t-s <name>  Map the heap from shared memory object <name>.\n");
+    fprintf(stderr, "\t-T <n>     Also replay on 1, 2, 4 ... <n> threads, up to the trace's own.\n");
     fprintf(stderr, "\t-t <dir>   Directory to find default traces.\n");
     fprintf(stderr, "\t-v         Print per-trace performance breakdowns.\n");
     fprintf(stderr, "\t-V         Print additional debug info.\n");
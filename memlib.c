@@ -2,6 +2,11 @@
  * memlib.c - a module that simulates the memory system.  Needed because it 
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
+ *
+ * Each simulated heap is a region with its own brk. The mem_* functions
+ * work on the default region set up by mem_init (or mem_init_file or
+ * mem_init_shm); mem_region_create makes further, independent regions
+ * that are released in one step by mem_region_destroy.
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,28 +15,211 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 #include "memlib.h"
 #include "config.h"
 
+#define MEM_MAGIC   0x4d4d4850  /* "MMHP" tags a heap file */
+#define MEM_VERSION 1
+
+/* 
+ * Header kept in the first page of a mapped heap. Only offsets are
+ * stored so the heap can be mapped back in at a different address.
+ */
+typedef struct {
+    unsigned int magic;      /* MEM_MAGIC once the file is initialized */
+    unsigned int version;    /* MEM_VERSION */
+    size_t max_heap;         /* size of the heap area in bytes */
+    size_t brk;              /* offset of brk from the first heap byte */
+    pthread_mutex_t lock;    /* process-shared lock, shared memory heaps only */
+} mem_hdr_t;
+
+/* A simulated heap and its brk */
+struct mem_region {
+    char *start_brk;         /* points to first byte of heap */
+    char *brk;               /* points to last byte of heap */
+    char *max_addr;          /* largest legal heap address-max VA */ 
+    mem_hdr_t *hdr;          /* header of a file or shm heap, NULL otherwise */
+    void *map;               /* start of the mapping, NULL if malloc'd */
+    size_t map_size;         /* bytes mapped at map */
+    int shared;              /* set if other processes map the heap too */
+    pthread_mutex_t lock;    /* lock of an unshared region, see mem_threads */
+};
+
 /* private variables */
-static char *mem_start_brk;  /* points to first byte of heap */
-static char *mem_brk;        /* points to last byte of heap */
-static char *mem_max_addr;   /* largest legal heap address-max VA */ 
+static mem_region_t mem_default;  /* the region behind the mem_* functions */
+static int mem_threaded;          /* unshared regions are locked as well */
 
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
+    mem_region_t *r = &mem_default;
+
     /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
+    if ((r->start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
 	fprintf(stderr, "mem_init_vm: malloc error\n");
 	exit(1);
     }
 
-    mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
-    mem_brk = mem_start_brk;                  /* heap is empty initially */
+    r->max_addr = r->start_brk + MAX_HEAP;  /* max legal heap address */
+    r->brk = r->start_brk;                  /* heap is empty initially */
+    pthread_mutex_init(&r->lock, NULL);
+}
+
+/*
+ * mem_map - map the header and heap area from fd, which must refer to
+ *    a regular file or a shared memory object. If create is set the
+ *    object is sized and given an empty heap, otherwise the existing
+ *    heap is validated and mapped back in. A shared heap gets a
+ *    process-shared lock in its header; processes attaching to it wait
+ *    until the creator has published the header. Returns 0 on success
+ *    and -1 on error. fd is closed in all cases.
+ */
+static int mem_map(int fd, const char *name, int create, int shared)
+{
+    mem_region_t *r = &mem_default;
+    mem_hdr_t *hdr;
+    struct stat st;
+    size_t hdrsize = mem_pagesize();
+    pthread_mutexattr_t attr;
+    int tries;
+    void *base;
+
+    r->map_size = hdrsize + MAX_HEAP;
+    if (create && ftruncate(fd, r->map_size) < 0) {
+	close(fd);
+	return -1;
+    }
+
+    /* An attaching process may get here before the creator sized the object */
+    for (tries = 0; !create; tries++) {
+	if (fstat(fd, &st) < 0) {
+	    close(fd);
+	    return -1;
+	}
+	if ((size_t)st.st_size == r->map_size)
+	    break;
+	if (!shared || tries == 1000) {
+	    fprintf(stderr, "mem_map: %s is not a heap of this size\n", name);
+	    close(fd);
+	    return -1;
+	}
+	usleep(1000);
+    }
+
+    base = mmap(NULL, r->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);                  /* the mapping keeps the object referenced */
+    if (base == MAP_FAILED)
+	return -1;
+    hdr = (mem_hdr_t *)base;
+
+    if (create) {
+	hdr->version = MEM_VERSION;
+	hdr->max_heap = MAX_HEAP;
+	hdr->brk = 0;
+	if (shared) {
+	    pthread_mutexattr_init(&attr);
+	    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	    pthread_mutex_init(&hdr->lock, &attr);
+	    pthread_mutexattr_destroy(&attr);
+	}
+	__atomic_store_n(&hdr->magic, MEM_MAGIC, __ATOMIC_RELEASE);
+    }
+    else {
+	for (tries = 0; shared && tries < 1000 && 
+		 __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE) != MEM_MAGIC; tries++)
+	    usleep(1000);
+	if (hdr->magic != MEM_MAGIC || hdr->version != MEM_VERSION ||
+	    hdr->max_heap != MAX_HEAP) {
+	    fprintf(stderr, "mem_map: %s has a bad heap header\n", name);
+	    munmap(base, r->map_size);
+	    return -1;
+	}
+    }
+
+    r->hdr = hdr;
+    r->map = base;
+    r->shared = shared;
+    pthread_mutex_init(&r->lock, NULL);
+    r->start_brk = (char *)base + hdrsize;
+    r->max_addr = r->start_brk + MAX_HEAP;
+    r->brk = r->start_brk + hdr->brk;
+    return 0;
+}
+
+/*
+ * mem_init_file - initialize the memory system model on a heap mapped
+ *    from the file at path. A new (or empty) file is sized to hold
+ *    MAX_HEAP bytes and starts with an empty heap; an existing heap
+ *    file is mapped back in with its brk and contents intact.
+ *    Returns 1 if an existing heap was resumed, 0 if a new heap was
+ *    created, and -1 on error.
+ */
+int mem_init_file(const char *path)
+{
+    int fd, create;
+    struct stat st;
+
+    if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0)
+	return -1;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return -1;
+    }
+    create = (st.st_size == 0);
+    if (mem_map(fd, path, create, 0) < 0)
+	return -1;
+    return !create;
+}
+
+/*
+ * mem_init_shm - initialize the memory system model on a heap in the
+ *    POSIX shared memory object name (e.g. "/mmheap"), so that several
+ *    processes can allocate from one region. The first process creates
+ *    the object and must call mm_init; the others get 1 back and call
+ *    mm_attach. All of them must bracket heap updates with
+ *    mem_lock/mem_unlock, which mm_malloc and friends already do. The
+ *    object outlives the processes until it is removed with shm_unlink.
+ *    Returns 1 if an existing heap was attached, 0 if a new heap was
+ *    created, and -1 on error.
+ */
+int mem_init_shm(const char *name)
+{
+    int fd, create = 1;
+
+    if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+	if (errno != EEXIST || (fd = shm_open(name, O_RDWR, 0600)) < 0)
+	    return -1;
+	create = 0;
+    }
+    if (mem_map(fd, name, create, 1) < 0)
+	return -1;
+    return !create;
+}
+
+/*
+ * mem_lock - take the process-shared heap lock. A process that died
+ *    holding it leaves the lock usable, though its last heap update may
+ *    be incomplete. No-op unless the heap came from mem_init_shm
+ *    or mem_threads is on.
+ */
+void mem_lock(void)
+{
+    mem_region_lock(&mem_default);
+}
+
+/*
+ * mem_unlock - release the process-shared heap lock
+ */
+void mem_unlock(void)
+{
+    mem_region_unlock(&mem_default);
 }
 
 /* 
@@ -39,7 +227,15 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    mem_region_t *r = &mem_default;
+
+    if (r->hdr) {
+	msync(r->map, r->map_size, MS_SYNC);
+	munmap(r->map, r->map_size);
+    }
+    else
+	free(r->start_brk);
+    memset(r, 0, sizeof(*r));
 }
 
 /*
@@ -47,7 +243,7 @@ void mem_deinit(void)
  */
 void mem_reset_brk()
 {
-    mem_brk = mem_start_brk;
+    mem_region_reset_brk(&mem_default);
 }
 
 /* 
@@ -57,15 +253,7 @@ void mem_reset_brk()
  */
 void *mem_sbrk(int incr) 
 {
-    char *old_brk = mem_brk;
-
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {			/*Check heap overflow and heap shrink(not allowed in this model)*/
-	errno = ENOMEM;
-	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
-	return (void *)-1;
-    }
-    mem_brk += incr;
-    return (void *)old_brk;
+    return mem_region_sbrk(&mem_default, incr);
 }
 
 /*
@@ -73,7 +261,7 @@ void *mem_sbrk(int incr)
  */
 void *mem_heap_lo()
 {
-    return (void *)mem_start_brk;
+    return mem_region_lo(&mem_default);
 }
 
 /* 
@@ -81,7 +269,7 @@ void *mem_heap_lo()
  */
 void *mem_heap_hi()
 {
-    return (void *)(mem_brk - 1);
+    return mem_region_hi(&mem_default);
 }
 
 /*
@@ -89,7 +277,7 @@ void *mem_heap_hi()
  */
 size_t mem_heapsize() 
 {
-    return (size_t)(mem_brk - mem_start_brk);
+    return mem_region_size(&mem_default);
 }
 
 /*
@@ -99,3 +287,195 @@ size_t mem_pagesize()
 {
     return (size_t)getpagesize();
 }
+
+/*
+ * mem_default_region - return the region behind the mem_* functions
+ */
+mem_region_t *mem_default_region(void)
+{
+    return &mem_default;
+}
+
+/*
+ * mem_region_create - make a new, empty region of up to size bytes
+ *    (MAX_HEAP if size is 0) from anonymous memory. The region
+ *    descriptor lives in the first page of the mapping, so the region
+ *    needs no other storage. Returns NULL on error.
+ */
+mem_region_t *mem_region_create(size_t size)
+{
+    size_t hdrsize = mem_pagesize();
+    size_t map_size;
+    mem_region_t *r;
+    void *base;
+
+    if (size == 0)
+	size = MAX_HEAP;
+    size = (size + hdrsize - 1) & ~(hdrsize - 1);
+    map_size = hdrsize + size;
+    base = mmap(NULL, map_size, PROT_READ | PROT_WRITE, 
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+	return NULL;
+
+    r = (mem_region_t *)base;
+    r->map = base;
+    r->map_size = map_size;
+    r->hdr = NULL;
+    r->shared = 0;
+    r->start_brk = (char *)base + hdrsize;
+    r->max_addr = r->start_brk + size;
+    r->brk = r->start_brk;
+    pthread_mutex_init(&r->lock, NULL);
+    return r;
+}
+
+/*
+ * mem_region_destroy - release a region made by mem_region_create and
+ *    everything allocated in it, in a single munmap
+ */
+void mem_region_destroy(mem_region_t *r)
+{
+    if (r == &mem_default)
+	mem_deinit();
+    else
+	munmap(r->map, r->map_size);
+}
+
+/*
+ * mem_region_reset_brk - reset the brk of a region to make it empty
+ */
+void mem_region_reset_brk(mem_region_t *r)
+{
+    r->brk = r->start_brk;
+    if (r->hdr)
+	r->hdr->brk = 0;
+}
+
+/* 
+ * mem_region_sbrk - extend region r by incr bytes and return the start
+ *    address of the new area, or (void *)-1 if the region is full
+ */
+void *mem_region_sbrk(mem_region_t *r, int incr) 
+{
+    char *old_brk;
+
+    if (r->hdr)                 /* another process may have moved it */
+	r->brk = r->start_brk + r->hdr->brk;
+    old_brk = r->brk;
+
+    if ( (incr < 0) || ((r->brk + incr) > r->max_addr)) {			/*Check heap overflow and heap shrink(not allowed in this model)*/
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+	return (void *)-1;
+    }
+    r->brk += incr;
+    if (r->hdr)
+	r->hdr->brk = r->brk - r->start_brk;
+    return (void *)old_brk;
+}
+
+/*
+ * mem_region_shrink - give the top decr bytes of region r back, so the
+ *    next mem_region_sbrk hands them out again. Whole pages of a private
+ *    mapped region are returned to the system. Returns 0, or -1 if decr
+ *    is negative or larger than the region.
+ */
+int mem_region_shrink(mem_region_t *r, int decr)
+{
+    size_t pagesize = mem_pagesize();
+    char *old_brk, *page;
+
+    if (r->hdr)
+	r->brk = r->start_brk + r->hdr->brk;
+    old_brk = r->brk;
+
+    if (decr < 0 || decr > r->brk - r->start_brk) {
+	errno = EINVAL;
+	return -1;
+    }
+    r->brk -= decr;
+    if (r->hdr)
+	r->hdr->brk = r->brk - r->start_brk;
+    else if (r->map) {
+	page = (char *)(((size_t)r->brk + pagesize - 1) & ~(pagesize - 1));
+	if (page < old_brk)
+	    madvise(page, old_brk - page, MADV_DONTNEED);
+    }
+    return 0;
+}
+
+/*
+ * mem_region_lo - return address of the first byte of region r
+ */
+void *mem_region_lo(mem_region_t *r)
+{
+    return (void *)r->start_brk;
+}
+
+/* 
+ * mem_region_hi - return address of the last byte of region r
+ */
+void *mem_region_hi(mem_region_t *r)
+{
+    if (r->hdr)
+	r->brk = r->start_brk + r->hdr->brk;
+    return (void *)(r->brk - 1);
+}
+
+/*
+ * mem_region_size - returns the size of region r in bytes
+ */
+size_t mem_region_size(mem_region_t *r) 
+{
+    if (r->hdr)
+	r->brk = r->start_brk + r->hdr->brk;
+    return (size_t)(r->brk - r->start_brk);
+}
+
+/*
+ * mem_region_mapped - nonzero if region r came from mem_init_file or 
+ *    mem_init_shm, and so may be mapped at another address
+ */
+int mem_region_mapped(mem_region_t *r)
+{
+    return r->hdr != NULL;
+}
+
+/*
+ * mem_threads - declare whether several threads of this process call
+ *    into the heaps at once. When on, mem_region_lock takes a lock of
+ *    the region's own on unshared regions too. Set it while no thread
+ *    holds a region lock.
+ */
+void mem_threads(int on)
+{
+    mem_threaded = on;
+}
+
+/*
+ * mem_region_lock - take the process-shared lock of region r, a no-op
+ *    unless r came from mem_init_shm or mem_threads is on. A process
+ *    that died holding it leaves the lock usable, though its last heap
+ *    update may be incomplete.
+ */
+void mem_region_lock(mem_region_t *r)
+{
+    if (r->shared) {
+	if (pthread_mutex_lock(&r->hdr->lock) == EOWNERDEAD)
+	    pthread_mutex_consistent(&r->hdr->lock);
+    }
+    else if (mem_threaded)
+	pthread_mutex_lock(&r->lock);
+}
+
+/*
+ * mem_region_unlock - release the lock taken by mem_region_lock
+ */
+void mem_region_unlock(mem_region_t *r)
+{
+    if (r->shared)
+	pthread_mutex_unlock(&r->hdr->lock);
+    else if (mem_threaded)
+	pthread_mutex_unlock(&r->lock);
+}
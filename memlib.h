@@ -1,11 +1,32 @@
 #include <unistd.h>
 
 void mem_init(void);               
+int mem_init_file(const char *path);
+int mem_init_shm(const char *name);
 void mem_deinit(void);
 void *mem_sbrk(int incr);
 void mem_reset_brk(void); 
+void mem_lock(void);
+void mem_unlock(void);
+void mem_threads(int on);
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
 size_t mem_pagesize(void);
 
+/* Independent simulated heaps; the functions above use the default one */
+typedef struct mem_region mem_region_t;
+
+mem_region_t *mem_default_region(void);
+mem_region_t *mem_region_create(size_t size);
+void mem_region_destroy(mem_region_t *r);
+void mem_region_reset_brk(mem_region_t *r);
+void *mem_region_sbrk(mem_region_t *r, int incr);
+int mem_region_shrink(mem_region_t *r, int decr);
+void *mem_region_lo(mem_region_t *r);
+void *mem_region_hi(mem_region_t *r);
+size_t mem_region_size(mem_region_t *r);
+int mem_region_mapped(mem_region_t *r);
+void mem_region_lock(mem_region_t *r);
+void mem_region_unlock(mem_region_t *r);
+
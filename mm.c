@@ -14,6 +14,45 @@
  * [HEADER:Prev:Next---:FOOTER]		=> Block format
    0      3    7   11   19    23    	=> bytes
  * Every Free block has pointers for next and free blocks that are placed in an explicit doubly linked list of free blocks 
+ * The Prev/Next links are stored as offsets from the start of the heap, so the heap can be mapped from a file
+ * (mem_init_file) and resumed at a different address with mm_attach. Offsets put an add on every hop of the first
+ * fit walk, which doubles its cost, so a heap that can't move (not from mem_init_file or mem_init_shm) keeps its
+ * Next links as raw pointers instead, the width of a pointer from the start of the Next slot.
+ *
+ * Heap state kept inside the heap:
+ * [PAD:PROLOGUE HDR:Prev:Next:PROLOGUE FTR:...]
+ * PAD	=> offset of the free list head (was alignment padding)
+ * Next	=> offset of the application root (mm_setroot), unused by the prologue otherwise
+ *
+ * A heap in POSIX shared memory (mem_init_shm) is used by several processes at once, so every public entry point
+ * holds the memlib process-shared lock while it touches the heap; the lock is a no-op for a private heap
+ * unless mem_threads(1) declares that several threads call in.
+ *
+ * All heap state hangs off an mm_heap_t, so independent heaps can be created with mm_heap_create, each in a memlib region
+ * of its own; mm_malloc, mm_free and mm_realloc use the heap in the default memlib region.
+ *
+ * mm_malloc_hint segregates blocks by expected lifetime: each MM_HINT_* class gets a heap of its own, created on first
+ * use, so a long-lived block never sits between short-lived neighbours and keeps coalesce from merging them once they
+ * are freed. mm_free and mm_realloc find a block's heap by address range, which costs nothing until a hint is used.
+ * With mm_predict(n), mm_malloc picks the hint itself from the lifetimes seen at the same call site, a hash of the
+ * innermost n return addresses (lifetime.c). The predictor and the creation of hint heaps run under mem_lock.
+ *
+ * mm_halloc returns a handle, a slot in a table that points at the block, instead of the block itself. Handle blocks live
+ * in a heap of their own and record their slot in a hidden first double word:
+ * [HEADER:SLOT:---PAYLOAD---:FOOTER]	=> Handle block format
+ * so mm_hcompact can slide them down over free blocks, fix their slots and give the free space left at the top back to
+ * memlib. It works in slices of a bounded number of bytes, resuming where the last slice stopped: no block below the
+ * heap's cursor is free, and mm_hfree moves the cursor back when it frees below it.
+ *
+ * Each heap has a free block policy (mm_heap_policy). MM_POLICY_LIFO is the list above. MM_POLICY_ADDRESS keeps the free
+ * blocks in a treap ordered by address instead, so first fit finds the lowest addressed fit, which fragments less,
+ * while insertion and removal stay O(log n). The tree is intrusive and uses the same offsets:
+ * [HEADER:Left:Max:Right---:FOOTER]	=> Free block format in an address tree
+ * Max is the largest block size in the node's subtree, which lets first fit skip subtrees; priorities are a hash of the
+ * block's offset, so a node needs no more room. The root takes the place of the list head.
+ * MM_POLICY_BEST keeps blocks of BEST_FIT_MIN bytes and more in the same kind of tree, ordered by size and then address,
+ * with its root in the prologue's last word, and leaves smaller blocks on the LIFO list. A large request takes the
+ * tightest fit from the tree in O(log n); a small one tries the list first and falls back to the tree.
  *
  */
 #include <stdio.h>
@@ -21,22 +60,40 @@
 #include <assert.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "mm.h"
 #include "memlib.h"
+#include "lifetime.h"
 
 
 /***********HELPER FUNCTIONS********************/
-static void *coalesce(void *);
-static void *extend_heap(size_t);
-static void *find_fit(size_t asize);
-static void place(void *, size_t);
+static int init_heap(mm_heap_t *h);
+static void *malloc_block(mm_heap_t *h, size_t size);
+static void free_block(mm_heap_t *h, void *bp);
+static void *realloc_block(mm_heap_t *h, void *ptr, size_t size);
+static mm_heap_t *heap_of(void *bp);
+static void *coalesce(mm_heap_t *h, void *);
+static void *extend_heap(mm_heap_t *h, size_t);
+static void *find_fit(mm_heap_t *h, size_t asize);
+static void place(mm_heap_t *h, void *, size_t);
 /***************PROTOTYPES********************/
 
 
 /******LINKED LIST FUNCTIONS*****************/
-static void insertblock(void *bp); 
-static void deleteblock(void *bp);
+static void insertblock(mm_heap_t *h, void *bp); 
+static void deleteblock(mm_heap_t *h, void *bp);
+/***************PROTOTYPES*******************/
+
+
+/******FREE BLOCK TREE FUNCTIONS*************/
+static void *tree_insert(mm_heap_t *h, void *t, void *bp);
+static void *tree_delete(mm_heap_t *h, void *t, void *bp);
+static void *tree_merge(mm_heap_t *h, void *a, void *b);
+static void tree_split(mm_heap_t *h, void *t, void *key, void **l, void **r);
+static void tree_update(mm_heap_t *h, void *t);
+static void *tree_first_fit(mm_heap_t *h, size_t asize);
+static void *tree_best_fit(mm_heap_t *h, size_t asize);
 /***************PROTOTYPES*******************/
 
 team_t team = {
@@ -64,9 +121,50 @@ team_t team = {
 #define SIZE_T_SIZE (ALIGN(sizeof(size_t)))
 
 
-static char *heap_listp = 0;  		/* Pointer to first block */  
-static char *freelist_head = 0;		/* Pointer to first free block */
-static char *freelist_tail = 0;		/* Pointer to last free block in the list */
+/* One heap: a memlib region and the start of the block list in it */
+struct mm_heap {
+	mem_region_t *region;			/* Region the heap grows in */
+	char *heap_listp;			/* Pointer to start of heap, base for free list offsets */
+	char *cursor;				/* mm_hcompact: no free block below this block, NULL for the first block */
+	int policy;				/* MM_POLICY_*, mirrored in the heap at POLICYP */
+	int raw;				/* LIFO Next links are raw pointers: the region can't move */
+};
+
+static mm_heap_t default_heap;			/* Heap behind mm_malloc, in the default memlib region */
+static int default_policy;			/* Policy mm_init gives the default heap */
+static mm_heap_t *hint_heap[3];			/* Heaps for MM_HINT_SHORT, _LONG and _PERMANENT, created on demand */
+static int nhint_heaps;				/* Hint heaps created since mm_init */
+static int predict;				/* Frames hashed into a call site for prediction, 0 if off */
+static mm_heap_t *handle_heap;			/* Heap of handle blocks, created by the first mm_halloc */
+static mem_region_t *handle_table;		/* Slots the handles point to */
+static void **free_handles;			/* Unused slots, linked through themselves, under handle_heap's lock */
+static const pthread_once_t once_init = PTHREAD_ONCE_INIT;
+static pthread_once_t handle_once = PTHREAD_ONCE_INIT;	/* Creation of handle_table and handle_heap */
+
+#define HANDLE_TABLE_SIZE	((size_t)64 << 20)	//address space reserved for handle slots
+#define HSLOT(bp)		(*(void ***)(bp))	//slot of a handle block, in its first double word
+
+#define FREELIST_HEAD(h)	OFF2PTR((h)->heap_listp, GET_OFF((h)->heap_listp))		/* Pointer to first free block */
+#define SET_FREELIST_HEAD(h,bp)	PUT_OFF((h)->heap_listp, PTR2OFF((h)->heap_listp, bp))	/* Update first free block */
+#define ROOTP(h)		((h)->heap_listp + DSIZE)					/* Prologue payload, next slot holds the root */
+#define LIST_NEXT(h,bp)		((h)->raw ? *(void **)((char *)(bp) + DSIZE) : FREE_NEXT((h)->heap_listp, bp))	/* Next block on the LIFO list */
+#define SET_LIST_NEXT(h,bp,p)	((h)->raw ? (void)(*(void **)((char *)(bp) + DSIZE) = (p)) : (void)SET_NEXT((h)->heap_listp, bp, p))
+#define FIRST_BLKP(h)		((h)->heap_listp + 2*MIN_BLOCK_SIZE)				/* First block, placed by extend_heap after init_heap */
+#define POLICYP(h)		(ROOTP(h) + WSIZE)						/* Prologue word holding the heap's policy */
+#define SIZEROOTP(h)		(ROOTP(h) + 3*WSIZE)						/* Prologue word holding the size tree's root */
+#define SIZE_ROOT(h)		OFF2PTR((h)->heap_listp, GET_OFF(SIZEROOTP(h)))			/* Root of the size tree */
+#define SET_SIZE_ROOT(h,bp)	PUT_OFF(SIZEROOTP(h), PTR2OFF((h)->heap_listp, bp))		/* Update root of the size tree */
+#define BEST_FIT_MIN		512								/* MM_POLICY_BEST: smallest block in the size tree */
+
+/* Treap of free blocks (address or size tree): children in the free list link slots, subtree's largest block in between */
+#define TREE_LEFT(h,bp)		FREE_PREV((h)->heap_listp, bp)				//left child (lower addresses)
+#define TREE_RIGHT(h,bp)	FREE_NEXT((h)->heap_listp, bp)				//right child (higher addresses)
+#define SET_LEFT(h,bp,p)	SET_PREV((h)->heap_listp, bp, p)
+#define SET_RIGHT(h,bp,p)	SET_NEXT((h)->heap_listp, bp, p)
+#define TREE_MAX(bp)		((bp) ? GET_OFF((char *)(bp) + WSIZE) : 0)		//largest block size in the subtree
+#define TREE_PRIO(h,bp)		(PTR2OFF((h)->heap_listp, bp) * 2654435761u)		//heap priority, hashed from the offset
+#define TREE_BEFORE(h,a,b)	((h)->policy == MM_POLICY_BEST && GET_SIZE(HDRP(a)) != GET_SIZE(HDRP(b)) ?	\
+				 GET_SIZE(HDRP(a)) < GET_SIZE(HDRP(b)) : (char *)(a) < (char *)(b))	//key order
 
 /* 
  * Function Name:	mm_init
@@ -78,38 +176,550 @@ static char *freelist_tail = 0;		/* Pointer to last free block in the list */
 
 int mm_init(void) 
 {
+	mm_heap_t *h = &default_heap;
+	int rc, i;
+
+	for (i = 0; i < 3; i++)					/* Blocks of the last heap lifetime are gone */
+	{
+		mm_heap_destroy(hint_heap[i]);
+		hint_heap[i] = NULL;
+	}
+	nhint_heaps = 0;
+	lifetime_reset();
+	h->policy = default_policy;
+	mm_heap_destroy(handle_heap);
+	handle_heap = NULL;
+	if (handle_table != NULL)
+		mem_region_destroy(handle_table);
+	handle_table = NULL;
+	free_handles = NULL;
+	handle_once = once_init;				/* mm_init runs before any other thread: the next mm_halloc creates them again */
+	h->region = mem_default_region();
+	mem_lock();
+	rc = init_heap(h);
+	mem_unlock();
+	return rc;
+}
+
+
+/* 
+ * Function Name:	init_heap
+ * Argument:		Heap whose region is empty (or holds only the heap descriptor)
+ * Return Type: 	0 on success, -1 if the region is full
+ * Description:		Create the prologue and epilogue blocks at the current brk of the heap's region and an initial free block
+ */
+
+static int init_heap(mm_heap_t *h)
+{
+	char *heap_listp;
+
 /* Create the initial empty heap */
-	if ((heap_listp = mem_sbrk(2*MIN_BLOCK_SIZE)) == NULL) 
+	if ((heap_listp = mem_region_sbrk(h->region, 2*MIN_BLOCK_SIZE)) == (void *)-1) 
 		return -1;
+	h->heap_listp = heap_listp;
+	h->raw = !mem_region_mapped(h->region);
 
-	PUT(heap_listp, 0);							/* Alignment padding */ 
+	PUT(heap_listp, 0);							/* Free list head (alignment padding) */ 
 	PUT(heap_listp + WSIZE, PACK(MIN_BLOCK_SIZE, 1));			/* Prologue header */
-	PUT(heap_listp + DSIZE, 0);						/* Previous pointer */
-	PUT(heap_listp + DSIZE+WSIZE, 0);					/* Next pointer */ 
+	SET_PREV(heap_listp, ROOTP(h), NULL);					/* Previous pointer */
+	SET_NEXT(heap_listp, ROOTP(h), NULL);					/* Next pointer (root) */ 
 	
 	
 	PUT(heap_listp + MIN_BLOCK_SIZE, PACK(MIN_BLOCK_SIZE, 1));		/* Prologue footer */ 
 	PUT(heap_listp+WSIZE + MIN_BLOCK_SIZE, PACK(0, 1));			/* Epilogue header */ 
 
-/* Initialize linked list head and tail to point to start of heap */	
-	freelist_head = heap_listp + DSIZE;					
-	freelist_tail = freelist_head; 
+/* Initialize linked list head to point to the prologue, which ends the list; an address tree starts empty */	
+	SET_FREELIST_HEAD(h, h->policy == MM_POLICY_ADDRESS ? NULL : ROOTP(h));
+	SET_SIZE_ROOT(h, NULL);
+	PUT(POLICYP(h), h->policy);
 /* Extend the empty heap with a free block of CHUNKSIZE bytes */
-	if (extend_heap(CHUNKSIZE/WSIZE) == NULL) 
+	if (extend_heap(h, CHUNKSIZE/WSIZE) == NULL) 
+		return -1;
+	return 0;
+}
+
+
+/* 
+ * Function Name:	mm_attach
+ * Argument:		None
+ * Return Type: 	0 on success, -1 if the heap was not initialized by mm_init
+ * Description:		Resume an existing heap, e.g. one mapped back in by mem_init_file, instead of creating an empty one.
+			All free list state lives in the heap as offsets, so only the heap base needs to be recomputed.
+ */
+
+int mm_attach(void)
+{
+	mm_heap_t *h = &default_heap;
+	int rc = 0;
+
+	h->region = mem_default_region();
+	mem_lock();
+	h->heap_listp = mem_heap_lo();
+	h->raw = !mem_region_mapped(h->region);
+	if (mem_heapsize() < 2*MIN_BLOCK_SIZE || GET(h->heap_listp + WSIZE) != PACK(MIN_BLOCK_SIZE, 1))
+		rc = -1;
+	else
+		h->policy = GET(POLICYP(h));
+	mem_unlock();
+	return rc;
+}
+
+
+/* 
+ * Function Name:	mm_setroot / mm_getroot
+ * Argument:		Pointer to an allocated block (or NULL) / None
+ * Return Type: 	void / root pointer
+ * Description:		Record and look up one application root in the heap, so objects reachable from it can be found
+			again after the heap is resumed with mm_attach.
+ */
+
+void mm_setroot(void *ptr)
+{
+	mm_heap_t *h = &default_heap;
+
+	mem_lock();
+	SET_NEXT(h->heap_listp, ROOTP(h), ptr);
+	mem_unlock();
+}
+
+void *mm_getroot(void)
+{
+	mm_heap_t *h = &default_heap;
+	void *root;
+
+	mem_lock();
+	root = FREE_NEXT(h->heap_listp, ROOTP(h));
+	mem_unlock();
+	return root;
+}
+
+
+/* 
+ * Function Name:	mm_malloc / mm_free / mm_realloc
+ * Argument:		See malloc_block, free_block and realloc_block
+ * Return Type: 	See malloc_block, free_block and realloc_block
+ * Description:		Public entry points for the default heap
+ */
+
+void *mm_malloc(size_t size)
+{
+	void *site, *bp;
+	int hint;
+
+	if (!predict)
+		return mm_heap_malloc(&default_heap, size);
+	site = (predict == 1) ? __builtin_return_address(0) : lifetime_site(predict, 0);
+	mem_lock();
+	hint = lifetime_predict(site, size);
+	mem_unlock();
+	bp = mm_malloc_hint(size, hint);
+	mem_lock();
+	lifetime_record(site, size, bp);
+	mem_unlock();
+	return bp;
+}
+
+void mm_free(void *bp)
+{
+	if (predict)
+	{
+		mem_lock();
+		lifetime_free(bp);
+		mem_unlock();
+	}
+	mm_heap_free(heap_of(bp), bp);
+}
+
+void *mm_realloc(void *ptr, size_t size)
+{
+	void *newptr = mm_heap_realloc(heap_of(ptr), ptr, size);
+
+	if (predict && ptr != NULL && (newptr != NULL || size == 0))
+	{
+		mem_lock();
+		lifetime_realloc(ptr, newptr);
+		mem_unlock();
+	}
+	return newptr;
+}
+
+
+/* 
+ * Function Name:	mm_predict
+ * Argument:		Frames whose return addresses make a call site (1 for mm_malloc's caller alone), 0 to disable
+ * Return Type: 	void
+ * Description:		Let mm_malloc place blocks by predicted lifetime (see lifetime.c): sites whose blocks mostly live long
+			get the MM_HINT_LONG heap. Off by default. A program that allocates through a wrapper needs 2 or more
+			frames, or every block gets the wrapper's site; each frame past the first costs a walk of the unwinder.
+ */
+
+void mm_predict(int frames)
+{
+	predict = frames;
+}
+
+
+/* 
+ * Function Name:	mm_malloc_hint
+ * Argument:		Memory block size requested in bytes, MM_HINT_SHORT, MM_HINT_LONG, MM_HINT_PERMANENT or MM_HINT_NONE
+ * Return Type: 	Pointer to block of memory, NULL if out of memory
+ * Description:		Allocate from the heap of the hinted lifetime class, creating it on first use (under mem_lock, so
+			threads racing for it create one). Unknown hints and MM_HINT_NONE use the default heap. The block is
+			freed and resized with mm_free and mm_realloc as usual.
+ */
+
+void *mm_malloc_hint(size_t size, int hint)
+{
+	mm_heap_t *h;
+	int i;
+
+	switch (hint)
+	{
+	case MM_HINT_SHORT:	i = 0; break;
+	case MM_HINT_LONG:	i = 1; break;
+	case MM_HINT_PERMANENT:	i = 2; break;
+	default:		return mm_heap_malloc(&default_heap, size);
+	}
+	if ((h = __atomic_load_n(&hint_heap[i], __ATOMIC_ACQUIRE)) == NULL)
+	{
+		mem_lock();
+		if ((h = hint_heap[i]) == NULL && (h = mm_heap_create(0)) != NULL)
+		{
+			__atomic_store_n(&hint_heap[i], h, __ATOMIC_RELEASE);
+			__atomic_add_fetch(&nhint_heaps, 1, __ATOMIC_RELEASE);
+		}
+		mem_unlock();
+		if (h == NULL)
+			return NULL;
+	}
+	return mm_heap_malloc(h, size);
+}
+
+
+/* 
+ * Function Name:	handle_init
+ * Argument:		void
+ * Return Type: 	void
+ * Description:		Create the handle table and heap, run once by mm_halloc. On failure both stay NULL and mm_halloc
+			returns NULL until the next mm_init.
+ */
+
+static void handle_init(void)
+{
+	if ((handle_table = mem_region_create(HANDLE_TABLE_SIZE)) == NULL)
+		return;
+	if ((handle_heap = mm_heap_create(0)) == NULL)
+	{
+		mem_region_destroy(handle_table);
+		handle_table = NULL;
+	}
+}
+
+
+/* 
+ * Function Name:	mm_halloc
+ * Argument:		Memory block size requested in bytes
+ * Return Type: 	Handle of a relocatable block, NULL if out of memory
+ * Description:		Take a slot from the handle table and allocate a handle block (size plus the slot double word) in the
+			handle heap, creating both on first use (once, however many threads race to it). The slot list,
+			the table and the heap are all kept under the handle heap's region lock. mm_hderef gives the
+			block's current address.
+ */
+
+mm_handle_t mm_halloc(size_t size)
+{
+	void **slot;
+	char *bp;
+
+	pthread_once(&handle_once, handle_init);
+	if (handle_heap == NULL)
+		return NULL;
+	mem_region_lock(handle_heap->region);
+	if ((slot = free_handles) != NULL)
+		free_handles = *slot;
+	else if ((slot = mem_region_sbrk(handle_table, sizeof(void *))) == (void *)-1)
+	{
+		mem_region_unlock(handle_heap->region);
+		return NULL;
+	}
+
+	if ((bp = malloc_block(handle_heap, size + DSIZE)) == NULL)
+	{
+		*slot = free_handles;
+		free_handles = slot;
+		mem_region_unlock(handle_heap->region);
+		return NULL;
+	}
+	HSLOT(bp) = slot;
+	*slot = bp + DSIZE;
+	mem_region_unlock(handle_heap->region);
+	return slot;
+}
+
+
+/* 
+ * Function Name:	mm_hderef
+ * Argument:		Handle from mm_halloc
+ * Return Type: 	Current address of the block, valid until the next mm_hcompact
+ * Description:		Read the handle's slot
+ */
+
+void *mm_hderef(mm_handle_t hd)
+{
+	return *hd;
+}
+
+
+/* 
+ * Function Name:	mm_hfree
+ * Argument:		Handle from mm_halloc, or NULL
+ * Return Type: 	void
+ * Description:		Free the handle's block and slot. A free below the compaction cursor moves the cursor back to the
+			start of the free block it ends up in.
+ */
+
+void mm_hfree(mm_handle_t hd)
+{
+	mm_heap_t *h = handle_heap;
+	char *bp;
+
+	if (hd == NULL)
+		return;
+	bp = (char *)*hd - DSIZE;
+	mem_region_lock(h->region);
+	if (h->cursor != NULL && bp < h->cursor)
+		h->cursor = GET_ALLOC(HDRP(PREV_BLKP(bp))) ? bp : (char *)PREV_BLKP(bp);
+	free_block(h, bp);
+	*hd = free_handles;
+	free_handles = hd;
+	mem_region_unlock(h->region);
+}
+
+
+/* 
+ * Function Name:	mm_hcompact
+ * Argument:		Bytes of work allowed in this slice (each block looked at counts MIN_BLOCK_SIZE, each moved block its size)
+ * Return Type: 	1 if the handle heap is compact (and trimmed), 0 if more work remains
+ * Description:		From the cursor, find the next free block. The block after it is allocated (free blocks are coalesced):
+			slide it down to the free block's start, fix its slot and coalesce the free space now behind it with
+			what follows. A free block at the top of the heap is given back to memlib instead.
+ */
+
+int mm_hcompact(size_t budget)
+{
+	mm_heap_t *h = handle_heap;
+	size_t fsize, asize, spent = 0;
+	char *bp, *next;
+	int done = 0;
+
+	if (h == NULL)
+		return 1;
+	mem_region_lock(h->region);
+	bp = h->cursor != NULL ? h->cursor : FIRST_BLKP(h);
+	while (spent < budget)
+	{
+		if (GET_ALLOC(HDRP(bp)))
+		{
+			if (GET_SIZE(HDRP(bp)) == 0)			/* Epilogue, nothing free */
+			{
+				done = 1;
+				break;
+			}
+			bp = NEXT_BLKP(bp);
+			spent += MIN_BLOCK_SIZE;
+			continue;
+		}
+
+		fsize = GET_SIZE(HDRP(bp));
+		next = NEXT_BLKP(bp);
+		deleteblock(h, bp);
+		if ((asize = GET_SIZE(HDRP(next))) == 0)		/* Free block at the top: trim it */
+		{
+			PUT(HDRP(bp), PACK(0, 1));
+			mem_region_shrink(h->region, fsize);
+			done = 1;
+			break;
+		}
+		memmove(HDRP(bp), HDRP(next), asize);
+		*HSLOT(bp) = bp + DSIZE;
+		next = bp + asize;
+		PUT(HDRP(next), PACK(fsize, 0));
+		PUT(FTRP(next), PACK(fsize, 0));
+		bp = coalesce(h, next);
+		spent += asize;
+	}
+	h->cursor = bp;
+	mem_region_unlock(h->region);
+	return done;
+}
+
+
+/* 
+ * Function Name:	heap_of
+ * Argument:		Pointer to an allocated block, or NULL
+ * Return Type: 	Heap the block belongs to: the hint heap whose region holds it, the default heap otherwise
+ * Description:		Range check against each hint heap; with none created only the count is read. Takes no lock: a hint
+			heap is published before the count, and a block's own heap was published before the block existed.
+ */
+
+static mm_heap_t *heap_of(void *bp)
+{
+	mm_heap_t *h;
+	int i;
+
+	if (__atomic_load_n(&nhint_heaps, __ATOMIC_ACQUIRE) == 0 || bp == NULL)
+		return &default_heap;
+	for (i = 0; i < 3; i++)
+		if ((h = __atomic_load_n(&hint_heap[i], __ATOMIC_ACQUIRE)) != NULL && mm_heap_owns(h, bp))
+			return h;
+	return &default_heap;
+}
+
+
+/* 
+ * Function Name:	mm_heap_owns
+ * Argument:		Heap handle, any pointer
+ * Return Type: 	Nonzero if the pointer lies in the used part of the heap's region
+ * Description:		Range check against the region, so a caller holding blocks from several sources can tell which are
+			the heap's. Takes no lock: the brk only moves up while blocks are live.
+ */
+
+int mm_heap_owns(mm_heap_t *h, void *bp)
+{
+	return (char *)bp > (char *)mem_region_lo(h->region) && (char *)bp <= (char *)mem_region_hi(h->region);
+}
+
+
+/* 
+ * Function Name:	mm_heap_create
+ * Argument:		Largest size the heap may grow to in bytes, 0 for the memlib default (MAX_HEAP)
+ * Return Type: 	Handle of the new heap, NULL if no region could be mapped
+ * Description:		Create an independent heap in a region of its own. The handle is stored at the start of that region,
+			so the heap needs no memory from anywhere else.
+ */
+
+mm_heap_t *mm_heap_create(size_t maxsize)
+{
+	mem_region_t *region;
+	mm_heap_t *h;
+
+	if ((region = mem_region_create(maxsize)) == NULL)
+		return NULL;
+	if ((h = mem_region_sbrk(region, ALIGN(sizeof(mm_heap_t)))) == (void *)-1)
+	{
+		mem_region_destroy(region);
+		return NULL;
+	}
+	h->region = region;
+	h->cursor = NULL;
+	h->policy = MM_POLICY_LIFO;
+	if (init_heap(h) < 0)
+	{
+		mem_region_destroy(region);
+		return NULL;
+	}
+	return h;
+}
+
+
+/* 
+ * Function Name:	mm_heap_destroy
+ * Argument:		Heap handle from mm_heap_create
+ * Return Type: 	void
+ * Description:		Release the heap and every block still allocated in it at once by unmapping its region, without
+			walking the blocks. The handle and all pointers into the heap are invalid afterwards.
+ */
+
+void mm_heap_destroy(mm_heap_t *h)
+{
+	if (h != NULL && h != &default_heap)
+		mem_region_destroy(h->region);
+}
+
+
+/* 
+ * Function Name:	mm_heap_policy
+ * Argument:		Heap handle (NULL for the default heap, also kept for later mm_init calls), MM_POLICY_LIFO,
+			MM_POLICY_ADDRESS or MM_POLICY_BEST
+ * Return Type: 	0 on success, -1 on an unknown policy
+ * Description:		Switch the heap's free block policy. The free blocks are found by walking the heap and indexed anew,
+			so this works at any time, at a cost linear in the number of blocks.
+ */
+
+int mm_heap_policy(mm_heap_t *h, int policy)
+{
+	char *bp;
+
+	if (policy != MM_POLICY_LIFO && policy != MM_POLICY_ADDRESS && policy != MM_POLICY_BEST)
 		return -1;
+	if (h == NULL)
+	{
+		default_policy = policy;
+		h = &default_heap;
+	}
+	if (h->heap_listp == NULL)				/* Default heap before mm_init */
+	{
+		h->policy = policy;
+		return 0;
+	}
+
+	mem_region_lock(h->region);
+	h->policy = policy;
+	PUT(POLICYP(h), policy);
+	SET_FREELIST_HEAD(h, policy == MM_POLICY_ADDRESS ? NULL : ROOTP(h));
+	SET_SIZE_ROOT(h, NULL);
+	for (bp = FIRST_BLKP(h); GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp))
+		if (!GET_ALLOC(HDRP(bp)))
+			insertblock(h, bp);
+	mem_region_unlock(h->region);
 	return 0;
 }
 
 
 /* 
- * Function Name:	mm_malloc
+ * Function Name:	mm_heap_malloc / mm_heap_free / mm_heap_realloc
+ * Argument:		Heap handle, then as for malloc_block, free_block and realloc_block
+ * Return Type: 	See malloc_block, free_block and realloc_block
+ * Description:		Run the block routines on one heap under its region lock (only taken for a shared memory heap)
+ */
+
+void *mm_heap_malloc(mm_heap_t *h, size_t size)
+{
+	void *bp;
+
+	mem_region_lock(h->region);
+	bp = malloc_block(h, size);
+	mem_region_unlock(h->region);
+	return bp;
+}
+
+void mm_heap_free(mm_heap_t *h, void *bp)
+{
+	mem_region_lock(h->region);
+	free_block(h, bp);
+	mem_region_unlock(h->region);
+}
+
+void *mm_heap_realloc(mm_heap_t *h, void *ptr, size_t size)
+{
+	void *newptr;
+
+	mem_region_lock(h->region);
+	newptr = realloc_block(h, ptr, size);
+	mem_region_unlock(h->region);
+	return newptr;
+}
+
+
+/* 
+ * Function Name:	malloc_block
  * Argument:		Memory block size requested in bytes
  * Return Type: 	Pointer to block of memory
  * Description:		Allocate the requested number of bytes on the heap from freelist and return the header pointer. 
 			If free list can't satisfy the request, extend heap size by appropriate number of bytes. 
  */
 
-void *mm_malloc(size_t size) 
+static void *malloc_block(mm_heap_t *h, size_t size) 
 {
 	size_t asize;						/* Adjusted block size */      
 	size_t extendsize;					/* Amount to extend heap if no fit */ 
@@ -123,34 +733,34 @@ void *mm_malloc(size_t size)
 	asize = MAX(ALIGN(size) + DSIZE, MIN_BLOCK_SIZE);
 
 /* Search the free list for a fit */	
-	if ((bp = find_fit(asize))) 				/*Check if a block can satisfy the requested memory*/
+	if ((bp = find_fit(h, asize))) 				/*Check if a block can satisfy the requested memory*/
 	{
-		place(bp, asize);				/*Check block and decide whether to split or not */
+		place(h, bp, asize);				/*Check block and decide whether to split or not */
 		return bp;
 	}
 
 /* No fit found. Get more memory and place the block by extending the heap*/
 	extendsize = MAX(asize, CHUNKSIZE);
 	
-	if ((bp = extend_heap(extendsize/WSIZE)) == NULL)
+	if ((bp = extend_heap(h, extendsize/WSIZE)) == NULL)
 	{ 
 		return NULL;
 	}
-	place(bp, asize);
+	place(h, bp, asize);
 	return bp;
 } 
 
 
 
 /* 
- * Function Name:	mm_free
+ * Function Name:	free_block
  * Argument:		Pointer to block of memory to be freed
  * Return Type: 	void
  * Description:		Free the memory block pointed by the block pointer
 			 
  */
 
-void mm_free(void *bp)
+static void free_block(mm_heap_t *h, void *bp)
 {
 	if(bp == NULL)					/* Return if illegal free call,i.e. null pointer free call */
 	{
@@ -160,7 +770,7 @@ void mm_free(void *bp)
 /* Update header and footer of block with free allocation status*/
 	PUT(HDRP(bp), PACK(size, 0)); 
 	PUT(FTRP(bp), PACK(size, 0));
-	coalesce(bp); 
+	coalesce(h, bp); 
 }
 
 
@@ -171,7 +781,7 @@ void mm_free(void *bp)
  * Description:		Check the allocation status of the previous and the next block after freeing a block of memory and coalesce them 				together to form a larger block if applicable.
 			 
  */
-static void *coalesce(void *bp) 
+static void *coalesce(mm_heap_t *h, void *bp) 
 {
 	//size_t prev_alloc;
 	size_t prev_alloc = GET_ALLOC(FTRP(PREV_BLKP(bp))) || PREV_BLKP(bp) == bp;
@@ -181,7 +791,7 @@ static void *coalesce(void *bp)
 	if (prev_alloc && !next_alloc)					/* Previous block is allocated and next block is free */ 
 	{			
 		size += GET_SIZE(HDRP(NEXT_BLKP(bp)));
-		deleteblock(NEXT_BLKP(bp));
+		deleteblock(h, NEXT_BLKP(bp));
 		PUT(HDRP(bp), PACK(size, 0));
 		PUT(FTRP(bp), PACK(size, 0));
 	}
@@ -190,7 +800,7 @@ static void *coalesce(void *bp)
 	{		
 		size += GET_SIZE(HDRP(PREV_BLKP(bp)));
 		bp = PREV_BLKP(bp);
-		deleteblock(bp);
+		deleteblock(h, bp);
 		PUT(HDRP(bp), PACK(size, 0));
 		PUT(FTRP(bp), PACK(size, 0));
 	}
@@ -199,40 +809,40 @@ static void *coalesce(void *bp)
 	{		
 		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + 
 				GET_SIZE(HDRP(NEXT_BLKP(bp)));
-		deleteblock(PREV_BLKP(bp));
-		deleteblock(NEXT_BLKP(bp));
+		deleteblock(h, PREV_BLKP(bp));
+		deleteblock(h, NEXT_BLKP(bp));
 		bp = PREV_BLKP(bp);
 		PUT(HDRP(bp), PACK(size, 0));
 		PUT(FTRP(bp), PACK(size, 0));
 	}
 	
-	insertblock(bp);
+	insertblock(h, bp);
 	
 	return bp;
 }
 
 /* 
- * Function Name:	mm_realloc
+ * Function Name:	realloc_block
  * Argument:		pointer to block
  * Return Type: 	updated pointer to allocated block, size to which it is to be reallocated
  * Description:		Update the size of the already existing allocated malloced block of memory to the size provided in argument
 			 
  */
 
-void *mm_realloc(void *ptr, size_t size)
+static void *realloc_block(mm_heap_t *h, void *ptr, size_t size)
 {
 	size_t oldsize;
 	void *newptr;
 	size_t asize = MAX(ALIGN(size) + DSIZE, MIN_BLOCK_SIZE);
 	/* If size <= 0 then this is just free, and we return NULL. */
 	if(size <= 0) {
-		mm_free(ptr);
+		free_block(h, ptr);
 		return NULL;
 	}
 
 	/* If oldptr is NULL, then this is just malloc. */
 	if(ptr == NULL) {
-		return mm_malloc(size);
+		return malloc_block(h, size);
 	}
 
 	/* Get the size of the original block */
@@ -255,11 +865,11 @@ void *mm_realloc(void *ptr, size_t size)
 		PUT(HDRP(ptr), PACK(size, 1));
 		PUT(FTRP(ptr), PACK(size, 1));
 		PUT(HDRP(NEXT_BLKP(ptr)), PACK(oldsize-size, 1));
-		mm_free(NEXT_BLKP(ptr));
+		free_block(h, NEXT_BLKP(ptr));
 		return ptr;
 	}
 
-	newptr = mm_malloc(size);
+	newptr = malloc_block(h, size);
 
 	/* If realloc() fails the original block is left untouched  */
 	if(!newptr) {
@@ -271,7 +881,7 @@ void *mm_realloc(void *ptr, size_t size)
 	memcpy(newptr, ptr, oldsize);
 
 	/* Free the old block. */
-	mm_free(ptr);
+	free_block(h, ptr);
 
 	return newptr;
 }
@@ -291,7 +901,7 @@ void mm_checkheap(int verbose)
  * Description:		Extend the size by word size in the argument
 			 
  */
-static void *extend_heap(size_t words) 
+static void *extend_heap(mm_heap_t *h, size_t words) 
 {
 	char *bp;
 	size_t size;
@@ -300,7 +910,7 @@ static void *extend_heap(size_t words)
 	size = (words % 2) ? (words+1) * WSIZE : words * WSIZE;
 	if (size < MIN_BLOCK_SIZE)
 		size = MIN_BLOCK_SIZE;
-	if ((long)(bp = mem_sbrk(size)) == -1) 
+	if ((long)(bp = mem_region_sbrk(h->region, size)) == -1) 
 		return NULL;
 
 /* Initialize free block header/footer and the epilogue header */	
@@ -309,7 +919,7 @@ static void *extend_heap(size_t words)
 	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); 				/* new epilogue header */
 
 /* Coalesce if the previous block was free */	
-	return coalesce(bp);
+	return coalesce(h, bp);
                                          
 }
 
@@ -322,26 +932,25 @@ static void *extend_heap(size_t words)
 			block, then split the block to avoid internal fragmentation.
  */
 
-static void place(void *bp, size_t asize)
+static void place(mm_heap_t *h, void *bp, size_t asize)
 {
 	size_t csize = GET_SIZE(HDRP(bp));
 
 
+	deleteblock(h, bp);				/* While its size still keys it in a size tree */
 	if ((csize - asize) >= MIN_BLOCK_SIZE)		/* Difference is large enough to be an independent block, so split the blocks */ 
 	{
 		PUT(HDRP(bp), PACK(asize, 1));
 		PUT(FTRP(bp), PACK(asize, 1));
-		deleteblock(bp);
 		bp = NEXT_BLKP(bp);
 		PUT(HDRP(bp), PACK(csize-asize, 0));
 		PUT(FTRP(bp), PACK(csize-asize, 0));
-		coalesce(bp);
+		coalesce(h, bp);
 	}
 	
 	else {						/* Donot split the block, small internal fragmentation will happen */
 		PUT(HDRP(bp), PACK(csize, 1));
 		PUT(FTRP(bp), PACK(csize, 1));
-		deleteblock(bp);
 	}
 }
 
@@ -353,16 +962,33 @@ static void place(void *bp, size_t asize)
  * Description:		Search for the first block in the explicit free-list that fits and satisfies the allocation request and return the 				pointer for that block.
  */
 
-static void *find_fit(size_t asize)
+static void *find_fit(mm_heap_t *h, size_t asize)
 
 {
+	char *base = h->heap_listp;
+	size_t off;
 	void *bp;
-/* First fit algorithm, Check for the first block that fits from the start of the heap that satisfies the request */	
-	for (bp = freelist_head; GET_ALLOC(HDRP(bp)) == 0; bp = FREE_NEXT(bp)) 
+
+	if (h->policy == MM_POLICY_ADDRESS)
+		return tree_first_fit(h, asize);
+	if (h->policy == MM_POLICY_BEST && asize >= BEST_FIT_MIN)
+		return tree_best_fit(h, asize);
+/* First fit algorithm, Check for the first block that fits from the start of the heap that satisfies the request. 
+   The list ends at the prologue, so neither walk needs a NULL check */	
+	if (h->raw)
 	{
-		if (asize <= (size_t)GET_SIZE(HDRP(bp)))
-			return bp;
-    	}
+		for (bp = FREELIST_HEAD(h); GET_ALLOC(HDRP(bp)) == 0; bp = *(void **)((char *)bp + DSIZE)) 
+			if (asize <= (size_t)GET_SIZE(HDRP(bp)))
+				return bp;
+	}
+	else
+	{
+		for (off = GET_OFF(base); GET_ALLOC(base + off - WSIZE) == 0; off = GET_OFF(base + off + DSIZE)) 
+			if (asize <= (size_t)GET_SIZE(base + off - WSIZE))
+				return base + off;
+	}
+	if (h->policy == MM_POLICY_BEST)				/* Small request, no small block fits */
+		return tree_best_fit(h, asize);
 	return NULL; /* No Fit */
 
 }
@@ -374,12 +1000,26 @@ static void *find_fit(size_t asize)
  * Return Type: 	void
  * Description:		Insert the new free (or coalesced) block to the head of the free list
  */
-static void insertblock(void *bp)
+static void insertblock(mm_heap_t *h, void *bp)
 {
-	FREE_NEXT(bp) = freelist_head; 
-	FREE_PREV(freelist_head) = bp; 
-	FREE_PREV(bp) = NULL; 
-	freelist_head = bp; 
+	void *head = FREELIST_HEAD(h);
+
+	if (h->policy == MM_POLICY_ADDRESS)
+	{
+		bp = tree_insert(h, head, bp);
+		SET_FREELIST_HEAD(h, bp);
+		return;
+	}
+	if (h->policy == MM_POLICY_BEST && GET_SIZE(HDRP(bp)) >= BEST_FIT_MIN)
+	{
+		bp = tree_insert(h, SIZE_ROOT(h), bp);
+		SET_SIZE_ROOT(h, bp);
+		return;
+	}
+	SET_LIST_NEXT(h, bp, head); 
+	SET_PREV(h->heap_listp, head, bp); 
+	SET_PREV(h->heap_listp, bp, NULL); 
+	SET_FREELIST_HEAD(h, bp); 
 }
 
 /* 
@@ -388,13 +1028,208 @@ static void insertblock(void *bp)
  * Return Type: 	void
  * Description:		Delete the free block from the free list if the block gets allocated or coalesced with other block to become a larger 				block
  */
-static void deleteblock(void *bp)
+static void deleteblock(mm_heap_t *h, void *bp)
 {
-	void *previous = FREE_PREV(bp);
-	void *next = FREE_NEXT(bp);
+	if (h->policy == MM_POLICY_ADDRESS)
+	{
+		bp = tree_delete(h, FREELIST_HEAD(h), bp);
+		SET_FREELIST_HEAD(h, bp);
+		return;
+	}
+	if (h->policy == MM_POLICY_BEST && GET_SIZE(HDRP(bp)) >= BEST_FIT_MIN)
+	{
+		bp = tree_delete(h, SIZE_ROOT(h), bp);
+		SET_SIZE_ROOT(h, bp);
+		return;
+	}
+	void *previous = FREE_PREV(h->heap_listp, bp);
+	void *next = LIST_NEXT(h, bp);
 	if (previous) 
-		FREE_NEXT(previous) = next;
+		SET_LIST_NEXT(h, previous, next);
+	else
+		SET_FREELIST_HEAD(h, next); 
+	SET_PREV(h->heap_listp, next, previous);
+}
+
+
+/* 
+ * Function Name:	tree_insert
+ * Argument:		Subtree root, free block not in the tree
+ * Return Type: 	New subtree root
+ * Description:		Treap insertion in TREE_BEFORE order: descend while the subtree root outranks the block, then split
+			the subtree around the block and hang the halves under it
+ */
+static void *tree_insert(mm_heap_t *h, void *t, void *bp)
+{
+	void *l, *r, *sub;
+
+	if (t == NULL || TREE_PRIO(h, bp) > TREE_PRIO(h, t))
+	{
+		tree_split(h, t, bp, &l, &r);
+		SET_LEFT(h, bp, l);
+		SET_RIGHT(h, bp, r);
+		tree_update(h, bp);
+		return bp;
+	}
+	if (TREE_BEFORE(h, bp, t))
+	{
+		sub = tree_insert(h, TREE_LEFT(h, t), bp);		/* SET_LEFT evaluates its argument twice */
+		SET_LEFT(h, t, sub);
+	}
 	else
-		freelist_head = next; 
-		FREE_PREV(next) = previous;
+	{
+		sub = tree_insert(h, TREE_RIGHT(h, t), bp);
+		SET_RIGHT(h, t, sub);
+	}
+	tree_update(h, t);
+	return t;
+}
+
+/* 
+ * Function Name:	tree_delete
+ * Argument:		Subtree root, free block in that subtree
+ * Return Type: 	New subtree root
+ * Description:		Find the block and replace it by the merge of its children. A size tree is keyed by the block's size,
+			so callers delete a block before they resize it.
+ */
+static void *tree_delete(mm_heap_t *h, void *t, void *bp)
+{
+	void *sub;
+
+	if (t == bp)
+		return tree_merge(h, TREE_LEFT(h, t), TREE_RIGHT(h, t));
+	if (TREE_BEFORE(h, bp, t))
+	{
+		sub = tree_delete(h, TREE_LEFT(h, t), bp);
+		SET_LEFT(h, t, sub);
+	}
+	else
+	{
+		sub = tree_delete(h, TREE_RIGHT(h, t), bp);
+		SET_RIGHT(h, t, sub);
+	}
+	tree_update(h, t);
+	return t;
+}
+
+/* 
+ * Function Name:	tree_merge
+ * Argument:		Two subtrees, every block of a below every block of b
+ * Return Type: 	Root of their union
+ * Description:		The root with the higher priority stays on top
+ */
+static void *tree_merge(mm_heap_t *h, void *a, void *b)
+{
+	void *sub;
+
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (TREE_PRIO(h, a) > TREE_PRIO(h, b))
+	{
+		sub = tree_merge(h, TREE_RIGHT(h, a), b);
+		SET_RIGHT(h, a, sub);
+		tree_update(h, a);
+		return a;
+	}
+	sub = tree_merge(h, a, TREE_LEFT(h, b));
+	SET_LEFT(h, b, sub);
+	tree_update(h, b);
+	return b;
+}
+
+/* 
+ * Function Name:	tree_split
+ * Argument:		Subtree, key address, where to store the halves
+ * Return Type: 	void
+ * Description:		Split the subtree into the blocks before key (*l) and after it (*r)
+ */
+static void tree_split(mm_heap_t *h, void *t, void *key, void **l, void **r)
+{
+	void *sub;
+
+	if (t == NULL)
+	{
+		*l = *r = NULL;
+		return;
+	}
+	if (TREE_BEFORE(h, t, key))
+	{
+		tree_split(h, TREE_RIGHT(h, t), key, &sub, r);
+		SET_RIGHT(h, t, sub);
+		*l = t;
+	}
+	else
+	{
+		tree_split(h, TREE_LEFT(h, t), key, l, &sub);
+		SET_LEFT(h, t, sub);
+		*r = t;
+	}
+	tree_update(h, t);
+}
+
+/* 
+ * Function Name:	tree_update
+ * Argument:		Tree node
+ * Return Type: 	void
+ * Description:		Recompute the largest block size in the node's subtree from its children
+ */
+static void tree_update(mm_heap_t *h, void *t)
+{
+	unsigned int max = GET_SIZE(HDRP(t));
+	unsigned int left = TREE_MAX(TREE_LEFT(h, t));
+	unsigned int right = TREE_MAX(TREE_RIGHT(h, t));
+
+	max = MAX(max, MAX(left, right));
+	PUT_OFF((char *)t + WSIZE, max);
+}
+
+/* 
+ * Function Name:	tree_first_fit
+ * Argument:		Size of block
+ * Return Type: 	Lowest addressed free block of at least asize bytes, NULL if none
+ * Description:		Address-ordered first fit in O(log n): go left while the left subtree holds a big enough block
+ */
+static void *tree_first_fit(mm_heap_t *h, size_t asize)
+{
+	void *t = FREELIST_HEAD(h);
+	void *left;
+
+	if (TREE_MAX(t) < asize)
+		return NULL;
+	for (;;)
+	{
+		left = TREE_LEFT(h, t);
+		if (TREE_MAX(left) >= asize)
+			t = left;
+		else if ((size_t)GET_SIZE(HDRP(t)) >= asize)
+			return t;
+		else
+			t = TREE_RIGHT(h, t);
+	}
+}
+
+/* 
+ * Function Name:	tree_best_fit
+ * Argument:		Size of block
+ * Return Type: 	Smallest free block of at least asize bytes in the size tree, lowest addressed among equals, NULL if none
+ * Description:		Best fit in O(log n): every block that fits is a candidate, and the search goes on left of it
+ */
+static void *tree_best_fit(mm_heap_t *h, size_t asize)
+{
+	void *t = SIZE_ROOT(h);
+	void *fit = NULL;
+
+	while (t != NULL)
+	{
+		if ((size_t)GET_SIZE(HDRP(t)) >= asize)
+		{
+			fit = t;
+			t = TREE_LEFT(h, t);
+		}
+		else
+			t = TREE_RIGHT(h, t);
+	}
+	return fit;
 }
@@ -4,6 +4,43 @@ extern int mm_init (void);
 extern void *mm_malloc (size_t size);
 extern void mm_free (void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
+extern int mm_attach (void);
+extern void mm_setroot(void *ptr);
+extern void *mm_getroot(void);
+
+/* Independent heaps, each in its own memlib region; mm_malloc and friends use the default heap */
+typedef struct mm_heap mm_heap_t;
+
+extern mm_heap_t *mm_heap_create(size_t maxsize);
+extern void mm_heap_destroy(mm_heap_t *h);
+extern void *mm_heap_malloc(mm_heap_t *h, size_t size);
+extern void mm_heap_free(mm_heap_t *h, void *ptr);
+extern void *mm_heap_realloc(mm_heap_t *h, void *ptr, size_t size);
+extern int mm_heap_owns(mm_heap_t *h, void *ptr);
+
+/* Free block policies, selectable per heap */
+#define MM_POLICY_LIFO		0			//LIFO free list, first fit (default)
+#define MM_POLICY_ADDRESS	1			//address-ordered first fit over a balanced tree
+#define MM_POLICY_BEST		2			//LIFO list for small blocks, best fit over a size tree for large ones
+
+extern int mm_heap_policy(mm_heap_t *h, int policy);
+
+/* Lifetime hints: each class is placed in a heap of its own; mm_free and mm_realloc find the heap */
+#define MM_HINT_NONE		0			//unknown lifetime, default heap
+#define MM_HINT_SHORT		1			//freed soon, typically within a burst of allocations
+#define MM_HINT_LONG		2			//outlives the bursts around it
+#define MM_HINT_PERMANENT	4			//rarely or never freed
+
+extern void *mm_malloc_hint(size_t size, int hint);
+extern void mm_predict(int frames);
+
+/* Relocatable blocks behind handles: mm_hcompact slides them together and shrinks their heap */
+typedef void **mm_handle_t;
+
+extern mm_handle_t mm_halloc(size_t size);
+extern void *mm_hderef(mm_handle_t hd);
+extern void mm_hfree(mm_handle_t hd);
+extern int mm_hcompact(size_t budget);
 
 /******************************************/
 #define WSIZE 			4			//word size
@@ -33,8 +70,21 @@ extern void *mm_realloc(void *ptr, size_t size);
 
 
 
-#define FREE_NEXT(bp)(*(void **)(bp + DSIZE))
-#define FREE_PREV(bp)(*(void **)(bp))
+/* Free list links are stored as offsets from the start of the heap (0 is NULL), 
+ * so a heap mapped back in at another address keeps valid links; mm.c keeps the
+ * LIFO list's next links as raw pointers in a heap that can't move */
+#define GET_OFF(p)		(*(unsigned int *)(p))				//read heap offset from address p
+#define PUT_OFF(p,off)		(*(unsigned int *)(p) = (off))			//write heap offset at address p
+#define PTR2OFF(base,bp)	((bp) ? (unsigned int)((char *)(bp) - (base)) : 0)	//pointer to heap offset
+#define OFF2PTR(base,off)	((off) ? (void *)((base) + (off)) : NULL)	//heap offset to pointer
+
+#define FREE_NEXT(base,bp)	OFF2PTR(base, GET_OFF((char *)(bp) + DSIZE))	//next free block
+#define FREE_PREV(base,bp)	OFF2PTR(base, GET_OFF(bp))			//previous free block
+#define SET_NEXT(base,bp,p)	PUT_OFF((char *)(bp) + DSIZE, PTR2OFF(base, p))	//set next free block
+#define SET_PREV(base,bp,p)	PUT_OFF(bp, PTR2OFF(base, p))			//set previous free block
+
+
+
 
 /* Min block size to contain pointers and boundary tags*/
 #define MIN_BLOCK_SIZE		24
@@ -0,0 +1,597 @@
+/*
+ * mmrec.c - An LD_PRELOAD library that records the allocation requests
+ *     of any program as a trace mdriver can replay:
+ *
+ *         unix> make libmmrec.so
+ *         unix> MMREC_OUT=ls.rep LD_PRELOAD=./libmmrec.so ls -l
+ *         unix> mdriver -V -f ls.rep
+ *
+ *     Environment:
+ *         MMREC_OUT     trace to write (default mmrec.rep); a %p in it is
+ *                       replaced by the process id, which keeps the
+ *                       programs a recorded one runs from sharing it
+ *         MMREC_FORMAT  text (default), binary or varint
+ *
+ * malloc, calloc, realloc, free, memalign, posix_memalign and
+ * aligned_alloc are passed on to the next definition (libc's), and
+ * each request is appended to a buffer of the calling thread, stamped
+ * with a number from a global sequence counter. Full buffers are
+ * written to a raw log, MMREC_OUT.raw, so recording costs an atomic
+ * increment and a store per request. At exit the raw log is sorted by
+ * sequence number and converted: each address is given a stable block
+ * id from its allocation to its free, each thread a tid in the order
+ * of its first request, blocks still live are freed, and the result is
+ * written with the trace.c writers. An aligned allocation is recorded
+ * as a plain one; the alignment is lost. A request for 0 bytes is
+ * recorded as one for 1, which mm_malloc serves where it returns NULL
+ * for 0.
+ *
+ * A free is numbered before it is passed on, and an allocation after,
+ * so an address reused by another thread is always released in the
+ * trace before it is taken again. A realloc that may move the block
+ * is numbered both before (releasing the old address) and after
+ * (taking the new one).
+ *
+ * Requests made by the recorder itself, or before dlsym has found the
+ * libc functions, are not recorded; the latter are served from a small
+ * static pool. Nothing is recorded in the child of a fork, or after
+ * exit has started. A process that ends in _exit, exec or a signal
+ * leaves only the raw log.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "trace.h"
+
+#define REC_BUF      4096          /* records per thread buffer */
+#define BOOT_POOL    8192          /* bytes for requests made during dlsym */
+#define MIN(x, y)    ((x) < (y) ? (x) : (y))
+
+/* Raw record types */
+#define R_ALLOC      0             /* addr allocated with size bytes */
+#define R_FREE       1             /* addr freed */
+#define R_MOVE       2             /* realloc: addr released, to come back as... */
+#define R_MOVED      3             /* ... addr, size bytes (0 if it failed: addr2 kept) */
+
+/* One request in the raw log */
+typedef struct {
+    uint64_t seq;      /* position in the global order */
+    uint64_t addr;
+    uint64_t addr2;    /* R_MOVED: the old address */
+    uint64_t size;
+    uint32_t tid;
+    uint32_t type;
+} rec_t;
+
+/* A thread's record buffer, on the list of all of them */
+typedef struct recbuf {
+    int n;
+    uint32_t tid;
+    struct recbuf *next;
+    rec_t recs[REC_BUF];
+} recbuf_t;
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+static void *(*real_memalign)(size_t, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void *(*real_aligned_alloc)(size_t, size_t);
+
+static char boot_pool[BOOT_POOL];
+static size_t boot_used;
+
+static int recording;               /* set once the raw log is open */
+static int rawfd = -1;
+static char out_path[4096], raw_path[4096 + 8];
+static uint64_t seq;                 /* next sequence number */
+static uint32_t next_tid;
+static recbuf_t *bufs;               /* every thread's buffer */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t buf_key;
+
+static __thread recbuf_t *my_buf __attribute__((tls_model("initial-exec")));
+static __thread int busy __attribute__((tls_model("initial-exec")));
+
+/*
+ * boot_alloc - Serve a request made while dlsym is looking up the
+ *     libc functions. Such blocks are never freed.
+ */
+static void *boot_alloc(size_t size)
+{
+    void *p;
+
+    size = (size + 15) & ~(size_t)15;
+    if (boot_used + size > BOOT_POOL)
+	return NULL;
+    p = boot_pool + boot_used;
+    boot_used += size;
+    return p;
+}
+
+#define IN_BOOT(p) ((char *)(p) >= boot_pool && (char *)(p) < boot_pool + BOOT_POOL)
+
+/*
+ * flush - Append a buffer's records to the raw log and empty it
+ */
+static void flush(recbuf_t *b)
+{
+    size_t len = b->n * sizeof(rec_t), done = 0;
+    ssize_t w;
+
+    pthread_mutex_lock(&lock);
+    while (done < len && (w = write(rawfd, (char *)b->recs + done, len - done)) > 0)
+	done += w;
+    pthread_mutex_unlock(&lock);
+    b->n = 0;
+}
+
+/*
+ * thread_exit - Flush and drop the buffer of an exiting thread
+ */
+static void thread_exit(void *ptr)
+{
+    recbuf_t *b = ptr, **pp;
+
+    busy++;
+    flush(b);
+    pthread_mutex_lock(&lock);
+    for (pp = &bufs; *pp != b; pp = &(*pp)->next)
+	;
+    *pp = b->next;
+    pthread_mutex_unlock(&lock);
+    munmap(b, sizeof(recbuf_t));
+    my_buf = NULL;
+    busy--;
+}
+
+/*
+ * buffer - The calling thread's buffer, created on its first request.
+ *     NULL if the request should not be recorded.
+ */
+static recbuf_t *buffer(void)
+{
+    recbuf_t *b;
+
+    if (!recording || busy)
+	return NULL;
+    if ((b = my_buf) != NULL)
+	return b;
+
+    /* mmap rather than malloc, which would come back here */
+    b = mmap(NULL, sizeof(recbuf_t), PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED)
+	return NULL;
+    b->n = 0;
+    b->tid = __atomic_fetch_add(&next_tid, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&lock);
+    b->next = bufs;
+    bufs = b;
+    pthread_mutex_unlock(&lock);
+    busy++;
+    pthread_setspecific(buf_key, b);
+    busy--;
+    return my_buf = b;
+}
+
+/*
+ * record - Append a request to the calling thread's buffer
+ */
+static void record(recbuf_t *b, uint64_t s, int type, void *addr,
+		   void *addr2, size_t size)
+{
+    rec_t *r = &b->recs[b->n];
+
+    r->seq = s;
+    r->type = type;
+    r->tid = b->tid;
+    r->addr = (uintptr_t)addr;
+    r->addr2 = (uintptr_t)addr2;
+    r->size = size;
+    if (++b->n == REC_BUF) {
+	busy++;
+	flush(b);
+	busy--;
+    }
+}
+
+#define NEXT_SEQ() __atomic_fetch_add(&seq, 1, __ATOMIC_RELAXED)
+
+/*
+ * record_alloc - Record an allocation made by a wrapper, if it succeeded
+ */
+static void *record_alloc(void *p, size_t size)
+{
+    recbuf_t *b;
+
+    if (p != NULL && (b = buffer()) != NULL)
+	record(b, NEXT_SEQ(), R_ALLOC, p, NULL, size);
+    return p;
+}
+
+/*
+ * Address to block id map used by the conversion, open addressed
+ */
+typedef struct {
+    uint64_t *addr;   /* 0 marks an empty slot */
+    int *id;
+    size_t mask;
+    size_t n;
+} addrmap_t;
+
+#define ADDR_HASH(a, mask) ((size_t)(((a) >> 4) * 0x9e3779b97f4a7c15ULL) & (mask))
+
+static int map_grow(addrmap_t *m)
+{
+    addrmap_t old = *m;
+    size_t i, j;
+
+    m->mask = old.mask ? 2 * old.mask + 1 : 1023;
+    m->n = 0;
+    if ((m->addr = calloc(m->mask + 1, sizeof(uint64_t))) == NULL ||
+	(m->id = malloc((m->mask + 1) * sizeof(int))) == NULL)
+	return -1;
+    for (i = 0; old.mask && i <= old.mask; i++)
+	if (old.addr[i] != 0) {
+	    for (j = ADDR_HASH(old.addr[i], m->mask); m->addr[j]; j = (j + 1) & m->mask)
+		;
+	    m->addr[j] = old.addr[i];
+	    m->id[j] = old.id[i];
+	    m->n++;
+	}
+    free(old.addr);
+    free(old.id);
+    return 0;
+}
+
+/* map_put - Bind addr to id, replacing a stale binding */
+static int map_put(addrmap_t *m, uint64_t addr, int id)
+{
+    size_t i;
+
+    if (2 * (m->n + 1) > m->mask && map_grow(m) < 0)
+	return -1;
+    for (i = ADDR_HASH(addr, m->mask); m->addr[i] && m->addr[i] != addr; i = (i + 1) & m->mask)
+	;
+    if (m->addr[i] == 0)
+	m->n++;
+    m->addr[i] = addr;
+    m->id[i] = id;
+    return 0;
+}
+
+/* map_take - Unbind addr and return its id, -1 if unbound */
+static int map_take(addrmap_t *m, uint64_t addr)
+{
+    size_t i, j, k;
+    int id;
+
+    if (m->n == 0)
+	return -1;
+    for (i = ADDR_HASH(addr, m->mask); m->addr[i] != addr; i = (i + 1) & m->mask)
+	if (m->addr[i] == 0)
+	    return -1;
+    id = m->id[i];
+
+    /* Shift later entries of the cluster back over the hole */
+    for (j = (i + 1) & m->mask; m->addr[j]; j = (j + 1) & m->mask) {
+	k = ADDR_HASH(m->addr[j], m->mask);
+	if ((j > i && (k <= i || k > j)) || (j < i && (k <= i && k > j))) {
+	    m->addr[i] = m->addr[j];
+	    m->id[i] = m->id[j];
+	    i = j;
+	}
+    }
+    m->addr[i] = 0;
+    m->n--;
+    return id;
+}
+
+static int seq_cmp(const void *a, const void *b)
+{
+    uint64_t x = ((const rec_t *)a)->seq, y = ((const rec_t *)b)->seq;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * add_op - Append an op to tf, growing its array. Sizes are clamped
+ *     to 1 .. INT32_MAX, except a free's.
+ */
+static int add_op(trace_file_t *tf, int *max, int type, int id, uint64_t size, int tid)
+{
+    trace_op_t *op;
+
+    if (tf->num_ops == *max) {
+	*max = *max ? 2 * *max : 65536;
+	if ((op = realloc(tf->ops, *max * sizeof(trace_op_t))) == NULL)
+	    return -1;
+	tf->ops = op;
+    }
+    op = &tf->ops[tf->num_ops++];
+    op->type = type;
+    op->index = id;
+    op->size = (size > 0x7fffffff) ? 0x7fffffff : (int32_t)size;
+    if (op->size == 0 && type != TRACE_FREE)
+	op->size = 1;
+    op->tid = tid;
+    return 0;
+}
+
+/*
+ * convert - Turn the sorted raw records into a balanced trace. Returns
+ *     0, or -1 if out of memory.
+ */
+static int convert(rec_t *recs, size_t n, trace_file_t *tf)
+{
+    addrmap_t map = {NULL, NULL, 0, 0};
+    int *pending = NULL, *tids = NULL, max = 0, id, rc = -1;
+    uint32_t ntids = next_tid;
+    size_t i;
+    rec_t *r;
+
+    memset(tf, 0, sizeof(*tf));
+    tf->weight = 1;
+    if ((pending = malloc((ntids + 1) * sizeof(int))) == NULL ||
+	(tids = malloc((ntids + 1) * sizeof(int))) == NULL)
+	goto out;
+    for (i = 0; i <= ntids; i++)
+	tids[i] = pending[i] = -1;
+
+    for (i = 0; i < n; i++) {
+	r = &recs[i];
+	if (tids[r->tid] < 0)
+	    tids[r->tid] = tf->num_threads++;
+	switch (r->type) {
+	case R_ALLOC:
+	    if (map_put(&map, r->addr, tf->num_ids) < 0 ||
+		add_op(tf, &max, TRACE_ALLOC, tf->num_ids, r->size, tids[r->tid]) < 0)
+		goto out;
+	    tf->num_ids++;
+	    break;
+	case R_FREE:
+	    /* Blocks from before recording started are not in the trace */
+	    if ((id = map_take(&map, r->addr)) >= 0 &&
+		add_op(tf, &max, TRACE_FREE, id, 0, tids[r->tid]) < 0)
+		goto out;
+	    break;
+	case R_MOVE:
+	    pending[r->tid] = map_take(&map, r->addr);
+	    break;
+	case R_MOVED:
+	    if ((id = pending[r->tid]) < 0)
+		break;
+	    pending[r->tid] = -1;
+	    if (r->addr == 0)  /* failed: the block stays put */
+		id = map_put(&map, r->addr2, id);
+	    else if (map_put(&map, r->addr, id) < 0 ||
+		     add_op(tf, &max, TRACE_REALLOC, id, r->size, tids[r->tid]) < 0)
+		id = -1;
+	    if (id < 0)
+		goto out;
+	    break;
+	}
+    }
+
+    /* Free what is still live, to balance the trace */
+    for (i = 0; i < ntids; i++)
+	if (pending[i] >= 0 && add_op(tf, &max, TRACE_FREE, pending[i], 0, 0) < 0)
+	    goto out;
+    for (i = 0; map.mask && i <= map.mask; i++)
+	if (map.addr[i] != 0 &&
+	    add_op(tf, &max, TRACE_FREE, map.id[i], 0, 0) < 0)
+	    goto out;
+    rc = 0;
+
+out:
+    free(map.addr);
+    free(map.id);
+    free(pending);
+    free(tids);
+    return rc;
+}
+
+/*
+ * finish - At exit, stop recording, flush every buffer, and convert
+ *     the raw log into the trace at MMREC_OUT
+ */
+static void __attribute__((destructor)) finish(void)
+{
+    char *format = getenv("MMREC_FORMAT");
+    trace_file_t tf;
+    struct stat st;
+    recbuf_t *b;
+    rec_t *recs;
+    FILE *fp;
+    int rc;
+
+    if (!recording)
+	return;
+    busy++;
+    recording = 0;
+    for (b = bufs; b != NULL; b = b->next)
+	flush(b);
+    if (fstat(rawfd, &st) < 0 || st.st_size == 0 ||
+	(recs = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+		     rawfd, 0)) == MAP_FAILED) {
+	close(rawfd);
+	unlink(raw_path);
+	busy--;
+	return;
+    }
+    qsort(recs, st.st_size / sizeof(rec_t), sizeof(rec_t), seq_cmp);
+    if (convert(recs, st.st_size / sizeof(rec_t), &tf) < 0) {
+	fprintf(stderr, "mmrec: out of memory converting %s\n", raw_path);
+	busy--;
+	return;
+    }
+    munmap(recs, st.st_size);
+    close(rawfd);
+
+    tf.sugg_heapsize = 0;
+    if ((fp = fopen(out_path, "wb")) == NULL) {
+	perror(out_path);
+	busy--;
+	return;
+    }
+    if (format != NULL && strcmp(format, "binary") == 0)
+	rc = trace_write_binary(fp, &tf, 0);
+    else if (format != NULL && strcmp(format, "varint") == 0)
+	rc = trace_write_binary(fp, &tf, TRACE_F_VARINT);
+    else
+	rc = trace_write_text(fp, &tf);
+    if (fclose(fp) != 0 || rc < 0)
+	perror(out_path);
+    else
+	unlink(raw_path);
+    free(tf.ops);
+    busy--;
+}
+
+/* No recording in the child of a fork: it would share the raw log */
+static void fork_child(void)
+{
+    recording = 0;
+}
+
+/*
+ * init - Find the libc functions and open the raw log
+ */
+static void __attribute__((constructor)) init(void)
+{
+    char *out, *d;
+
+    if (real_malloc != NULL)
+	return;
+    busy++;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    real_memalign = dlsym(RTLD_NEXT, "memalign");
+    real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    real_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+
+    if ((out = getenv("MMREC_OUT")) == NULL)
+	out = "mmrec.rep";
+    for (d = out_path; *out && d < out_path + sizeof(out_path) - 24; out++)
+	if (out[0] == '%' && out[1] == 'p') {
+	    d += sprintf(d, "%d", (int)getpid());
+	    out++;
+	}
+	else
+	    *d++ = *out;
+    *d = '\0';
+    snprintf(raw_path, sizeof(raw_path), "%s.raw", out_path);
+    if ((rawfd = open(raw_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+	perror(raw_path);
+    else if (pthread_key_create(&buf_key, thread_exit) == 0) {
+	pthread_atfork(NULL, NULL, fork_child);
+	recording = 1;
+    }
+    busy--;
+}
+
+/*
+ * The wrappers
+ */
+
+void *malloc(size_t size)
+{
+    if (real_malloc == NULL) {
+	if (busy)
+	    return boot_alloc(size);
+	init();
+    }
+    return record_alloc(real_malloc(size), size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (real_calloc == NULL) {
+	/* dlsym itself calls calloc */
+	if (busy) {
+	    if (size && nmemb > (size_t)-1 / size)
+		return NULL;
+	    return boot_alloc(nmemb * size);  /* static, so already zero */
+	}
+	init();
+    }
+    p = real_calloc(nmemb, size);
+    return record_alloc(p, nmemb * size);
+}
+
+void free(void *ptr)
+{
+    recbuf_t *b;
+
+    if (ptr == NULL || IN_BOOT(ptr))
+	return;
+    if ((b = buffer()) != NULL)
+	record(b, NEXT_SEQ(), R_FREE, ptr, NULL, 0);
+    real_free(ptr);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    recbuf_t *b;
+    void *p;
+
+    if (ptr == NULL)
+	return malloc(size);
+    if (IN_BOOT(ptr)) {
+	if ((p = malloc(size)) != NULL)
+	    memcpy(p, ptr, MIN(size, (size_t)(boot_pool + BOOT_POOL - (char *)ptr)));
+	return p;
+    }
+    if ((b = buffer()) == NULL)
+	return real_realloc(ptr, size);
+    if (size == 0) {
+	record(b, NEXT_SEQ(), R_FREE, ptr, NULL, 0);
+	return real_realloc(ptr, size);
+    }
+    record(b, NEXT_SEQ(), R_MOVE, ptr, NULL, 0);
+    p = real_realloc(ptr, size);
+    if ((b = buffer()) != NULL)
+	record(b, NEXT_SEQ(), R_MOVED, p, ptr, p ? size : 0);
+    return p;
+}
+
+void *memalign(size_t alignment, size_t size)
+{
+    if (real_memalign == NULL)
+	init();
+    return record_alloc(real_memalign(alignment, size), size);
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (real_aligned_alloc == NULL)
+	init();
+    return record_alloc(real_aligned_alloc(alignment, size), size);
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    int rc;
+
+    if (real_posix_memalign == NULL)
+	init();
+    if ((rc = real_posix_memalign(memptr, alignment, size)) == 0)
+	record_alloc(*memptr, size);
+    return rc;
+}
@@ -0,0 +1,355 @@
+/*
+ * mmshim.c - Runs unmodified programs on the mm allocator: built into
+ *     libmm.so, it defines malloc and friends on top of an mm heap.
+ *
+ *         unix> make libmm.so
+ *         unix> LD_PRELOAD=./libmm.so ls -l
+ *
+ *     Environment:
+ *         MM_HEAP_SIZE  largest size of the heap in bytes (default 1GB,
+ *                       reserved as address space, not memory)
+ *         MM_POLICY     free block policy: lifo (default), address or best
+ *         MM_PREDICT    place blocks by predicted lifetime, with call sites
+ *                       made of this many return addresses (off by default;
+ *                       C++ programs need 2 or more to see past operator new)
+ *
+ * The heap is created with mm_heap_create on the first request, so it
+ * lives in an mmap'd memlib region rather than in memory from libc. One
+ * lock serializes the calls into it; pthread_atfork handlers take the
+ * lock across a fork, so the child never inherits a heap half way
+ * through an update.
+ *
+ * mm payloads are only 8-byte aligned, while malloc must return memory
+ * aligned for any type (16 bytes on the ABIs we run on). An aligned
+ * request takes align - 8 extra bytes and moves the pointer up to the
+ * boundary; the word below a moved pointer holds the distance moved
+ * with SHIFTED set, a bit the size word of an mm header never has, so
+ * free and malloc_usable_size find the block again. Requests the heap
+ * can't take (larger than MM_BIG, or with the heap full) get a mapping
+ * of their own, described by a big_t just below the pointer; memlib
+ * reports each time the heap turns out to be full on stderr, a sign
+ * MM_HEAP_SIZE is too small. Pointers from neither source were handed
+ * out by the dynamic linker before the shim took over, and free leaves
+ * them alone.
+ *
+ * With MM_PREDICT, each entry point takes its caller's site and the
+ * lifetime predictor (lifetime.c) sends blocks from sites whose blocks
+ * mostly live long to a second heap of the same size, as mm_malloc does
+ * with mm_predict. The predictor runs under the lock.
+ */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "lifetime.h"
+
+#define MM_ALIGN      16                  /* alignment of a malloc'd pointer */
+#define MM_BIG        ((size_t)1 << 28)   /* larger requests are mapped */
+#define HEAP_SIZE     ((size_t)1 << 30)   /* default MM_HEAP_SIZE */
+#define SHIFTED       0x2                 /* tags the word below a moved pointer */
+#define BIG_MAGIC     0x4d4d4247          /* "MMBG" tags a mapped block */
+
+/* Describes a block with a mapping of its own, just below its pointer */
+typedef struct {
+    void *base;        /* start of the mapping */
+    size_t len;        /* bytes mapped */
+    size_t magic;      /* BIG_MAGIC */
+} big_t;
+
+static mm_heap_t *heap;
+static mm_heap_t *long_heap;          /* MM_PREDICT: predicted long-lived blocks */
+static int predict;                   /* MM_PREDICT: frames in a call site, 0 if off */
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The call site of the entry point this is used in, NULL without MM_PREDICT */
+#define SITE()  (predict == 0 ? NULL : predict == 1 ? __builtin_return_address(0) : \
+		 lifetime_site(predict, 0))
+
+/*
+ * shim_init - Create the heap, and the long-lived heap with MM_PREDICT.
+ *     Runs once, from the first request.
+ */
+static void shim_init(void)
+{
+    char *s;
+    size_t size = HEAP_SIZE;
+    int policy = MM_POLICY_LIFO;
+
+    if ((s = getenv("MM_HEAP_SIZE")) != NULL && strtoull(s, NULL, 0) > 0)
+	size = strtoull(s, NULL, 0);
+    if ((s = getenv("MM_POLICY")) != NULL)
+	policy = strcmp(s, "address") == 0 ? MM_POLICY_ADDRESS :
+	    strcmp(s, "best") == 0 ? MM_POLICY_BEST : MM_POLICY_LIFO;
+    if ((heap = mm_heap_create(size)) == NULL)
+	return;
+    mm_heap_policy(heap, policy);
+    if ((s = getenv("MM_PREDICT")) != NULL && atoi(s) > 0 &&
+	(long_heap = mm_heap_create(size)) != NULL) {
+	mm_heap_policy(long_heap, policy);
+	predict = atoi(s);
+    }
+}
+
+/*
+ * The fork handlers: hold the lock across the fork, release it on
+ * both sides
+ */
+static void fork_prepare(void)
+{
+    pthread_mutex_lock(&lock);
+}
+
+static void fork_release(void)
+{
+    pthread_mutex_unlock(&lock);
+}
+
+/* Registered from a constructor, since pthread_atfork may itself malloc */
+static void __attribute__((constructor)) shim_atfork(void)
+{
+    pthread_atfork(fork_prepare, fork_release, fork_release);
+}
+
+/*
+ * big_alloc - Map a block of size bytes aligned to align. Returns
+ *     NULL if out of memory.
+ */
+static void *big_alloc(size_t align, size_t size)
+{
+    size_t page = mem_pagesize(), pad, len;
+    char *base, *p;
+    big_t *b;
+
+    pad = (sizeof(big_t) + align - 1) & ~(align - 1);
+    if (align > page)
+	pad += align;                 /* room to move up to the boundary */
+    if (size > SIZE_MAX - pad - page)
+	return NULL;
+    len = (pad + size + page - 1) & ~(page - 1);
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+	return NULL;
+    p = (char *)(((uintptr_t)base + pad) & ~(uintptr_t)(align - 1));
+    b = (big_t *)p - 1;
+    b->base = base;
+    b->len = len;
+    b->magic = BIG_MAGIC;
+    return p;
+}
+
+/*
+ * shim_alloc - Allocate size bytes aligned to align, a power of two
+ *     of at least 8, for call site site (NULL without MM_PREDICT).
+ *     Returns NULL, with errno set, if out of memory.
+ */
+static void *shim_alloc(size_t align, size_t size, void *site)
+{
+    char *bp = NULL, *p;
+    mm_heap_t *h;
+
+    if (heap == NULL)
+	pthread_once(&once, shim_init);
+    if (size == 0)
+	size = 1;
+    if (heap != NULL && size <= MM_BIG && align <= MM_BIG) {
+	pthread_mutex_lock(&lock);
+	h = (site != NULL && lifetime_predict(site, size) == MM_HINT_LONG) ?
+	    long_heap : heap;
+	bp = mm_heap_malloc(h, size + align - DSIZE);
+	pthread_mutex_unlock(&lock);
+    }
+    if (bp == NULL) {
+	if ((p = big_alloc(align, size)) == NULL)
+	    errno = ENOMEM;
+	return p;
+    }
+
+    p = (char *)(((uintptr_t)bp + align - 1) & ~(uintptr_t)(align - 1));
+    if (p != bp)
+	PUT(p - WSIZE, (p - bp) | SHIFTED);
+    if (site != NULL) {
+	pthread_mutex_lock(&lock);
+	lifetime_record(site, size, p);
+	pthread_mutex_unlock(&lock);
+    }
+    return p;
+}
+
+/*
+ * block_of - The mm block a pointer from shim_alloc lies in, and its
+ *     heap in *hp; NULL if it has a mapping of its own
+ */
+static char *block_of(void *ptr, mm_heap_t **hp)
+{
+    char *p = ptr;
+
+    if (heap != NULL && mm_heap_owns(heap, p))
+	*hp = heap;
+    else if (long_heap != NULL && mm_heap_owns(long_heap, p))
+	*hp = long_heap;
+    else
+	return NULL;
+    if (GET(p - WSIZE) & SHIFTED)
+	return p - (GET(p - WSIZE) & ~0x7);
+    return p;
+}
+
+/*
+ * usable - Bytes usable at ptr, 0 if it didn't come from shim_alloc
+ */
+static size_t usable(void *ptr)
+{
+    mm_heap_t *h;
+    char *bp = block_of(ptr, &h);
+    big_t *b = (big_t *)ptr - 1;
+
+    if (bp != NULL)
+	return GET_SIZE(HDRP(bp)) - DSIZE - ((char *)ptr - bp);
+    if (b->magic == BIG_MAGIC)
+	return (char *)b->base + b->len - (char *)ptr;
+    return 0;
+}
+
+void *malloc(size_t size)
+{
+    return shim_alloc(MM_ALIGN, size, SITE());
+}
+
+void free(void *ptr)
+{
+    mm_heap_t *h;
+    char *bp;
+    big_t *b;
+
+    if (ptr == NULL)
+	return;
+    if (predict) {
+	pthread_mutex_lock(&lock);
+	lifetime_free(ptr);
+	pthread_mutex_unlock(&lock);
+    }
+    if ((bp = block_of(ptr, &h)) != NULL) {
+	pthread_mutex_lock(&lock);
+	mm_heap_free(h, bp);
+	pthread_mutex_unlock(&lock);
+	return;
+    }
+    /* Anything else untagged came from before us (the dynamic linker): leave it */
+    b = (big_t *)ptr - 1;
+    if (b->magic == BIG_MAGIC)
+	munmap(b->base, b->len);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    void *p;
+
+    if (size && nmemb > SIZE_MAX / size) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    /* Not malloc, or the compiler turns malloc and memset back into calloc */
+    if ((p = shim_alloc(MM_ALIGN, nmemb * size, SITE())) != NULL)
+	memset(p, 0, nmemb * size);
+    return p;
+}
+
+/*
+ * realloc - Resized by mm_heap_realloc where the block was not moved
+ *     for alignment and the result stays aligned; copied to a new block
+ *     otherwise, or if the heap is full. The new block takes realloc's
+ *     call site, a resized one keeps its sample.
+ */
+void *realloc(void *ptr, size_t size)
+{
+    void *site = SITE();
+    mm_heap_t *h;
+    char *bp, *p, *old = ptr;
+    size_t n;
+
+    if (ptr == NULL)
+	return shim_alloc(MM_ALIGN, size, site);
+    if (size == 0) {
+	free(ptr);
+	return NULL;
+    }
+    if ((bp = block_of(ptr, &h)) == (char *)ptr && size <= MM_BIG) {
+	pthread_mutex_lock(&lock);
+	p = mm_heap_realloc(h, bp, size);
+	if (p != NULL && predict)
+	    lifetime_realloc(old, p);
+	pthread_mutex_unlock(&lock);
+	if (p != NULL && ((uintptr_t)p & (MM_ALIGN - 1)) == 0)
+	    return p;
+	if (p != NULL)
+	    ptr = p;           /* moved, but off the boundary */
+    }
+    if ((p = shim_alloc(MM_ALIGN, size, site)) == NULL)
+	return NULL;
+    if ((n = usable(ptr)) == 0)
+	n = size;              /* from the dynamic linker: size unknown */
+    memcpy(p, ptr, n < size ? n : size);
+    free(ptr);
+    return p;
+}
+
+/*
+ * shim_memalign - Allocate size bytes aligned to align, a power of two,
+ *     for call site site. Returns NULL, with errno set, on error.
+ */
+static void *shim_memalign(size_t align, size_t size, void *site)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+	errno = EINVAL;
+	return NULL;
+    }
+    return shim_alloc(align < MM_ALIGN ? MM_ALIGN : align, size, site);
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+{
+    void *p;
+
+    if (align < sizeof(void *) || (align & (align - 1)) != 0)
+	return EINVAL;
+    if ((p = shim_memalign(align, size, SITE())) == NULL)
+	return ENOMEM;
+    *memptr = p;
+    return 0;
+}
+
+void *memalign(size_t align, size_t size)
+{
+    return shim_memalign(align, size, SITE());
+}
+
+void *aligned_alloc(size_t align, size_t size)
+{
+    return shim_memalign(align, size, SITE());
+}
+
+void *valloc(size_t size)
+{
+    return shim_memalign(mem_pagesize(), size, SITE());
+}
+
+void *pvalloc(size_t size)
+{
+    size_t page = mem_pagesize();
+
+    return shim_memalign(page, (size + page - 1) & ~(page - 1), SITE());
+}
+
+size_t malloc_usable_size(void *ptr)
+{
+    return (ptr == NULL) ? 0 : usable(ptr);
+}
@@ -0,0 +1,714 @@
+/*
+ * mmtest.c - Checks of the parts of the package that mdriver's trace
+ *     replays don't reach. Each check is a subcommand that says what it
+ *     did and exits nonzero at the first thing that is wrong; "make
+ *     check" runs them all.
+ *
+ *     usage: mmtest resume <heapfile>
+ *            mmtest handles
+ *            mmtest scavenge
+ *            mmtest arena
+ *            mmtest pool
+ *            mmtest hint
+ *
+ *     resume   Run twice on the same file. The first run creates a
+ *              heap in it, builds a list of objects hanging off the
+ *              root (mm_setroot), frees some of them and exits. The
+ *              second maps the heap back in, most likely at another
+ *              address, resumes it with mm_attach and checks the root
+ *              and every object reachable from it, then frees and
+ *              allocates through the resumed free lists.
+ *
+ *     handles  Threads race to the first mm_halloc and then take and
+ *              give back handle slots together. Afterwards every
+ *              live handle must still reach its own data, including
+ *              across an mm_hcompact.
+ *
+ *     scavenge Fill a front-end cache of the small object tier, leave
+ *              it unused for two scavenges and check that the next
+ *              allocation empties it. Then threads allocate and free
+ *              while the scavenger runs, and every object must keep
+ *              what its thread wrote.
+ *
+ *     arena    For each chunk source: bump allocate until the arena's
+ *              capacity runs out, checking alignment and that no two
+ *              objects overlap, reset and check that the same calls
+ *              return the same memory, then release the arena.
+ *
+ *     pool     For several object sizes and alignments: every slot is
+ *              aligned as asked, slots are a whole number of alignments
+ *              apart (so MM_POOL_CACHELINE slots never share a cache
+ *              line), objects keep their data, and freed slots are the
+ *              ones handed out next.
+ *
+ *     hint     Allocate a mix of blocks, part of them with lifetime
+ *              hints (mm_malloc_hint). Hinted blocks must lie outside
+ *              the default heap, each class apart from the others, and
+ *              mm_realloc and mm_free must take them back to the heap
+ *              they came from.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "small.h"
+#include "arena.h"
+#include "pool.h"
+
+#define RESUME_OBJS  1000          /* objects built by the first resume run */
+#define HANDLE_THREADS 4           /* threads of the handles check */
+#define HANDLE_ROUNDS  20000       /* halloc/hfree pairs per thread */
+#define HANDLE_LIVE    64          /* handles each thread keeps at a time */
+#define SCAV_OBJS      32          /* objects that fill the scavenge check's cache */
+#define SCAV_THREADS   4           /* threads racing the scavenger */
+#define SCAV_ROUNDS    200000      /* malloc/free pairs per thread */
+#define ARENA_CHUNK    (16 * 1024) /* chunk size of the arena check */
+#define ARENA_CAP      (256 * 1024) /* its capacity */
+#define ARENA_OBJS     4096        /* most objects it allocates */
+#define POOL_OBJS      1000        /* objects per pool, several chunks */
+#define HINT_OBJS      2000        /* blocks of the hint check */
+
+/* An object of the resume check. Its link is an offset from the start
+   of the heap, as a pointer would be stale in the next run */
+typedef struct {
+    unsigned int next;             /* offset of the next object, 0 at the end */
+    int id;
+    int size;                      /* bytes of data */
+    unsigned char data[];          /* each byte id & 0xff */
+} obj_t;
+
+#define OBJ_AT(off)   ((obj_t *)((char *)mem_heap_lo() + (off)))
+#define OBJ_OFF(o)    ((unsigned int)((char *)(o) - (char *)mem_heap_lo()))
+
+static int fail(const char *check, const char *msg)
+{
+    fprintf(stderr, "%s: FAILED: %s\n", check, msg);
+    return 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: mmtest resume <heapfile>\n"
+	    "       mmtest handles\n"
+	    "       mmtest scavenge\n"
+	    "       mmtest arena\n"
+	    "       mmtest pool\n"
+	    "       mmtest hint\n");
+}
+
+/*
+ * new_obj - Allocate an object with id and fill its data, NULL if the
+ *     heap is full
+ */
+static obj_t *new_obj(int id)
+{
+    int size = 8 + (id * 37) % 500;
+    obj_t *o;
+
+    if ((o = mm_malloc(sizeof(obj_t) + size)) == NULL)
+	return NULL;
+    o->next = 0;
+    o->id = id;
+    o->size = size;
+    memset(o->data, id & 0xff, size);
+    return o;
+}
+
+/*
+ * obj_ok - Check the data of an object
+ */
+static int obj_ok(obj_t *o)
+{
+    int i;
+
+    for (i = 0; i < o->size; i++)
+	if (o->data[i] != (o->id & 0xff))
+	    return 0;
+    return 1;
+}
+
+/*
+ * resume_create - First run: a list of the objects with ids not
+ *     divisible by 3, in id order, with the others freed among them
+ */
+static int resume_create(const char *path)
+{
+    obj_t *o, *last = NULL;
+    obj_t *objs[RESUME_OBJS];
+    int i;
+
+    if (mm_init() < 0)
+	return fail("resume", "mm_init failed");
+    for (i = 0; i < RESUME_OBJS; i++) {
+	if ((objs[i] = new_obj(i)) == NULL)
+	    return fail("resume", "mm_malloc failed");
+    }
+    for (i = 0; i < RESUME_OBJS; i++) {
+	o = objs[i];
+	if (i % 3 == 0) {
+	    mm_free(o);
+	    continue;
+	}
+	if (last == NULL)
+	    mm_setroot(o);
+	else
+	    last->next = OBJ_OFF(o);
+	last = o;
+    }
+    printf("resume: created %d objects in %s, heap at %p\n",
+	   RESUME_OBJS - (RESUME_OBJS + 2) / 3, path, mem_heap_lo());
+    return 0;
+}
+
+/*
+ * resume_check - Second run: the list must be intact, and the heap
+ *     must keep working from the free lists it was left with
+ */
+static int resume_check(const char *path)
+{
+    obj_t *o, *extra[RESUME_OBJS];
+    int i, n = 0, id = 1;
+    char msg[128];
+
+    if (mm_attach() < 0)
+	return fail("resume", "mm_attach failed");
+    if ((o = mm_getroot()) == NULL)
+	return fail("resume", "no root");
+    for (; o != NULL; o = o->next ? OBJ_AT(o->next) : NULL, n++) {
+	if (o->id != id || !obj_ok(o)) {
+	    sprintf(msg, "object %d is not object %d, or its data is damaged", n, id);
+	    return fail("resume", msg);
+	}
+	id += (id % 3 == 2) ? 2 : 1;       /* skip the freed multiples of 3 */
+    }
+    if (n != RESUME_OBJS - (RESUME_OBJS + 2) / 3) {
+	sprintf(msg, "%d objects reachable from the root", n);
+	return fail("resume", msg);
+    }
+
+    /* Allocate into the holes, free every other object, check the rest */
+    for (i = 0; i < RESUME_OBJS; i++)
+	if ((extra[i] = new_obj(RESUME_OBJS + i)) == NULL)
+	    return fail("resume", "mm_malloc failed after mm_attach");
+    for (o = mm_getroot(); o != NULL; o = o->next ? OBJ_AT(o->next) : NULL)
+	if (o->next != 0 && OBJ_AT(o->next)->id % 2 == 0) {
+	    obj_t *dead = OBJ_AT(o->next);
+	    o->next = dead->next;
+	    mm_free(dead);
+	}
+    for (o = mm_getroot(); o != NULL; o = o->next ? OBJ_AT(o->next) : NULL)
+	if (!obj_ok(o))
+	    return fail("resume", "object damaged by the allocations after mm_attach");
+    for (i = 0; i < RESUME_OBJS; i++) {
+	if (!obj_ok(extra[i]))
+	    return fail("resume", "new object damaged");
+	mm_free(extra[i]);
+    }
+    printf("resume: %d objects intact in %s, heap at %p\n", n, path, mem_heap_lo());
+    return 0;
+}
+
+/*
+ * check_resume - Create the heap in path if it is new, else resume it
+ */
+static int check_resume(const char *path)
+{
+    switch (mem_init_file(path)) {
+    case 0:
+	return resume_create(path);
+    case 1:
+	return resume_check(path);
+    default:
+	perror(path);
+	return 1;
+    }
+}
+
+/*
+ * handle_ok - Check that every byte of a handle's block is tag
+ */
+static int handle_ok(mm_handle_t hd, int size, int tag)
+{
+    unsigned char *p = mm_hderef(hd);
+    int i;
+
+    for (i = 0; i < size; i++)
+	if (p[i] != (tag & 0xff))
+	    return 0;
+    return 1;
+}
+
+typedef struct {
+    int id;
+    int bad;                       /* set when a handle lost its data */
+    mm_handle_t live[HANDLE_LIVE];
+} handle_arg_t;
+
+#define HANDLE_SIZE(id, i)  (1 + ((id) * 131 + (i) * 17) % 200)
+#define HANDLE_TAG(id, i)   ((id) * HANDLE_LIVE + (i))
+
+/*
+ * handle_thread - Keep HANDLE_LIVE handles, replacing one per round
+ *     after checking it still holds what this thread wrote
+ */
+static void *handle_thread(void *vp)
+{
+    handle_arg_t *a = vp;
+    int r, i;
+
+    for (r = 0; r < HANDLE_ROUNDS; r++) {
+	i = r % HANDLE_LIVE;
+	if (a->live[i] != NULL) {
+	    if (!handle_ok(a->live[i], HANDLE_SIZE(a->id, i), HANDLE_TAG(a->id, i)))
+		a->bad = 1;
+	    mm_hfree(a->live[i]);
+	}
+	if ((a->live[i] = mm_halloc(HANDLE_SIZE(a->id, i))) == NULL) {
+	    a->bad = 1;
+	    break;
+	}
+	memset(mm_hderef(a->live[i]), HANDLE_TAG(a->id, i) & 0xff, HANDLE_SIZE(a->id, i));
+    }
+    return NULL;
+}
+
+/*
+ * check_handles - Run the threads, then compact and check every handle
+ */
+static int check_handles(void)
+{
+    pthread_t tid[HANDLE_THREADS];
+    handle_arg_t arg[HANDLE_THREADS];
+    int t, i, n = 0;
+
+    mem_init();
+    mem_threads(1);
+    if (mm_init() < 0)
+	return fail("handles", "mm_init failed");
+    memset(arg, 0, sizeof(arg));
+    for (t = 0; t < HANDLE_THREADS; t++) {
+	arg[t].id = t;
+	if (pthread_create(&tid[t], NULL, handle_thread, &arg[t]) != 0)
+	    return fail("handles", "pthread_create failed");
+    }
+    for (t = 0; t < HANDLE_THREADS; t++)
+	pthread_join(tid[t], NULL);
+    for (t = 0; t < HANDLE_THREADS; t++)
+	if (arg[t].bad)
+	    return fail("handles", "a handle lost its data or mm_halloc failed");
+
+    /* Free every other handle so compaction has blocks to move */
+    for (t = 0; t < HANDLE_THREADS; t++)
+	for (i = 0; i < HANDLE_LIVE; i += 2) {
+	    mm_hfree(arg[t].live[i]);
+	    arg[t].live[i] = NULL;
+	}
+    while (!mm_hcompact(1 << 16))
+	;
+    for (t = 0; t < HANDLE_THREADS; t++)
+	for (i = 0; i < HANDLE_LIVE; i++) {
+	    if (arg[t].live[i] == NULL)
+		continue;
+	    if (!handle_ok(arg[t].live[i], HANDLE_SIZE(t, i), HANDLE_TAG(t, i)))
+		return fail("handles", "a handle lost its data in mm_hcompact");
+	    mm_hfree(arg[t].live[i]);
+	    n++;
+	}
+    printf("handles: %d threads x %d rounds, %d handles intact after mm_hcompact\n",
+	   HANDLE_THREADS, HANDLE_ROUNDS, n);
+    return 0;
+}
+
+static int scav_running;            /* racing threads not finished yet */
+
+/*
+ * scav_thread - Allocate and free objects of every size class, each
+ *     filled with the round it was allocated in, checked before its free
+ */
+static void *scav_thread(void *vp)
+{
+    int *bad = vp, r, i, j;
+    unsigned char *live[16] = { NULL };
+    int size[16];
+
+    for (r = 0; r < SCAV_ROUNDS; r++) {
+	i = r % 16;
+	if (live[i] != NULL) {
+	    for (j = 0; j < size[i]; j++)
+		if (live[i][j] != (unsigned char)(r - 16))
+		    *bad = 1;
+	    mm_small_free(live[i]);
+	}
+	size[i] = 1 + (r * 97) % SMALL_MAX;
+	if ((live[i] = mm_small_malloc(size[i])) == NULL) {
+	    *bad = 1;
+	    break;
+	}
+	memset(live[i], r & 0xff, size[i]);
+    }
+    for (i = 0; i < 16; i++)
+	mm_small_free(live[i]);
+    __atomic_sub_fetch(&scav_running, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * check_scavenge - An idle cache is emptied by the next operation after
+ *     the scavenge that finds it idle, and scavenging while other
+ *     threads use the caches loses nothing
+ */
+static int check_scavenge(void)
+{
+    void *objs[SCAV_OBJS];
+    pthread_t tid[SCAV_THREADS];
+    int bad[SCAV_THREADS] = { 0 };
+    size_t before, flagged, after;
+    int i, t, n = 0;
+    char msg[128];
+
+    for (i = 0; i < SCAV_OBJS; i++)
+	if ((objs[i] = mm_small_malloc(1024)) == NULL)
+	    return fail("scavenge", "mm_small_malloc failed");
+    for (i = 0; i < SCAV_OBJS; i++)
+	mm_small_free(objs[i]);
+    if ((before = mm_small_cached()) < 1024)
+	return fail("scavenge", "the frees left nothing in the cache");
+
+    mm_small_scavenge();           /* clears the used mark */
+    mm_small_scavenge();           /* finds the cache idle */
+    flagged = mm_small_cached();
+    mm_small_free(mm_small_malloc(16));
+    after = mm_small_cached();
+    if (after >= 1024) {
+	sprintf(msg, "%zu bytes still cached after the idle cache was scavenged", after);
+	return fail("scavenge", msg);
+    }
+    printf("scavenge: %zu bytes cached, %zu after two scavenges, %zu after the next allocation\n",
+	   before, flagged, after);
+
+    /* Two scavenges back to back mark whatever wasn't used in between */
+    scav_running = SCAV_THREADS;
+    for (t = 0; t < SCAV_THREADS; t++)
+	if (pthread_create(&tid[t], NULL, scav_thread, &bad[t]) != 0)
+	    return fail("scavenge", "pthread_create failed");
+    while (__atomic_load_n(&scav_running, __ATOMIC_ACQUIRE) > 0) {
+	mm_small_scavenge();
+	mm_small_scavenge();
+	n += 2;
+	sched_yield();
+    }
+    for (t = 0; t < SCAV_THREADS; t++)
+	pthread_join(tid[t], NULL);
+    for (t = 0; t < SCAV_THREADS; t++)
+	if (bad[t])
+	    return fail("scavenge", "an object lost its data or mm_small_malloc failed");
+    printf("scavenge: %d threads x %d rounds with %d scavenges alongside\n", SCAV_THREADS, SCAV_ROUNDS, n);
+    return 0;
+}
+
+/*
+ * arena_fill - Allocate objects of varying sizes from an arena until it
+ *     is full, each filled with its number. Returns how many, -1 if an
+ *     object is misaligned or an earlier one was overwritten.
+ */
+static int arena_fill(mm_arena_t *a, unsigned char **objs, int *sizes)
+{
+    int i, j, n;
+
+    for (n = 0; n < ARENA_OBJS; n++) {
+	sizes[n] = 1 + (n * 211) % 3000;
+	if (n % 64 == 63)
+	    sizes[n] = 2 * ARENA_CHUNK;        /* bigger than a chunk */
+	if ((objs[n] = mm_arena_alloc(a, sizes[n])) == NULL)
+	    break;
+	if ((unsigned long)objs[n] % 8 != 0)
+	    return -1;
+	memset(objs[n], n & 0xff, sizes[n]);
+    }
+    for (i = 0; i < n; i++)
+	for (j = 0; j < sizes[i]; j++)
+	    if (objs[i][j] != (i & 0xff))
+		return -1;
+    return n;
+}
+
+/*
+ * check_arena_source - Fill, reset, refill and release an arena
+ */
+static int check_arena_source(int source, const char *name)
+{
+    static unsigned char *objs[ARENA_OBJS], *again[ARENA_OBJS];
+    static int sizes[ARENA_OBJS];
+    mm_arena_t *a;
+    size_t total = 0;
+    int i, n, m;
+    char msg[128];
+
+    if ((a = mm_arena_create(ARENA_CHUNK, ARENA_CAP, source)) == NULL)
+	return fail("arena", "mm_arena_create failed");
+    if ((n = arena_fill(a, objs, sizes)) < 0)
+	return fail("arena", "an object is misaligned or overlaps another");
+    for (i = 0; i < n; i++)
+	total += sizes[i];
+    if (n == ARENA_OBJS || total > ARENA_CAP || total < ARENA_CAP / 2) {
+	sprintf(msg, "%s arena held %zu bytes in %d objects, capacity %d", name, total, n, ARENA_CAP);
+	return fail("arena", msg);
+    }
+
+    /* A reset arena hands out the same memory to the same calls */
+    mm_arena_reset(a);
+    if ((m = arena_fill(a, again, sizes)) != n)
+	return fail("arena", "the arena holds less after a reset");
+    for (i = 0; i < n; i++)
+	if (again[i] != objs[i])
+	    return fail("arena", "a reset arena didn't reuse its memory");
+    mm_arena_release(a);
+    printf("arena: %s: %d objects, %zu bytes of %d, reused after reset\n", name, n, total, ARENA_CAP);
+    return 0;
+}
+
+/*
+ * check_arena - Both chunk sources; the chunks a released HEAP arena
+ *     gave back must then serve a large block without growing the heap
+ */
+static int check_arena(void)
+{
+    size_t heapsize;
+    void *p;
+
+    mem_init();
+    if (mm_init() < 0)
+	return fail("arena", "mm_init failed");
+    if (check_arena_source(MM_ARENA_SBRK, "sbrk") || check_arena_source(MM_ARENA_HEAP, "heap"))
+	return 1;
+    heapsize = mem_heapsize();
+    if ((p = mm_malloc(ARENA_CAP / 2)) == NULL)
+	return fail("arena", "mm_malloc failed after the release");
+    if (mem_heapsize() != heapsize)
+	return fail("arena", "the released chunks weren't given back to the mm heap");
+    mm_free(p);
+    return 0;
+}
+
+static int addr_cmp(const void *a, const void *b)
+{
+    char *x = *(char **)a, *y = *(char **)b;
+
+    return (x > y) - (x < y);
+}
+
+/*
+ * check_pool_shape - One pool of objsize byte objects aligned to align
+ */
+static int check_pool_shape(size_t objsize, size_t align)
+{
+    static unsigned char *objs[POOL_OBJS], *sorted[POOL_OBJS];
+    size_t slot = (objsize + align - 1) / align * align;
+    mm_pool_t *p;
+    size_t j;
+    int i;
+    char msg[128];
+
+    sprintf(msg, "pool of %zu byte objects aligned to %zu: ", objsize, align);
+    if ((p = mm_pool_create(objsize, align)) == NULL)
+	return fail("pool", strcat(msg, "mm_pool_create failed"));
+    for (i = 0; i < POOL_OBJS; i++) {
+	if ((objs[i] = mm_pool_alloc(p)) == NULL)
+	    return fail("pool", strcat(msg, "mm_pool_alloc failed"));
+	if ((unsigned long)objs[i] % align != 0)
+	    return fail("pool", strcat(msg, "misaligned slot"));
+	memset(objs[i], i & 0xff, objsize);
+    }
+
+    /* Slots are at least a padded slot apart, and keep their data */
+    memcpy(sorted, objs, sizeof(objs));
+    qsort(sorted, POOL_OBJS, sizeof(sorted[0]), addr_cmp);
+    for (i = 1; i < POOL_OBJS; i++)
+	if ((size_t)(sorted[i] - sorted[i - 1]) < slot)
+	    return fail("pool", strcat(msg, "slots closer than the padded slot size"));
+    for (i = 0; i < POOL_OBJS; i++)
+	for (j = 0; j < objsize; j++)
+	    if (objs[i][j] != (i & 0xff))
+		return fail("pool", strcat(msg, "an object was overwritten"));
+
+    /* The slots freed are the ones handed out next, most recent first */
+    for (i = 0; i < POOL_OBJS; i += 3)
+	mm_pool_free(p, objs[i]);
+    for (i -= 3; i >= 0; i -= 3)
+	if (mm_pool_alloc(p) != objs[i])
+	    return fail("pool", strcat(msg, "a freed slot wasn't reused"));
+    mm_pool_destroy(p);
+    printf("pool: %zu byte objects aligned to %zu: %d slots %zu bytes apart, reused\n",
+	   objsize, align, POOL_OBJS, slot);
+    return 0;
+}
+
+/*
+ * check_pool - Pools of a few shapes, and the arguments a pool refuses
+ */
+static int check_pool(void)
+{
+    mem_init();
+    if (mm_init() < 0)
+	return fail("pool", "mm_init failed");
+    if (check_pool_shape(24, sizeof(void *)) || check_pool_shape(100, 16) ||
+	check_pool_shape(8, MM_POOL_CACHELINE) || check_pool_shape(72, MM_POOL_CACHELINE) ||
+	check_pool_shape(1000, 256))
+	return 1;
+    if (mm_pool_create(0, 8) != NULL || mm_pool_create(16, 24) != NULL)
+	return fail("pool", "a bad size or alignment was accepted");
+    return 0;
+}
+
+/* hint_of - The hint block i of the hint check is allocated with */
+static int hint_of(int i)
+{
+    switch (i % 8) {
+    case 1: case 5:
+	return MM_HINT_LONG;
+    case 3:
+	return MM_HINT_PERMANENT;
+    case 6:
+	return MM_HINT_SHORT;
+    default:
+	return MM_HINT_NONE;
+    }
+}
+
+/* in_default_heap - Whether a block lies in the default heap */
+static int in_default_heap(void *p)
+{
+    return (char *)p > (char *)mem_heap_lo() && (char *)p <= (char *)mem_heap_hi();
+}
+
+/*
+ * hint_range - Lowest and highest address of the blocks with a hint,
+ *     and whether they are all outside the default heap
+ */
+static int hint_range(obj_t **objs, int hint, char **lo, char **hi)
+{
+    int i;
+
+    *lo = NULL;
+    *hi = NULL;
+    for (i = 0; i < HINT_OBJS; i++) {
+	if (objs[i] == NULL || hint_of(i) != hint)
+	    continue;
+	if (in_default_heap(objs[i]))
+	    return 0;
+	if (*lo == NULL || (char *)objs[i] < *lo)
+	    *lo = (char *)objs[i];
+	if ((char *)objs[i] + sizeof(obj_t) + objs[i]->size > *hi)
+	    *hi = (char *)objs[i] + sizeof(obj_t) + objs[i]->size;
+    }
+    return 1;
+}
+
+/*
+ * check_hint - Place, resize, free and place again hinted blocks
+ */
+static int check_hint(void)
+{
+    static const int hints[3] = { MM_HINT_SHORT, MM_HINT_LONG, MM_HINT_PERMANENT };
+    static obj_t *objs[HINT_OBJS];
+    char *lo[3], *hi[3], *lo2, *hi2;
+    size_t heapsize;
+    int i, j, size;
+
+    mem_init();
+    if (mm_init() < 0)
+	return fail("hint", "mm_init failed");
+    for (i = 0; i < HINT_OBJS; i++) {
+	size = 8 + (i * 37) % 500;
+	if ((objs[i] = mm_malloc_hint(sizeof(obj_t) + size, hint_of(i))) == NULL)
+	    return fail("hint", "mm_malloc_hint failed");
+	objs[i]->id = i;
+	objs[i]->size = size;
+	memset(objs[i]->data, i & 0xff, size);
+	if ((hint_of(i) == MM_HINT_NONE) != in_default_heap(objs[i]))
+	    return fail("hint", hint_of(i) == MM_HINT_NONE ? "an unhinted block is outside the default heap" :
+			"a hinted block is in the default heap");
+    }
+    for (j = 0; j < 3; j++)
+	if (!hint_range(objs, hints[j], &lo[j], &hi[j]) || lo[j] == NULL)
+	    return fail("hint", "a hinted block is in the default heap");
+    for (j = 0; j < 3; j++)
+	if (hi[j] > lo[(j + 1) % 3] && lo[j] < hi[(j + 1) % 3])
+	    return fail("hint", "two hint classes share a heap");
+
+    /* mm_realloc keeps a hinted block in its class's heap */
+    heapsize = mem_heapsize();
+    for (i = 0; i < HINT_OBJS; i++) {
+	if (hint_of(i) == MM_HINT_NONE)
+	    continue;
+	if ((objs[i] = mm_realloc(objs[i], sizeof(obj_t) + 2 * objs[i]->size)) == NULL)
+	    return fail("hint", "mm_realloc failed");
+	if (!obj_ok(objs[i]) || objs[i]->id != i)
+	    return fail("hint", "mm_realloc lost a hinted block's data");
+	memset(objs[i]->data, i & 0xff, 2 * objs[i]->size);
+	objs[i]->size *= 2;
+    }
+    for (j = 0; j < 3; j++) {
+	if (!hint_range(objs, hints[j], &lo2, &hi2))
+	    return fail("hint", "mm_realloc moved a hinted block into the default heap");
+	if (hi2 > lo[(j + 1) % 3] && lo2 < hi[(j + 1) % 3])
+	    return fail("hint", "mm_realloc moved a hinted block into another class's heap");
+	if (lo2 < lo[j])
+	    lo[j] = lo2;
+	if (hi2 > hi[j])
+	    hi[j] = hi2;
+    }
+    if (mem_heapsize() != heapsize)
+	return fail("hint", "mm_realloc of hinted blocks grew the default heap");
+
+    /* Freed into their own heaps, the same blocks fit there again */
+    for (i = 0; i < HINT_OBJS; i++)
+	if (hint_of(i) != MM_HINT_NONE) {
+	    mm_free(objs[i]);
+	    objs[i] = NULL;
+	}
+    for (i = 0; i < HINT_OBJS; i++) {
+	if (objs[i] != NULL) {
+	    if (!obj_ok(objs[i]))
+		return fail("hint", "freeing hinted blocks damaged an unhinted one");
+	    continue;
+	}
+	size = 2 * (8 + (i * 37) % 500);
+	if ((objs[i] = mm_malloc_hint(sizeof(obj_t) + size, hint_of(i))) == NULL)
+	    return fail("hint", "mm_malloc_hint failed after the frees");
+	objs[i]->size = 0;
+	for (j = 0; hints[j] != hint_of(i); j++)
+	    ;
+	if ((char *)objs[i] < lo[j] || (char *)objs[i] + sizeof(obj_t) + size > hi[j])
+	    return fail("hint", "a freed hinted block didn't go back to its heap");
+    }
+    if (mem_heapsize() != heapsize)
+	return fail("hint", "hinted blocks went to the default heap");
+    for (i = 0; i < HINT_OBJS; i++)
+	mm_free(objs[i]);
+    printf("hint: %d blocks, short/long/permanent each in a heap of their own, resized and freed there\n",
+	   HINT_OBJS);
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc == 3 && strcmp(argv[1], "resume") == 0)
+	return check_resume(argv[2]);
+    if (argc == 2 && strcmp(argv[1], "handles") == 0)
+	return check_handles();
+    if (argc == 2 && strcmp(argv[1], "scavenge") == 0)
+	return check_scavenge();
+    if (argc == 2 && strcmp(argv[1], "arena") == 0)
+	return check_arena();
+    if (argc == 2 && strcmp(argv[1], "pool") == 0)
+	return check_pool();
+    if (argc == 2 && strcmp(argv[1], "hint") == 0)
+	return check_hint();
+    usage();
+    return 2;
+}
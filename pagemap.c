@@ -0,0 +1,222 @@
+/*
+ * Radix-tree page map
+ *
+ * Maps every page of the address space to the metadata of whoever owns it (a span, a heap...) and a small size class,
+ * so a free path that has no block header can resolve a raw pointer. Keyed by page number (address >> PM_PAGE_SHIFT):
+ *
+ * 64-bit:	[ROOT 12 bits][MID 12 bits][LEAF 12 bits][page offset 12 bits]	=> 48-bit addresses, three levels
+ * 32-bit:	[ROOT 8 bits][LEAF 12 bits][page offset 12 bits]			=> 32-bit addresses, two levels
+ *
+ * The root is a static array, so a lookup is at most a load per level plus the entry itself. Each leaf keeps the size
+ * classes in their own byte array so lookups of neighbouring pages share cache lines.
+ *
+ * Nodes are never freed once published, and are published with a release store after being zeroed, so readers walk
+ * the tree with acquire loads and no lock. Node creation is serialized by a spin lock; entries themselves are written
+ * by the page owner, which must not race with another writer for the same pages. Node memory comes from a memlib
+ * region of its own (reserved, only touched as nodes are created) so the map never calls malloc.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pagemap.h"
+#include "memlib.h"
+
+#define PM_LEAF_BITS		12
+#define PM_LEAF_LEN		((size_t)1 << PM_LEAF_BITS)
+#if UINTPTR_MAX > 0xffffffffu
+#define PM_MID_BITS		12
+#define PM_ROOT_BITS		(48 - PM_PAGE_SHIFT - PM_LEAF_BITS - PM_MID_BITS)
+#else
+#define PM_MID_BITS		0
+#define PM_ROOT_BITS		(32 - PM_PAGE_SHIFT - PM_LEAF_BITS)
+#endif
+#define PM_MID_LEN		((size_t)1 << PM_MID_BITS)
+#define PM_ROOT_LEN		((size_t)1 << PM_ROOT_BITS)
+
+#define PM_LEAF_IDX(pn)		((pn) & (PM_LEAF_LEN - 1))
+#define PM_MID_IDX(pn)		(((pn) >> PM_LEAF_BITS) & (PM_MID_LEN - 1))
+#define PM_ROOT_IDX(pn)		((pn) >> (PM_LEAF_BITS + PM_MID_BITS))
+
+#define PM_NODE_ARENA		((size_t)1 << 30)		//address space reserved for nodes
+
+typedef struct {
+	void *owner[PM_LEAF_LEN];		/* Owner of each page, NULL if unmapped */
+	unsigned char sizeclass[PM_LEAF_LEN];	/* Size class of each page */
+} pm_leaf_t;
+
+#if PM_MID_BITS
+typedef struct {
+	pm_leaf_t *leaf[PM_MID_LEN];
+} pm_mid_t;
+
+static pm_mid_t *pm_root[PM_ROOT_LEN];
+#else
+static pm_leaf_t *pm_root[PM_ROOT_LEN];
+#endif
+
+static mem_region_t *pm_nodes;			/* Region the nodes are carved from */
+static int pm_lock;				/* Serializes node creation */
+
+#define LOAD(p)			__atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+#define PUBLISH(p,v)		__atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+
+static pm_leaf_t *get_leaf(size_t pn);
+
+
+/* 
+ * Function Name:	find_leaf
+ * Argument:		Page number
+ * Return Type: 	Leaf covering the page, NULL if there is none
+ * Description:		Read-side walk of the tree, acquire loads and no lock
+ */
+
+static inline pm_leaf_t *find_leaf(size_t pn)
+{
+#if PM_MID_BITS
+	pm_mid_t *mid = LOAD(pm_root[PM_ROOT_IDX(pn)]);
+
+	return mid ? LOAD(mid->leaf[PM_MID_IDX(pn)]) : NULL;
+#else
+	return LOAD(pm_root[PM_ROOT_IDX(pn)]);
+#endif
+}
+
+
+/* 
+ * Function Name:	pm_alloc_node
+ * Argument:		Node size in bytes
+ * Return Type: 	Pointer to zeroed node memory, NULL if the node region is full
+ * Description:		Carve a node from the node region, creating the region on first use. Called with pm_lock held.
+ */
+
+static void *pm_alloc_node(size_t size)
+{
+	void *node;
+
+	if (pm_nodes == NULL && (pm_nodes = mem_region_create(PM_NODE_ARENA)) == NULL)
+		return NULL;
+	size = (size + 63) & ~(size_t)63;
+	if ((node = mem_region_sbrk(pm_nodes, size)) == (void *)-1)
+		return NULL;
+	return node;				/* fresh anonymous memory is already zero */
+}
+
+
+/* 
+ * Function Name:	get_leaf
+ * Argument:		Page number
+ * Return Type: 	Leaf covering the page, NULL if there is no memory to create it
+ * Description:		Walk the tree, creating missing nodes. Creation re-checks under pm_lock so two writers can't publish the
+			same node twice.
+ */
+
+static pm_leaf_t *get_leaf(size_t pn)
+{
+#if PM_MID_BITS
+	pm_mid_t *mid, **midp = &pm_root[PM_ROOT_IDX(pn)];
+	pm_leaf_t *leaf, **leafp;
+
+	if ((mid = LOAD(*midp)) == NULL)
+	{
+		while (__atomic_exchange_n(&pm_lock, 1, __ATOMIC_ACQUIRE))
+			;
+		if ((mid = LOAD(*midp)) == NULL && (mid = pm_alloc_node(sizeof(pm_mid_t))) != NULL)
+			PUBLISH(*midp, mid);
+		__atomic_store_n(&pm_lock, 0, __ATOMIC_RELEASE);
+		if (mid == NULL)
+			return NULL;
+	}
+	leafp = &mid->leaf[PM_MID_IDX(pn)];
+#else
+	pm_leaf_t *leaf, **leafp = &pm_root[PM_ROOT_IDX(pn)];
+#endif
+
+	if ((leaf = LOAD(*leafp)) == NULL)
+	{
+		while (__atomic_exchange_n(&pm_lock, 1, __ATOMIC_ACQUIRE))
+			;
+		if ((leaf = LOAD(*leafp)) == NULL && (leaf = pm_alloc_node(sizeof(pm_leaf_t))) != NULL)
+			PUBLISH(*leafp, leaf);
+		__atomic_store_n(&pm_lock, 0, __ATOMIC_RELEASE);
+	}
+	return leaf;
+}
+
+
+/* 
+ * Function Name:	pagemap_set
+ * Argument:		First byte of the range (page aligned), number of pages, owner, size class (0-255)
+ * Return Type: 	0 on success, -1 if a node could not be created
+ * Description:		Record owner and size class for every page of the range
+ */
+
+int pagemap_set(void *addr, size_t npages, void *owner, int sizeclass)
+{
+	size_t pn = PM_PAGENUM(addr);
+	pm_leaf_t *leaf = NULL;
+
+	for (; npages > 0; npages--, pn++)
+	{
+		if (leaf == NULL || PM_LEAF_IDX(pn) == 0)
+			if ((leaf = get_leaf(pn)) == NULL)
+				return -1;
+		leaf->sizeclass[PM_LEAF_IDX(pn)] = (unsigned char)sizeclass;
+		__atomic_store_n(&leaf->owner[PM_LEAF_IDX(pn)], owner, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+
+/* 
+ * Function Name:	pagemap_clear
+ * Argument:		First byte of the range (page aligned), number of pages
+ * Return Type: 	void
+ * Description:		Forget the owner of every page of the range
+ */
+
+void pagemap_clear(void *addr, size_t npages)
+{
+	size_t pn = PM_PAGENUM(addr);
+	pm_leaf_t *leaf;
+
+	for (; npages > 0; npages--, pn++)
+		if ((leaf = find_leaf(pn)) != NULL)
+		{
+			__atomic_store_n(&leaf->owner[PM_LEAF_IDX(pn)], NULL, __ATOMIC_RELEASE);
+			leaf->sizeclass[PM_LEAF_IDX(pn)] = 0;
+		}
+}
+
+
+/* 
+ * Function Name:	pagemap_owner
+ * Argument:		Any address
+ * Return Type: 	Owner recorded for the page holding it, NULL if none
+ * Description:		Lock-free lookup, one load per level
+ */
+
+void *pagemap_owner(void *p)
+{
+	size_t pn = PM_PAGENUM(p);
+	pm_leaf_t *leaf = find_leaf(pn);
+
+	return leaf ? __atomic_load_n(&leaf->owner[PM_LEAF_IDX(pn)], __ATOMIC_ACQUIRE) : NULL;
+}
+
+
+/* 
+ * Function Name:	pagemap_sizeclass
+ * Argument:		Any address
+ * Return Type: 	Size class recorded for the page holding it, 0 if none
+ * Description:		Lock-free lookup, one load per level
+ */
+
+int pagemap_sizeclass(void *p)
+{
+	size_t pn = PM_PAGENUM(p);
+	pm_leaf_t *leaf = find_leaf(pn);
+
+	return leaf ? leaf->sizeclass[PM_LEAF_IDX(pn)] : 0;
+}
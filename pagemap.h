@@ -0,0 +1,14 @@
+#include <stdio.h>
+
+/*
+ * Radix page map: page number -> (owner, size class) for any address.
+ * Reads take no lock; writers must not update the same pages concurrently.
+ */
+#define PM_PAGE_SHIFT		12				//page size used by the page map and the span allocator
+#define PM_PAGE_SIZE		((size_t)1 << PM_PAGE_SHIFT)
+#define PM_PAGENUM(p)		((size_t)(p) >> PM_PAGE_SHIFT)	//page number of address p
+
+extern int pagemap_set(void *addr, size_t npages, void *owner, int sizeclass);
+extern void pagemap_clear(void *addr, size_t npages);
+extern void *pagemap_owner(void *p);
+extern int pagemap_sizeclass(void *p);
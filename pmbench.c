@@ -0,0 +1,126 @@
+/*
+ * pmbench.c - Measures what it costs the free path to find a block's
+ *     metadata: the boundary tag read GET_SIZE(HDRP(bp)) that mm_free
+ *     does today, against a page map lookup of the owner and size class
+ *     (what a headerless small-object free would do).
+ *
+ *     usage: pmbench [-n <blocks>] [-r <reps>]
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mm.h"
+#include "memlib.h"
+#include "pagemap.h"
+#include "ftimer.h"
+
+/* Parameters passed to the timed functions */
+typedef struct {
+    void **blocks;      /* payload pointers to look up */
+    int n;              /* number of pointers */
+    size_t sink;        /* keeps the lookups from being optimized away */
+} bench_t;
+
+/*
+ * hdr_lookup - read the size from each block's header, as mm_free does
+ */
+static void hdr_lookup(void *argp)
+{
+    bench_t *b = argp;
+    size_t sum = 0;
+    int i;
+
+    for (i = 0; i < b->n; i++)
+	sum += GET_SIZE(HDRP(b->blocks[i]));
+    b->sink += sum;
+}
+
+/*
+ * pm_lookup - resolve owner and size class of each block via the page map
+ */
+static void pm_lookup(void *argp)
+{
+    bench_t *b = argp;
+    size_t sum = 0;
+    int i;
+
+    for (i = 0; i < b->n; i++)
+	sum += pagemap_sizeclass(b->blocks[i]) + (pagemap_owner(b->blocks[i]) != NULL);
+    b->sink += sum;
+}
+
+/*
+ * report - time one lookup function and print ns per lookup
+ */
+static void report(char *name, ftimer_test_funct f, bench_t *b, int reps)
+{
+    double secs = ftimer_gettod(f, b, reps);
+    printf("%-28s %8.2f ns/lookup\n", name, secs * 1e9 / b->n);
+}
+
+int main(int argc, char **argv)
+{
+    int n = 200000, reps = 20;
+    int i, j, c;
+    bench_t b;
+    void *tmp;
+    char *lo;
+
+    while ((c = getopt(argc, argv, "n:r:")) != EOF) {
+	switch (c) {
+	case 'n':
+	    n = atoi(optarg);
+	    break;
+	case 'r':
+	    reps = atoi(optarg);
+	    break;
+	default:
+	    fprintf(stderr, "usage: pmbench [-n <blocks>] [-r <reps>]\n");
+	    exit(1);
+	}
+    }
+
+    /* Fill the default heap with blocks of mixed small sizes */
+    mem_init();
+    if (mm_init() < 0) {
+	fprintf(stderr, "mm_init failed\n");
+	exit(1);
+    }
+    if ((b.blocks = malloc(n * sizeof(void *))) == NULL) {
+	fprintf(stderr, "malloc failed\n");
+	exit(1);
+    }
+    srand(1);
+    for (i = 0; i < n; i++)
+	if ((b.blocks[i] = mm_malloc(8 + rand() % 120)) == NULL) {
+	    fprintf(stderr, "mm_malloc failed after %d blocks\n", i);
+	    exit(1);
+	}
+    b.n = n;
+    b.sink = 0;
+
+    /* Map every heap page to the heap, with a dummy size class */
+    lo = (char *)((size_t)mem_heap_lo() & ~(PM_PAGE_SIZE - 1));
+    if (pagemap_set(lo, PM_PAGENUM((char *)mem_heap_hi() - lo) + 1, 
+		    mem_default_region(), 1) < 0) {
+	fprintf(stderr, "pagemap_set failed\n");
+	exit(1);
+    }
+
+    printf("%d blocks, %zu heap bytes\n", n, mem_heapsize());
+    report("header read, address order", hdr_lookup, &b, reps);
+    report("page map, address order", pm_lookup, &b, reps);
+
+    /* Random order defeats the prefetcher, as frees usually do */
+    for (i = n - 1; i > 0; i--) {
+	j = rand() % (i + 1);
+	tmp = b.blocks[i];
+	b.blocks[i] = b.blocks[j];
+	b.blocks[j] = tmp;
+    }
+    report("header read, random order", hdr_lookup, &b, reps);
+    report("page map, random order", pm_lookup, &b, reps);
+
+    return (b.sink == 0);
+}
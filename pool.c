@@ -0,0 +1,154 @@
+/*
+ * Fixed-size object pool on top of mm
+ *
+ * Slots all have the same size and are carved from chunks of whole pages taken from the span allocator. A free slot
+ * holds the link to the next free slot in its first word, so the free list needs no memory of its own:
+ * [NEXT:---unused---]		=> Free slot format
+ * [-----OBJECT------]		=> Allocated slot format
+ *
+ * The slot size is the object size rounded up to a multiple of the alignment. With align = MM_POOL_CACHELINE every
+ * slot covers whole cache lines, so objects handed to different threads never share a line (no false sharing).
+ * Fresh chunks are carved lazily by a bump pointer, so slots are only touched when they are first handed out.
+ *
+ * Chunks are spans, so they are page aligned and every slot is aligned without padding; the pool links its spans
+ * through their span_t for mm_pool_destroy, which hands them back to the span allocator. The pool descriptor itself
+ * comes from the default mm heap.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+#include "mm.h"
+#include "span.h"
+#include "pagemap.h"
+
+#define POOL_CHUNK_SLOTS	64				//slots per chunk (at least)
+#define POOL_CHUNK_MIN		(16*1024)			//bytes per chunk (at least)
+
+#define POOL_ROUND(n,a)		(((n) + ((a)-1)) & ~(size_t)((a)-1))	//round n up to a multiple of a (a power of 2)
+#define SLOT_NEXT(s)		(*(void **)(s))			//next free slot, stored in the slot itself
+
+struct mm_pool {
+	void *freelist;				/* First free slot */
+	char *ptr;				/* Next never used slot in the current chunk */
+	char *end;				/* End of the current chunk */
+	size_t slotsize;			/* Bytes per slot */
+	size_t align;				/* Slot alignment */
+	size_t chunkpages;			/* Pages taken from the span allocator per chunk */
+	span_t *chunks;				/* Chunks, linked through span_t next */
+};
+
+static int pool_grow(mm_pool_t *p);
+
+
+/* 
+ * Function Name:	mm_pool_create
+ * Argument:		Object size in bytes, slot alignment in bytes (a power of 2 up to PM_PAGE_SIZE, MM_POOL_CACHELINE to pad
+			slots to cache lines)
+ * Return Type: 	Pointer to the new pool, NULL on a bad argument or no memory
+ * Description:		Create an empty pool of objsize byte objects. Alignments below a pointer are raised to a pointer so a free
+			slot can hold its link.
+ */
+
+mm_pool_t *mm_pool_create(size_t objsize, size_t align)
+{
+	mm_pool_t *p;
+
+	if (objsize == 0 || (align & (align - 1)) != 0 || align > PM_PAGE_SIZE)
+		return NULL;
+	if (align < sizeof(void *))
+		align = sizeof(void *);
+
+	if ((p = mm_malloc(sizeof(mm_pool_t))) == NULL)
+		return NULL;
+	memset(p, 0, sizeof(*p));
+	p->align = align;
+	p->slotsize = POOL_ROUND(objsize, align);
+	p->chunkpages = POOL_ROUND(MAX(POOL_CHUNK_MIN, POOL_CHUNK_SLOTS * p->slotsize), PM_PAGE_SIZE) >> PM_PAGE_SHIFT;
+	return p;
+}
+
+
+/* 
+ * Function Name:	mm_pool_alloc
+ * Argument:		Pool
+ * Return Type: 	Pointer to a slot, NULL if no memory
+ * Description:		Pop the free list; if it is empty, carve the next slot from the current chunk, growing the pool when the
+			chunk is used up
+ */
+
+void *mm_pool_alloc(mm_pool_t *p)
+{
+	void *s;
+
+	if ((s = p->freelist) != NULL)
+	{
+		p->freelist = SLOT_NEXT(s);
+		return s;
+	}
+	if (p->ptr == p->end && pool_grow(p) < 0)
+		return NULL;
+	s = p->ptr;
+	p->ptr += p->slotsize;
+	return s;
+}
+
+
+/* 
+ * Function Name:	mm_pool_free
+ * Argument:		Pool, slot returned by mm_pool_alloc on that pool
+ * Return Type: 	void
+ * Description:		Push the slot on the free list
+ */
+
+void mm_pool_free(mm_pool_t *p, void *obj)
+{
+	if (obj == NULL)
+		return;
+	SLOT_NEXT(obj) = p->freelist;
+	p->freelist = obj;
+}
+
+
+/* 
+ * Function Name:	pool_grow
+ * Argument:		Pool
+ * Return Type: 	0 on success, -1 if the span allocator is out of memory
+ * Description:		Take a new span and make it the current chunk
+ */
+
+static int pool_grow(mm_pool_t *p)
+{
+	span_t *s;
+
+	if ((s = span_alloc(p->chunkpages)) == NULL)
+		return -1;
+	s->owner = p;
+	s->next = p->chunks;
+	p->chunks = s;
+
+	p->ptr = s->start;
+	p->end = p->ptr + (p->chunkpages << PM_PAGE_SHIFT) / p->slotsize * p->slotsize;
+	return 0;
+}
+
+
+/* 
+ * Function Name:	mm_pool_destroy
+ * Argument:		Pool
+ * Return Type: 	void
+ * Description:		Give every chunk of the pool back to the span allocator, and with them every object still allocated from it
+ */
+
+void mm_pool_destroy(mm_pool_t *p)
+{
+	span_t *s, *next;
+
+	for (s = p->chunks; s != NULL; s = next)
+	{
+		next = s->next;
+		span_free(s);
+	}
+	mm_free(p);
+}
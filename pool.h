@@ -0,0 +1,13 @@
+#include <stdio.h>
+
+/*
+ * Fixed-size object pools: one intrusive free list of same-size slots, O(1) alloc and free.
+ */
+typedef struct mm_pool mm_pool_t;
+
+#define MM_POOL_CACHELINE	64			//pass as align to pad every slot to whole cache lines
+
+extern mm_pool_t *mm_pool_create(size_t objsize, size_t align);
+extern void *mm_pool_alloc(mm_pool_t *p);
+extern void mm_pool_free(mm_pool_t *p, void *obj);
+extern void mm_pool_destroy(mm_pool_t *p);
@@ -0,0 +1,1033 @@
+/*
+ * Small object tier with per-CPU caches
+ *
+ * Requests up to SMALL_MAX bytes are rounded up to one of SMALL_NCLASS size classes. Each class has three levels:
+ *
+ * front-end cache	=> a stack of free objects per CPU, SMALL_CACHE_SLOTS deep at most; alloc pops, free pushes
+ * central list		=> spans of the class that still have free objects, under a per-class mutex
+ * span allocator	=> a span is carved into objects when the central list runs dry, and handed back once all of
+ *			   its objects are free again
+ *
+ * The front end moves objects to and from the central list in batches, so the mutex is taken once per batch.
+ *
+ * Free objects are sharded by span, and each span keeps three lists of them:
+ *
+ * free			=> the allocation list; batches are popped from it, so they come from one span, in address
+ *			   order while the span is fresh
+ * local-free		=> objects returned under the central lock; swapped in when the free list runs dry, so frees
+ *			   never interleave with the span being allocated from
+ * thread-free		=> objects returned while another thread holds the lock, pushed with a compare-and-swap; the
+ *			   span then sits on the class's pending stack until the lock holder collects the list
+ *
+ * The central list holds the spans with free or local-free objects; a full span leaves it and comes back when objects
+ * are returned to it.
+ *
+ * Per-CPU caches use Linux restartable sequences. glibc registers a struct rseq for every thread; the fast path
+ * reads the current CPU from it, then pops or pushes in a short assembly sequence that commits with a single store
+ * to the stack count. If the thread is preempted, migrated or signalled before the commit, the kernel restarts it at
+ * the abort handler and the operation falls back to the slow path. No lock and no atomic instruction is needed, and
+ * cache memory scales with the number of CPUs rather than the number of threads.
+ *
+ * Where rseq is unavailable (not x86-64 Linux, an old glibc, or registration disabled), each thread gets a cache of
+ * the same layout of its own instead. Its owner and the scavenger exclude each other with a busy flag.
+ *
+ * Between the front end and the central list sits a transfer cache per class: a small stack of full batches. A batch
+ * drained from one cache is handed as is to the next cache that misses, so objects move between threads (or CPUs)
+ * without the central list walking spans.
+ *
+ * Front-end caches that go unused hoard memory, so they are scavenged from the slow path about once a second (or by
+ * mm_small_scavenge): a cache not used since the previous scavenge is emptied. A thread cache is emptied by the
+ * scavenger itself, and released entirely when its thread exits. A per-CPU cache can only be popped from its own CPU,
+ * so the scavenger marks it for flushing instead, and the next allocation or free on that CPU empties it.
+ *
+ * Objects larger than SMALL_MAX get a span of their own (size class 0); mm_small_free tells the two apart by the
+ * span's size class, looked up through the page map.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+
+#include "small.h"
+#include "span.h"
+#include "pagemap.h"
+
+#if defined(__x86_64__) && defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define SMALL_RSEQ		1
+#endif
+#endif
+
+#define SMALL_NCLASS		25				//size classes, class 0 is reserved for large spans
+#define SMALL_CACHE_SLOTS	64				//most objects a front-end cache holds per class
+#define SMALL_CACHE_BYTES	(32*1024)			//bytes a front-end cache holds per class (at most)
+#define SMALL_SPAN_OBJS		32				//objects per span (at least)
+
+#define SMALL_TRANSFER_BATCHES	16				//batches a transfer cache holds per class
+#define SMALL_SCAVENGE_CHECK	64				//slow path calls between clock checks
+#define SMALL_SCAVENGE_SECS	1				//least seconds between scavenges of front-end caches
+
+#define CLASS_INDEX(size)	(((size) + 15) >> 4)		//index into class_of for a request size
+#define BATCH(cls)		((int)class_cap[cls] / 2)	//objects moved between levels at a time
+#define UNLOCK_CACHE(c)		__atomic_store_n(&(c)->busy, 0, __ATOMIC_RELEASE)
+
+typedef struct small_cache {
+	unsigned int count[SMALL_NCLASS];			/* Objects on each stack */
+	int touched;						/* Used since the last scavenge */
+	int busy;						/* Held by the owner or the scavenger (thread caches) */
+	int flush;						/* To be emptied by the next operation on its CPU */
+	struct small_cache *next;				/* List of thread caches */
+	struct small_cache *prev;
+	void *slots[SMALL_NCLASS][SMALL_CACHE_SLOTS];		/* Stacks of free objects */
+} __attribute__((aligned(64))) small_cache_t;
+
+typedef struct transfer {
+	pthread_mutex_t lock;
+	int nbatch;						/* Full batches held */
+	void *batch[SMALL_TRANSFER_BATCHES][SMALL_CACHE_SLOTS / 2];
+} transfer_t;
+
+typedef struct central {
+	pthread_mutex_t lock;
+	span_t nonempty;			/* Sentinel of the list of spans with free or local-free objects */
+	span_t *pending;			/* Stack of spans with thread-free objects, pushed without the lock */
+} central_t;
+
+static size_t class_size[SMALL_NCLASS];			/* Object size of each class */
+static size_t class_pages[SMALL_NCLASS];		/* Pages per span of each class */
+static unsigned int class_cap[SMALL_NCLASS];		/* Front-end stack depth of each class */
+static unsigned char class_of[CLASS_INDEX(SMALL_MAX) + 1];	/* Request size -> class */
+static central_t central[SMALL_NCLASS];
+static transfer_t transfer[SMALL_NCLASS];
+
+static pthread_once_t small_once = PTHREAD_ONCE_INIT;
+static small_cache_t *cpu_cache;		/* One cache per CPU, NULL without rseq */
+static unsigned int ncpu;
+static __thread small_cache_t *thread_cache;	/* Fallback cache of this thread */
+static small_cache_t *thread_caches;		/* Every thread cache, under caches_lock */
+static pthread_mutex_t caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t cache_key;			/* Releases a thread's cache when it exits */
+static pthread_mutex_t scavenge_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long slow_calls;		/* Slow path calls, to pace the scavenger */
+static time_t last_scavenge;			/* CLOCK_MONOTONIC seconds at the last scavenge */
+static char small_owner;			/* span_t owner tag of this tier */
+
+#define OBJ_NEXT(o)		(*(void **)(o))			//next free object, stored in the object itself
+
+static void small_init(void);
+static void *alloc_slow(int cls);
+static void free_slow(void *ptr, int cls);
+static void release_batch(int cls, void **objs, int n);
+static int transfer_remove(int cls, void **objs);
+static int transfer_insert(int cls, void **objs);
+static void drain_cache(small_cache_t *c);
+static void scavenge_caches(void);
+static void scavenge_thread_caches(void);
+static size_t cache_bytes(small_cache_t *c);
+static void maybe_scavenge(void);
+static small_cache_t *lock_thread_cache(void);
+static small_cache_t *get_thread_cache(void);
+static void release_thread_cache(void *arg);
+static span_t *new_span(int cls);
+static int central_remove(int cls, void **objs, int n);
+static void central_insert(int cls, void **objs, int n);
+static void collect_thread_free(central_t *c);
+static void release_objects(central_t *c, span_t *s, unsigned int n);
+
+#ifdef SMALL_RSEQ
+static void drain_cpu_cache(struct rseq *rs, unsigned int cpu);
+
+/* Publish the critical section descriptor (start 1, post-commit 2, abort 4) and enter it */
+#define RSEQ_START \
+	".pushsection __rseq_cs, \"aw\"\n\t" \
+	".balign 32\n\t" \
+	"3:\n\t" \
+	".long 0, 0\n\t" \
+	".quad 1f, 2f - 1f, 4f\n\t" \
+	".popsection\n\t" \
+	"leaq 3b(%%rip), %%rax\n\t" \
+	"movq %%rax, 8(%[rs])\n\t" \
+	"1:\n\t" \
+	"cmpl %[cpu], 4(%[rs])\n\t" \
+	"jnz 5f\n\t"
+
+/* Abort handler, preceded by the signature the kernel checks; it continues at the failure label 5 */
+#define RSEQ_ABORT \
+	".pushsection __rseq_failure, \"ax\"\n\t" \
+	".byte 0x0f, 0xb9, 0x3d\n\t" \
+	".long 0x53053053\n\t" \
+	"4:\n\t" \
+	"jmp 5f\n\t" \
+	".popsection\n\t"
+
+/* 
+ * Function Name:	rseq_area
+ * Argument:		None
+ * Return Type: 	The calling thread's struct rseq, registered by glibc
+ * Description:		Locate the rseq area at its fixed offset from the thread pointer
+ */
+
+static inline struct rseq *rseq_area(void)
+{
+	return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+
+/* 
+ * Function Name:	cpu_pop
+ * Argument:		rseq area, CPU the caller read from it, that CPU's cache, size class
+ * Return Type: 	Object popped from the cache, NULL if the stack is empty or the sequence was aborted
+ * Description:		Restartable sequence: check the CPU, load the top object, commit by storing the decremented count
+ */
+
+static inline void *cpu_pop(struct rseq *rs, unsigned int cpu, small_cache_t *c, int cls)
+{
+	void *obj;
+
+	__asm__ __volatile__ (
+		RSEQ_START
+		"movl (%[count]), %%eax\n\t"
+		"testl %%eax, %%eax\n\t"
+		"jz 5f\n\t"
+		"subl $1, %%eax\n\t"
+		"movq (%[slots],%%rax,8), %[obj]\n\t"
+		"movl %%eax, (%[count])\n\t"
+		"2:\n\t"
+		"jmp 6f\n\t"
+		RSEQ_ABORT
+		"5:\n\t"
+		"xorl %k[obj], %k[obj]\n\t"
+		"6:\n\t"
+		: [obj] "=&r" (obj)
+		: [rs] "r" (rs), [cpu] "r" (cpu), [count] "r" (&c->count[cls]), [slots] "r" (c->slots[cls])
+		: "rax", "memory", "cc");
+	return obj;
+}
+
+
+/* 
+ * Function Name:	cpu_push
+ * Argument:		rseq area, CPU the caller read from it, that CPU's cache, size class, object
+ * Return Type: 	1 if the object was pushed, 0 if the stack is full or the sequence was aborted
+ * Description:		Restartable sequence: check the CPU, store the object above the top, commit by storing the
+			incremented count
+ */
+
+static inline int cpu_push(struct rseq *rs, unsigned int cpu, small_cache_t *c, int cls, void *obj)
+{
+	int ok;
+
+	__asm__ __volatile__ (
+		RSEQ_START
+		"movl (%[count]), %%eax\n\t"
+		"cmpl %[cap], %%eax\n\t"
+		"jae 5f\n\t"
+		"movq %[obj], (%[slots],%%rax,8)\n\t"
+		"addl $1, %%eax\n\t"
+		"movl %%eax, (%[count])\n\t"
+		"2:\n\t"
+		"movl $1, %[ok]\n\t"
+		"jmp 6f\n\t"
+		RSEQ_ABORT
+		"5:\n\t"
+		"movl $0, %[ok]\n\t"
+		"6:\n\t"
+		: [ok] "=&r" (ok)
+		: [rs] "r" (rs), [cpu] "r" (cpu), [count] "r" (&c->count[cls]), [slots] "r" (c->slots[cls]),
+		  [cap] "r" (class_cap[cls]), [obj] "r" (obj)
+		: "rax", "memory", "cc");
+	return ok;
+}
+#endif
+
+
+/* 
+ * Function Name:	mm_small_malloc
+ * Argument:		Size in bytes
+ * Return Type: 	Pointer to at least size bytes (16 byte aligned), NULL if size is 0 or out of memory
+ * Description:		Pop the size class's stack in this CPU's (or thread's) cache; on a miss refill it from the transfer
+			cache or the central list. Large requests take a span of their own.
+ */
+
+void *mm_small_malloc(size_t size)
+{
+	small_cache_t *c;
+	void *obj;
+	span_t *s;
+	int cls;
+
+	if (size == 0)
+		return NULL;
+	pthread_once(&small_once, small_init);
+	if (size > SMALL_MAX)
+	{
+		if ((s = span_alloc((size + PM_PAGE_SIZE - 1) >> PM_PAGE_SHIFT)) == NULL)
+			return NULL;
+		s->owner = &small_owner;
+		return s->start;
+	}
+	cls = class_of[CLASS_INDEX(size)];
+
+#ifdef SMALL_RSEQ
+	if (cpu_cache != NULL)
+	{
+		struct rseq *rs = rseq_area();
+		unsigned int cpu = *(volatile unsigned int *)&rs->cpu_id_start;
+
+		if (cpu < ncpu && __builtin_expect(cpu_cache[cpu].flush, 0))
+			drain_cpu_cache(rs, cpu);
+		if (cpu < ncpu && (obj = cpu_pop(rs, cpu, &cpu_cache[cpu], cls)) != NULL)
+		{
+			cpu_cache[cpu].touched = 1;
+			return obj;
+		}
+		return alloc_slow(cls);
+	}
+#endif
+	if ((c = lock_thread_cache()) != NULL)
+	{
+		obj = c->count[cls] > 0 ? c->slots[cls][--c->count[cls]] : NULL;
+		UNLOCK_CACHE(c);
+		if (obj != NULL)
+			return obj;
+	}
+	return alloc_slow(cls);
+}
+
+
+/* 
+ * Function Name:	mm_small_free
+ * Argument:		Pointer returned by mm_small_malloc
+ * Return Type: 	void
+ * Description:		Push the object on its class's stack in this CPU's (or thread's) cache; when the stack is full, move
+			a batch back to the transfer cache or the central list. Large objects give their span back.
+			Either first empties the CPU's cache if the scavenger marked it.
+ */
+
+void mm_small_free(void *ptr)
+{
+	small_cache_t *c;
+	span_t *s;
+	int cls, pushed;
+
+	if (ptr == NULL || (s = span_of(ptr)) == NULL || s->owner != &small_owner)
+		return;
+	if ((cls = s->sizeclass) == 0)
+	{
+		span_free(s);
+		return;
+	}
+
+#ifdef SMALL_RSEQ
+	if (cpu_cache != NULL)
+	{
+		struct rseq *rs = rseq_area();
+		unsigned int cpu = *(volatile unsigned int *)&rs->cpu_id_start;
+
+		if (cpu < ncpu && __builtin_expect(cpu_cache[cpu].flush, 0))
+			drain_cpu_cache(rs, cpu);
+		if (cpu < ncpu && cpu_push(rs, cpu, &cpu_cache[cpu], cls, ptr))
+		{
+			cpu_cache[cpu].touched = 1;
+			return;
+		}
+		free_slow(ptr, cls);
+		return;
+	}
+#endif
+	if ((c = lock_thread_cache()) != NULL)
+	{
+		if ((pushed = c->count[cls] < class_cap[cls]))
+			c->slots[cls][c->count[cls]++] = ptr;
+		UNLOCK_CACHE(c);
+		if (pushed)
+			return;
+	}
+	free_slow(ptr, cls);
+}
+
+
+/* 
+ * Function Name:	mm_small_scavenge
+ * Argument:		None
+ * Return Type: 	void
+ * Description:		Scavenge the front-end caches now rather than waiting for the slow path to do it (see scavenge_caches)
+ */
+
+void mm_small_scavenge(void)
+{
+	pthread_once(&small_once, small_init);
+	pthread_mutex_lock(&scavenge_lock);
+	scavenge_caches();
+	pthread_mutex_unlock(&scavenge_lock);
+}
+
+
+/* 
+ * Function Name:	mm_small_cached
+ * Argument:		None
+ * Return Type: 	Bytes of free objects held in the front-end caches
+ * Description:		Sum the per-CPU and thread caches. The counts are read without stopping their owners, so the result
+			is a snapshot for statistics and tests.
+ */
+
+size_t mm_small_cached(void)
+{
+	small_cache_t *c;
+	size_t bytes = 0;
+	unsigned int cpu;
+
+	pthread_once(&small_once, small_init);
+	if (cpu_cache != NULL)
+		for (cpu = 0; cpu < ncpu; cpu++)
+			bytes += cache_bytes(&cpu_cache[cpu]);
+	pthread_mutex_lock(&caches_lock);
+	for (c = thread_caches; c != NULL; c = c->next)
+		bytes += cache_bytes(c);
+	pthread_mutex_unlock(&caches_lock);
+	return bytes;
+}
+
+
+/* 
+ * Function Name:	mm_small_usable_size
+ * Argument:		Pointer returned by mm_small_malloc
+ * Return Type: 	Bytes usable at ptr, 0 if ptr isn't from this tier
+ * Description:		Size of the object's class, or of its span for a large object
+ */
+
+size_t mm_small_usable_size(void *ptr)
+{
+	span_t *s;
+
+	if (ptr == NULL || (s = span_of(ptr)) == NULL || s->owner != &small_owner)
+		return 0;
+	return s->sizeclass ? class_size[s->sizeclass] : s->npages << PM_PAGE_SHIFT;
+}
+
+
+/* 
+ * Function Name:	small_init
+ * Argument:		None
+ * Return Type: 	void
+ * Description:		Build the size class tables (16 byte steps to 128, then four classes per power of 2), the key that
+			releases thread caches at thread exit and, if this thread has a registered rseq area, the per-CPU caches
+ */
+
+static void small_init(void)
+{
+	size_t size = 0, step = 16, i;
+	int cls;
+
+	for (cls = 1; cls < SMALL_NCLASS; cls++)
+	{
+		if (size >= 128 && (size & (size - 1)) == 0)
+			step = size / 4;
+		size += step;
+		class_size[cls] = size;
+		class_pages[cls] = (size * SMALL_SPAN_OBJS + PM_PAGE_SIZE - 1) >> PM_PAGE_SHIFT;
+		class_cap[cls] = SMALL_CACHE_BYTES / size;
+		if (class_cap[cls] > SMALL_CACHE_SLOTS)
+			class_cap[cls] = SMALL_CACHE_SLOTS;
+		if (class_cap[cls] < 8)
+			class_cap[cls] = 8;
+		pthread_mutex_init(&central[cls].lock, NULL);
+		central[cls].nonempty.next = central[cls].nonempty.prev = &central[cls].nonempty;
+		pthread_mutex_init(&transfer[cls].lock, NULL);
+	}
+	for (i = 0, cls = 1; i <= CLASS_INDEX(SMALL_MAX); i++)
+	{
+		while (class_size[cls] < (i << 4))
+			cls++;
+		class_of[i] = cls;
+	}
+	pthread_key_create(&cache_key, release_thread_cache);
+
+#ifdef SMALL_RSEQ
+	if (__rseq_size > 0 && (int)rseq_area()->cpu_id >= 0)
+	{
+		long conf = sysconf(_SC_NPROCESSORS_CONF);
+		size_t n;
+		span_t *s;
+
+		ncpu = conf > 0 ? conf : 1;
+		n = (ncpu * sizeof(small_cache_t) + PM_PAGE_SIZE - 1) >> PM_PAGE_SHIFT;
+		if ((s = span_alloc(n)) != NULL)
+		{
+			memset(s->start, 0, n << PM_PAGE_SHIFT);
+			cpu_cache = (small_cache_t *)s->start;
+		}
+	}
+#endif
+}
+
+
+/* 
+ * Function Name:	alloc_slow
+ * Argument:		Size class
+ * Return Type: 	Object of the class, NULL if out of memory
+ * Description:		Take a batch of half the cache depth from the transfer cache, or from the central list if it has none,
+			keep one object for the caller and push the rest on this CPU's (or thread's) stack; whatever doesn't
+			fit goes back
+ */
+
+static void *alloc_slow(int cls)
+{
+	void *objs[SMALL_CACHE_SLOTS];
+	small_cache_t *c;
+	int n, i = 1;
+
+	maybe_scavenge();
+	if ((n = transfer_remove(cls, objs)) == 0 && (n = central_remove(cls, objs, BATCH(cls))) == 0)
+		return NULL;
+#ifdef SMALL_RSEQ
+	if (cpu_cache != NULL)
+	{
+		struct rseq *rs = rseq_area();
+
+		for (; i < n; i++)
+		{
+			unsigned int cpu = *(volatile unsigned int *)&rs->cpu_id_start;
+
+			if (cpu >= ncpu || !cpu_push(rs, cpu, &cpu_cache[cpu], cls, objs[i]))
+				break;
+		}
+	}
+	else
+#endif
+	if ((c = lock_thread_cache()) != NULL)
+	{
+		for (; i < n && c->count[cls] < class_cap[cls]; i++)
+			c->slots[cls][c->count[cls]++] = objs[i];
+		UNLOCK_CACHE(c);
+	}
+	if (i < n)
+		central_insert(cls, objs + i, n - i);
+	return objs[0];
+}
+
+
+/* 
+ * Function Name:	free_slow
+ * Argument:		Object, its size class
+ * Return Type: 	void
+ * Description:		The stack is full: move half of it back, then push the object (or send it along with the batch if
+			the push fails again)
+ */
+
+static void free_slow(void *ptr, int cls)
+{
+	void *objs[SMALL_CACHE_SLOTS + 1];
+	small_cache_t *c;
+	int n = 0, pushed = 0;
+
+	maybe_scavenge();
+#ifdef SMALL_RSEQ
+	if (cpu_cache != NULL)
+	{
+		struct rseq *rs = rseq_area();
+		unsigned int cpu = *(volatile unsigned int *)&rs->cpu_id_start;
+
+		if (cpu < ncpu)
+		{
+			while (n < BATCH(cls) && (objs[n] = cpu_pop(rs, cpu, &cpu_cache[cpu], cls)) != NULL)
+				n++;
+			pushed = cpu_push(rs, cpu, &cpu_cache[cpu], cls, ptr);
+		}
+	}
+	else
+#endif
+	if ((c = lock_thread_cache()) != NULL)
+	{
+		while (n < BATCH(cls) && c->count[cls] > 0)
+			objs[n++] = c->slots[cls][--c->count[cls]];
+		c->slots[cls][c->count[cls]++] = ptr;
+		pushed = 1;
+		UNLOCK_CACHE(c);
+	}
+	if (!pushed)
+		objs[n++] = ptr;
+	release_batch(cls, objs, n);
+}
+
+
+/* 
+ * Function Name:	release_batch
+ * Argument:		Size class, objects, number of objects
+ * Return Type: 	void
+ * Description:		A full batch goes to the transfer cache while it has room, anything else to the central list
+ */
+
+static void release_batch(int cls, void **objs, int n)
+{
+	if (n > 0 && (n != BATCH(cls) || transfer_insert(cls, objs) < 0))
+		central_insert(cls, objs, n);
+}
+
+
+/* 
+ * Function Name:	transfer_remove
+ * Argument:		Size class, array for the objects
+ * Return Type: 	Number of objects taken: a full batch, or 0 if the transfer cache is empty
+ * Description:		Pop a batch from the class's transfer cache, a copy of BATCH pointers under its lock
+ */
+
+static int transfer_remove(int cls, void **objs)
+{
+	transfer_t *t = &transfer[cls];
+	int n = 0;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->nbatch > 0)
+	{
+		n = BATCH(cls);
+		memcpy(objs, t->batch[--t->nbatch], n * sizeof(void *));
+	}
+	pthread_mutex_unlock(&t->lock);
+	return n;
+}
+
+
+/* 
+ * Function Name:	transfer_insert
+ * Argument:		Size class, a full batch of objects
+ * Return Type: 	0 on success, -1 if the transfer cache is full
+ * Description:		Push the batch on the class's transfer cache, so another cache can take it without touching spans
+ */
+
+static int transfer_insert(int cls, void **objs)
+{
+	transfer_t *t = &transfer[cls];
+	int ret = -1;
+
+	pthread_mutex_lock(&t->lock);
+	if (t->nbatch < SMALL_TRANSFER_BATCHES)
+	{
+		memcpy(t->batch[t->nbatch++], objs, BATCH(cls) * sizeof(void *));
+		ret = 0;
+	}
+	pthread_mutex_unlock(&t->lock);
+	return ret;
+}
+
+
+/* 
+ * Function Name:	drain_cache
+ * Argument:		Cache (held by the caller)
+ * Return Type: 	void
+ * Description:		Move every object in the cache back, a batch at a time
+ */
+
+static void drain_cache(small_cache_t *c)
+{
+	int cls, n;
+
+	for (cls = 1; cls < SMALL_NCLASS; cls++)
+		while (c->count[cls] > 0)
+		{
+			n = c->count[cls] < (unsigned int)BATCH(cls) ? c->count[cls] : BATCH(cls);
+			c->count[cls] -= n;
+			release_batch(cls, &c->slots[cls][c->count[cls]], n);
+		}
+}
+
+
+#ifdef SMALL_RSEQ
+/* 
+ * Function Name:	drain_cpu_cache
+ * Argument:		rseq area, CPU the caller read from it
+ * Return Type: 	void
+ * Description:		Clear the CPU's flush mark and pop its cache empty with the usual restartable sequence. If the thread
+			is migrated meanwhile, the pops fail and the rest waits for the next scavenge.
+ */
+
+static void drain_cpu_cache(struct rseq *rs, unsigned int cpu)
+{
+	void *objs[SMALL_CACHE_SLOTS];
+	int cls, n;
+
+	if (!__atomic_exchange_n(&cpu_cache[cpu].flush, 0, __ATOMIC_ACQUIRE))
+		return;
+	for (cls = 1; cls < SMALL_NCLASS; cls++)
+		do
+		{
+			for (n = 0; n < BATCH(cls) && (objs[n] = cpu_pop(rs, cpu, &cpu_cache[cpu], cls)) != NULL; n++)
+				;
+			release_batch(cls, objs, n);
+		} while (n == BATCH(cls));
+}
+#endif
+
+
+/* 
+ * Function Name:	cache_bytes
+ * Argument:		Cache
+ * Return Type: 	Bytes of free objects on its stacks
+ * Description:		Read without holding the cache, so only a snapshot
+ */
+
+static size_t cache_bytes(small_cache_t *c)
+{
+	size_t bytes = 0;
+	int cls;
+
+	for (cls = 1; cls < SMALL_NCLASS; cls++)
+		bytes += *(volatile unsigned int *)&c->count[cls] * class_size[cls];
+	return bytes;
+}
+
+
+/* 
+ * Function Name:	scavenge_caches
+ * Argument:		None (scavenge_lock held)
+ * Return Type: 	void
+ * Description:		Clear the used mark of every front-end cache used since the previous scavenge. Of the others, mark
+			each per-CPU cache that holds anything for flushing by the next operation on its CPU (the scavenger
+			can't pop another CPU's cache, and doesn't migrate to reach it), and empty the thread caches.
+ */
+
+static void scavenge_caches(void)
+{
+	unsigned int cpu;
+
+	if (cpu_cache != NULL)
+		for (cpu = 0; cpu < ncpu; cpu++)
+		{
+			if (cpu_cache[cpu].touched)
+				cpu_cache[cpu].touched = 0;
+			else if (cache_bytes(&cpu_cache[cpu]) > 0)
+				__atomic_store_n(&cpu_cache[cpu].flush, 1, __ATOMIC_RELEASE);
+		}
+	scavenge_thread_caches();
+}
+
+
+/* 
+ * Function Name:	scavenge_thread_caches
+ * Argument:		None (scavenge_lock held)
+ * Return Type: 	void
+ * Description:		Empty every thread cache that hasn't been used since the previous scavenge and clear the used mark
+			of the others. Caches in use right now are skipped.
+ */
+
+static void scavenge_thread_caches(void)
+{
+	struct timespec now;
+	small_cache_t *c;
+
+	pthread_mutex_lock(&caches_lock);
+	for (c = thread_caches; c != NULL; c = c->next)
+		if (!__atomic_exchange_n(&c->busy, 1, __ATOMIC_ACQUIRE))
+		{
+			if (c->touched)
+				c->touched = 0;
+			else
+				drain_cache(c);
+			UNLOCK_CACHE(c);
+		}
+	pthread_mutex_unlock(&caches_lock);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	last_scavenge = now.tv_sec;
+}
+
+
+/* 
+ * Function Name:	maybe_scavenge
+ * Argument:		None
+ * Return Type: 	void
+ * Description:		Called on every slow path: every SMALL_SCAVENGE_CHECK calls, scavenge the front-end caches if the last
+			scavenge was SMALL_SCAVENGE_SECS or more ago and nobody else is at it
+ */
+
+static void maybe_scavenge(void)
+{
+	struct timespec now;
+
+	if ((cpu_cache == NULL && thread_caches == NULL) || __atomic_add_fetch(&slow_calls, 1, __ATOMIC_RELAXED) % SMALL_SCAVENGE_CHECK != 0)
+		return;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (now.tv_sec - last_scavenge < SMALL_SCAVENGE_SECS || pthread_mutex_trylock(&scavenge_lock) != 0)
+		return;
+	scavenge_caches();
+	pthread_mutex_unlock(&scavenge_lock);
+}
+
+
+/* 
+ * Function Name:	lock_thread_cache
+ * Argument:		None
+ * Return Type: 	The calling thread's cache, held and marked used; NULL if out of memory or the scavenger holds it
+ * Description:		The owner and the scavenger exclude each other with the cache's busy flag; the owner never waits
+			for it and goes to the shared levels instead
+ */
+
+static small_cache_t *lock_thread_cache(void)
+{
+	small_cache_t *c = get_thread_cache();
+
+	if (c == NULL || __atomic_exchange_n(&c->busy, 1, __ATOMIC_ACQUIRE))
+		return NULL;
+	c->touched = 1;
+	return c;
+}
+
+
+/* 
+ * Function Name:	get_thread_cache
+ * Argument:		None
+ * Return Type: 	The calling thread's cache, NULL if out of memory
+ * Description:		Give the thread a zeroed cache from the span allocator on first use, put it on the list the scavenger
+			walks and register it for release at thread exit
+ */
+
+static small_cache_t *get_thread_cache(void)
+{
+	size_t n = (sizeof(small_cache_t) + PM_PAGE_SIZE - 1) >> PM_PAGE_SHIFT;
+	small_cache_t *c;
+	span_t *s;
+
+	if (thread_cache != NULL || (s = span_alloc(n)) == NULL)
+		return thread_cache;
+	c = (small_cache_t *)s->start;
+	memset(c, 0, n << PM_PAGE_SHIFT);
+	pthread_mutex_lock(&caches_lock);
+	if ((c->next = thread_caches) != NULL)
+		thread_caches->prev = c;
+	thread_caches = c;
+	pthread_mutex_unlock(&caches_lock);
+	pthread_setspecific(cache_key, c);
+	return thread_cache = c;
+}
+
+
+/* 
+ * Function Name:	release_thread_cache
+ * Argument:		Exiting thread's cache (pthread key destructor)
+ * Return Type: 	void
+ * Description:		Move everything in the cache back, take it off the scavenger's list and give its span back
+ */
+
+static void release_thread_cache(void *arg)
+{
+	small_cache_t *c = arg;
+
+	while (__atomic_exchange_n(&c->busy, 1, __ATOMIC_ACQUIRE))
+		sched_yield();
+	drain_cache(c);
+	pthread_mutex_lock(&caches_lock);
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		thread_caches = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+	pthread_mutex_unlock(&caches_lock);
+	thread_cache = NULL;
+	span_free(span_of(c));
+}
+
+
+/* 
+ * Function Name:	link_span
+ * Argument:		Central list, span
+ * Return Type: 	void
+ * Description:		Put the span at the head of the list of spans with free objects, unless it is there already
+ */
+
+static inline void link_span(central_t *c, span_t *s)
+{
+	if (s->next != NULL)
+		return;
+	s->next = c->nonempty.next;
+	s->prev = &c->nonempty;
+	c->nonempty.next->prev = s;
+	c->nonempty.next = s;
+}
+
+
+/* 
+ * Function Name:	unlink_span
+ * Argument:		Span
+ * Return Type: 	void
+ * Description:		Take the span off the list of spans with free objects, if it is on it
+ */
+
+static inline void unlink_span(span_t *s)
+{
+	if (s->next == NULL)
+		return;
+	s->prev->next = s->next;
+	s->next->prev = s->prev;
+	s->next = s->prev = NULL;
+}
+
+
+/* 
+ * Function Name:	new_span
+ * Argument:		Size class (central lock held)
+ * Return Type: 	Fresh span of the class on the central list, NULL if out of memory
+ * Description:		Take a span, tag its pages with the class in the page map (giving the span back if that fails) and
+			thread all of its objects on its free list in address order, so consecutive allocations are adjacent
+ */
+
+static span_t *new_span(int cls)
+{
+	size_t size = class_size[cls];
+	span_t *s;
+	char *obj;
+
+	if ((s = span_alloc(class_pages[cls])) == NULL)
+		return NULL;
+	if (pagemap_set(s->start, s->npages, s, cls) < 0)
+	{
+		span_free(s);
+		return NULL;
+	}
+	s->owner = &small_owner;
+	s->sizeclass = cls;
+
+	obj = s->start + ((s->npages << PM_PAGE_SHIFT) / size - 1) * size;
+	for (; obj >= s->start; obj -= size)
+	{
+		OBJ_NEXT(obj) = s->objects;
+		s->objects = obj;
+	}
+	link_span(&central[cls], s);
+	return s;
+}
+
+
+/* 
+ * Function Name:	release_objects
+ * Argument:		Central list, span, number of its objects just returned to it (central lock held)
+ * Return Type: 	void
+ * Description:		Account for returned objects: a span with none left in use goes back to the span allocator, any
+			other span is (again) available for allocation
+ */
+
+static void release_objects(central_t *c, span_t *s, unsigned int n)
+{
+	if ((s->inuse -= n) == 0)
+	{
+		unlink_span(s);
+		span_free(s);
+	}
+	else
+		link_span(c, s);
+}
+
+
+/* 
+ * Function Name:	collect_thread_free
+ * Argument:		Central list (central lock held)
+ * Return Type: 	void
+ * Description:		Take every span that received lock-free frees off the pending stack and move its thread-free list
+			onto its local-free list
+ */
+
+static void collect_thread_free(central_t *c)
+{
+	span_t *s, *next;
+	void *list, *tail;
+	unsigned int n;
+
+	for (s = __atomic_exchange_n(&c->pending, NULL, __ATOMIC_ACQUIRE); s != NULL; s = next)
+	{
+		next = s->pending;		/* Read before the span can be pushed again */
+		list = __atomic_exchange_n(&s->thread_free, NULL, __ATOMIC_ACQ_REL);
+		for (n = 1, tail = list; OBJ_NEXT(tail) != NULL; n++)
+			tail = OBJ_NEXT(tail);
+		OBJ_NEXT(tail) = s->local_free;
+		s->local_free = list;
+		release_objects(c, s, n);
+	}
+}
+
+
+/* 
+ * Function Name:	central_remove
+ * Argument:		Size class, array for the objects, number wanted
+ * Return Type: 	Number of objects taken (less than n only when out of memory)
+ * Description:		Pop objects from the free list of the first span with any, swapping in its local-free list when the
+			free list runs dry. With no span left, collect the thread-free lists, then carve a new span.
+ */
+
+static int central_remove(int cls, void **objs, int n)
+{
+	central_t *c = &central[cls];
+	span_t *s;
+	int i;
+
+	pthread_mutex_lock(&c->lock);
+	for (i = 0; i < n; i++)
+	{
+		if ((s = c->nonempty.next) == &c->nonempty)
+		{
+			collect_thread_free(c);
+			if ((s = c->nonempty.next) == &c->nonempty && (s = new_span(cls)) == NULL)
+				break;
+		}
+		if (s->objects == NULL)
+		{
+			s->objects = s->local_free;
+			s->local_free = NULL;
+		}
+		objs[i] = s->objects;
+		s->objects = OBJ_NEXT(objs[i]);
+		s->inuse++;
+		if (s->objects == NULL && s->local_free == NULL)
+			unlink_span(s);
+	}
+	pthread_mutex_unlock(&c->lock);
+	return i;
+}
+
+
+/* 
+ * Function Name:	central_insert
+ * Argument:		Size class, objects, number of objects
+ * Return Type: 	void
+ * Description:		If the central lock is free, push each object on its span's local-free list under it. Otherwise push
+			it on the span's thread-free list with a compare-and-swap, and the first object to reach an empty
+			thread-free list pushes its span on the pending stack, so a free never waits for the lock.
+ */
+
+static void central_insert(int cls, void **objs, int n)
+{
+	central_t *c = &central[cls];
+	span_t *s;
+	void *old;
+	int i;
+
+	if (pthread_mutex_trylock(&c->lock) == 0)
+	{
+		for (i = 0; i < n; i++)
+		{
+			s = span_of(objs[i]);
+			OBJ_NEXT(objs[i]) = s->local_free;
+			s->local_free = objs[i];
+			release_objects(c, s, 1);
+		}
+		pthread_mutex_unlock(&c->lock);
+		return;
+	}
+
+	for (i = 0; i < n; i++)
+	{
+		s = span_of(objs[i]);
+		old = __atomic_load_n(&s->thread_free, __ATOMIC_RELAXED);
+		do
+			OBJ_NEXT(objs[i]) = old;
+		while (!__atomic_compare_exchange_n(&s->thread_free, &old, objs[i], 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		if (old != NULL)
+			continue;
+		s->pending = __atomic_load_n(&c->pending, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&c->pending, &s->pending, s, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+			;
+	}
+}
@@ -0,0 +1,13 @@
+#include <stdio.h>
+
+/*
+ * Small object tier: size classes carved from spans, cached per CPU (rseq) or per thread.
+ * Requests above SMALL_MAX get whole spans of their own.
+ */
+#define SMALL_MAX		2048			//largest request served from a size class
+
+extern void *mm_small_malloc(size_t size);
+extern void mm_small_free(void *ptr);
+extern size_t mm_small_usable_size(void *ptr);
+extern void mm_small_scavenge(void);
+extern size_t mm_small_cached(void);
@@ -0,0 +1,320 @@
+/*
+ * Span-based page allocator
+ *
+ * Memory below the object tiers is handed out in spans: runs of whole pages (PM_PAGE_SIZE) described by a span_t.
+ * Free spans are indexed by page count:
+ *
+ * freelist[k], 1 <= k < SPAN_MAX_PAGES	=> doubly linked lists of free spans of exactly k pages, taken in O(1)
+ * largelist				=> free spans of SPAN_MAX_PAGES pages or more, searched for the best fit
+ *
+ * span_alloc takes the smallest span that is big enough and splits off the tail; span_free merges a span with free
+ * neighbours on both sides before putting it back, so free pages always form maximal runs and fragmentation stays
+ * bounded however long the allocator runs. Neighbours are found through the page map: every page of an in-use span
+ * maps to its span_t, and the first and last page of a free span map to it.
+ *
+ * Pages come from a memlib region of the span allocator's own, grown SPAN_GROW_PAGES at a time. Span descriptors come
+ * from a second region and are recycled through a free list, so nothing here calls malloc. The boundary tag heaps of
+ * mm.c stay on their own regions, since they rely on owning every byte up to their brk.
+ *
+ * All operations are serialized by span_lock.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "span.h"
+#include "pagemap.h"
+#include "memlib.h"
+
+#define SPAN_MAX_PAGES		128				//spans this long or longer live on largelist
+#define SPAN_GROW_PAGES		256				//least pages to grow the page region by
+#define SPAN_REGION_SIZE	((size_t)1 << 30)		//address space reserved for pages
+#define SPAN_META_SIZE		((size_t)64 << 20)		//address space reserved for descriptors
+
+static span_t freelist[SPAN_MAX_PAGES];		/* Sentinels of the exact-size lists (index 0 unused) */
+static span_t largelist;			/* Sentinel of the list of long spans */
+static span_t *free_desc;			/* Recycled descriptors, linked by next */
+static mem_region_t *pages;			/* Region the spans are carved from */
+static mem_region_t *meta;			/* Region the descriptors are carved from */
+static pthread_mutex_t span_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SPAN_END(s)		((s)->start + ((s)->npages << PM_PAGE_SHIFT))	//first byte after span s
+#define LIST_FOR(n)		((n) < SPAN_MAX_PAGES ? &freelist[n] : &largelist)	//free list for n pages
+
+static int span_init(void);
+static span_t *new_desc(void);
+static void insert_span(span_t *s);
+static void remove_span(span_t *s);
+static span_t *find_span(size_t npages);
+static span_t *grow(size_t npages);
+static span_t *merge(span_t *s);
+
+
+/* 
+ * Function Name:	span_alloc
+ * Argument:		Number of pages
+ * Return Type: 	In-use span of exactly npages pages, NULL if out of memory
+ * Description:		Take the best fitting free span (growing the page region if there is none), split off what isn't needed
+			and map every page of the result to it
+ */
+
+span_t *span_alloc(size_t npages)
+{
+	span_t *s, *rest;
+
+	if (npages == 0)
+		return NULL;
+	pthread_mutex_lock(&span_lock);
+	if ((pages == NULL && span_init() < 0) ||
+	    ((s = find_span(npages)) == NULL && (s = grow(npages)) == NULL))
+	{
+		pthread_mutex_unlock(&span_lock);
+		return NULL;
+	}
+	remove_span(s);
+
+	if (s->npages > npages)				/* Split, the tail stays free */
+	{
+		if ((rest = new_desc()) == NULL)
+		{
+			insert_span(s);
+			pthread_mutex_unlock(&span_lock);
+			return NULL;
+		}
+		rest->start = s->start + (npages << PM_PAGE_SHIFT);
+		rest->npages = s->npages - npages;
+		s->npages = npages;
+		insert_span(rest);
+	}
+
+	s->free = 0;
+	s->next = s->prev = NULL;
+	s->owner = s->objects = s->local_free = s->thread_free = NULL;
+	s->pending = NULL;
+	s->inuse = 0;
+	s->sizeclass = 0;
+	if (pagemap_set(s->start, s->npages, s, 0) < 0)
+	{
+		insert_span(merge(s));
+		s = NULL;
+	}
+	pthread_mutex_unlock(&span_lock);
+	return s;
+}
+
+
+/* 
+ * Function Name:	span_free
+ * Argument:		In-use span from span_alloc
+ * Return Type: 	void
+ * Description:		Give the span's pages back, merging it with free neighbours
+ */
+
+void span_free(span_t *s)
+{
+	if (s == NULL)
+		return;
+	pthread_mutex_lock(&span_lock);
+	insert_span(merge(s));
+	pthread_mutex_unlock(&span_lock);
+}
+
+
+/* 
+ * Function Name:	span_of
+ * Argument:		Any address inside an in-use span
+ * Return Type: 	The span, NULL if the address isn't in span memory
+ * Description:		Page map lookup, lock free
+ */
+
+span_t *span_of(void *p)
+{
+	return (span_t *)pagemap_owner(p);
+}
+
+
+/* 
+ * Function Name:	span_heapsize
+ * Argument:		None
+ * Return Type: 	Bytes of page region in use by the span allocator (free and in-use spans)
+ * Description:		Footprint of the span layer, the counterpart of mem_heapsize
+ */
+
+size_t span_heapsize(void)
+{
+	return pages ? mem_region_size(pages) : 0;
+}
+
+
+/* 
+ * Function Name:	span_init
+ * Argument:		None
+ * Return Type: 	0 on success, -1 if the regions can't be mapped
+ * Description:		Map the page and descriptor regions and make every free list empty
+ */
+
+static int span_init(void)
+{
+	size_t i;
+	char *lo;
+
+	if ((meta = mem_region_create(SPAN_META_SIZE)) == NULL)
+		return -1;
+	if ((pages = mem_region_create(SPAN_REGION_SIZE)) == NULL)
+	{
+		mem_region_destroy(meta);
+		meta = NULL;
+		return -1;
+	}
+	/* The region starts page aligned, keep its brk that way */
+	lo = mem_region_lo(pages);
+	if (((size_t)lo & (PM_PAGE_SIZE - 1)) != 0)
+		mem_region_sbrk(pages, PM_PAGE_SIZE - ((size_t)lo & (PM_PAGE_SIZE - 1)));
+	for (i = 1; i < SPAN_MAX_PAGES; i++)
+		freelist[i].next = freelist[i].prev = &freelist[i];
+	largelist.next = largelist.prev = &largelist;
+	return 0;
+}
+
+
+/* 
+ * Function Name:	new_desc
+ * Argument:		None
+ * Return Type: 	Zeroed span descriptor, NULL if out of memory
+ * Description:		Reuse a descriptor from free_desc, or carve one from the descriptor region
+ */
+
+static span_t *new_desc(void)
+{
+	span_t *s;
+
+	if ((s = free_desc) != NULL)
+		free_desc = s->next;
+	else if ((s = mem_region_sbrk(meta, sizeof(span_t))) == (void *)-1)
+		return NULL;
+	memset(s, 0, sizeof(*s));
+	return s;
+}
+
+
+/* 
+ * Function Name:	insert_span
+ * Argument:		Span that is not on any list
+ * Return Type: 	void
+ * Description:		Mark the span free, map its first and last page to it and push it on the list for its length
+ */
+
+static void insert_span(span_t *s)
+{
+	span_t *list = LIST_FOR(s->npages);
+
+	s->free = 1;
+	pagemap_set(s->start, 1, s, 0);
+	pagemap_set(SPAN_END(s) - PM_PAGE_SIZE, 1, s, 0);
+	s->next = list->next;
+	s->prev = list;
+	list->next->prev = s;
+	list->next = s;
+}
+
+
+/* 
+ * Function Name:	remove_span
+ * Argument:		Free span
+ * Return Type: 	void
+ * Description:		Unlink the span from its free list
+ */
+
+static void remove_span(span_t *s)
+{
+	s->prev->next = s->next;
+	s->next->prev = s->prev;
+	s->free = 0;
+}
+
+
+/* 
+ * Function Name:	find_span
+ * Argument:		Number of pages
+ * Return Type: 	Smallest free span of at least npages pages, NULL if there is none
+ * Description:		Exact-size lists first (the first non-empty one is the best fit), then best fit over the long spans,
+			lowest address breaking ties so memory is reused from the bottom of the region
+ */
+
+static span_t *find_span(size_t npages)
+{
+	span_t *s, *best = NULL;
+	size_t n;
+
+	for (n = npages; n < SPAN_MAX_PAGES; n++)
+		if (freelist[n].next != &freelist[n])
+			return freelist[n].next;
+	for (s = largelist.next; s != &largelist; s = s->next)
+		if (s->npages >= npages && (best == NULL || s->npages < best->npages ||
+		    (s->npages == best->npages && s->start < best->start)))
+			best = s;
+	return best;
+}
+
+
+/* 
+ * Function Name:	grow
+ * Argument:		Number of pages needed
+ * Return Type: 	Free span of at least npages pages (on its free list), NULL if the page region is full
+ * Description:		Extend the page region by at least SPAN_GROW_PAGES pages and merge the new pages with a free span
+			at the old top of the region
+ */
+
+static span_t *grow(size_t npages)
+{
+	size_t n = npages < SPAN_GROW_PAGES ? SPAN_GROW_PAGES : npages;
+	span_t *s;
+	char *start;
+
+	if ((n << PM_PAGE_SHIFT) > 0x7fffffff || (s = new_desc()) == NULL)
+		return NULL;
+	if ((start = mem_region_sbrk(pages, n << PM_PAGE_SHIFT)) == (void *)-1)
+	{
+		s->next = free_desc;
+		free_desc = s;
+		return NULL;
+	}
+	s->start = start;
+	s->npages = n;
+	s = merge(s);
+	insert_span(s);
+	return s;
+}
+
+
+/* 
+ * Function Name:	merge
+ * Argument:		Span that is not on any list
+ * Return Type: 	The span, grown over any free neighbours (which are unlinked and their descriptors recycled)
+ * Description:		Check the pages just below and just above the span in the page map and absorb free spans found there
+ */
+
+static span_t *merge(span_t *s)
+{
+	span_t *n;
+	char *lo = mem_region_lo(pages);
+	char *hi = (char *)mem_region_hi(pages) + 1;
+
+	if (s->start > lo && (n = span_of(s->start - 1)) != NULL && n->free && SPAN_END(n) == s->start)
+	{
+		remove_span(n);
+		s->start = n->start;
+		s->npages += n->npages;
+		n->next = free_desc;
+		free_desc = n;
+	}
+	if (SPAN_END(s) < hi && (n = span_of(SPAN_END(s))) != NULL && n->free && n->start == SPAN_END(s))
+	{
+		remove_span(n);
+		s->npages += n->npages;
+		n->next = free_desc;
+		free_desc = n;
+	}
+	return s;
+}
@@ -0,0 +1,26 @@
+#include <stdio.h>
+
+/*
+ * Span allocator: runs of PM_PAGE_SIZE pages, split and merged on demand.
+ * The object tiers take pages from it as spans and give whole spans back.
+ */
+typedef struct span {
+	char *start;				/* First byte of the span (page aligned) */
+	size_t npages;				/* Length in pages */
+	int free;				/* Set while the span is on a span free list */
+	struct span *next;			/* Free list links, or the owner's own list while in use */
+	struct span *prev;
+	/* Owner data, meaningful only while the span is in use */
+	void *owner;				/* Tier or pool the span belongs to */
+	void *objects;				/* Owner's free objects in the span */
+	void *local_free;			/* Owner's objects freed while allocating from objects */
+	void *thread_free;			/* Owner's objects freed by other threads (atomic) */
+	struct span *pending;			/* Owner's stack of spans with thread_free objects */
+	unsigned int inuse;			/* Owner's objects in use */
+	int sizeclass;				/* Owner's size class */
+} span_t;
+
+extern span_t *span_alloc(size_t npages);
+extern void span_free(span_t *s);
+extern span_t *span_of(void *p);
+extern size_t span_heapsize(void);
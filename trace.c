@@ -0,0 +1,603 @@
+/*
+ * trace.c - reads and writes allocator trace files.
+ *
+ * A text trace (.rep) is a four line header (suggested heap size,
+ * number of ids, number of ops, weight) followed by one request per
+ * line: "a <id> <size>", "r <id> <size>" or "f <id>".
+ *
+ * A binary trace is a trace_hdr_t followed by datalen bytes of
+ * records. Plain records are trace_op_t's, so trace_load maps the
+ * file and points the ops straight into the mapping: nothing is
+ * parsed or copied. With TRACE_F_VARINT each record is a varint of
+ * (zigzag(id - previous id) << 2 | type), followed for allocs and
+ * reallocs by a varint of the size, and in a trace of more than one
+ * thread by a varint of the tid; ids mostly step by one, so a typical
+ * record takes three to five bytes instead of sixteen.
+ *
+ * trace_stream_* read any of the formats in chunks of TRACE_CHUNK ops
+ * instead, for traces too large to hold in memory. A reader thread
+ * fills one of two buffers while the caller replays the other, so
+ * the file is read while the allocator runs rather than between runs.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024
+
+/* Stream formats */
+#define FMT_TEXT   0
+#define FMT_PLAIN  1
+#define FMT_VARINT 2
+
+/* A streamed trace: two chunk buffers, filled in turn by a reader thread */
+struct trace_stream {
+    FILE *fp;
+    int format;              /* FMT_* */
+    int num_ids;             /* ids must stay below this */
+    int left;                /* ops not read yet */
+    int prev;                /* previous id, for varint deltas */
+    int tid;                 /* current thread of a text trace */
+    int num_threads;         /* from the binary header, 0 for text */
+    trace_op_t *buf[2];
+    int count[2];            /* ops in each buffer; 0 at the end, -1 on error */
+    int full[2];             /* buffer is filled and not yet handed back */
+    int cur;                 /* buffer the caller holds, -1 for none */
+    int next;                /* buffer the caller gets next */
+    int stop;                /* trace_stream_close is waiting for the reader */
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static int load_text(FILE *fp, trace_file_t *tf);
+static int decode_ops(trace_file_t *tf, const unsigned char *p,
+		      const unsigned char *end);
+static int get_varint(const unsigned char **pp, const unsigned char *end,
+		      unsigned long long *v);
+static int check_ops(const trace_file_t *tf);
+static int get_text_op(FILE *fp, trace_op_t *op, int *tid);
+static int get_varint_fp(FILE *fp, unsigned long long *v);
+static int fill_chunk(trace_stream_t *ts, trace_op_t *buf);
+static void *stream_reader(void *arg);
+
+/*
+ * trace_load - Load the text or binary trace at path. Returns 0, or
+ *     -1 with errno set (EINVAL for a malformed trace).
+ */
+int trace_load(const char *path, trace_file_t *tf)
+{
+    FILE *fp;
+    struct stat st;
+    trace_hdr_t *hdr;
+    void *map;
+    int fd, rc, err;
+
+    memset(tf, 0, sizeof(*tf));
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return -1;
+    if (fstat(fd, &st) < 0) {
+	close(fd);
+	return -1;
+    }
+
+    /* Binary traces are recognized by their magic number */
+    if (st.st_size >= (off_t)sizeof(trace_hdr_t)) {
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+	    close(fd);
+	    return -1;
+	}
+	hdr = map;
+	if (hdr->magic == TRACE_MAGIC) {
+	    close(fd);
+	    tf->sugg_heapsize = hdr->sugg_heapsize;
+	    tf->num_ids = hdr->num_ids;
+	    tf->num_ops = hdr->num_ops;
+	    tf->weight = hdr->weight;
+	    tf->num_threads = hdr->num_threads;
+	    rc = -1;
+	    if (hdr->version == TRACE_VERSION && hdr->num_ops >= 0 &&
+		hdr->datalen <= st.st_size - sizeof(trace_hdr_t)) {
+		if (hdr->flags & TRACE_F_VARINT) {
+		    rc = decode_ops(tf, (unsigned char *)(hdr + 1),
+				    (unsigned char *)(hdr + 1) + hdr->datalen);
+		    munmap(map, st.st_size);
+		    map = NULL;
+		}
+		else if (hdr->datalen == (uint64_t)hdr->num_ops * sizeof(trace_op_t)) {
+		    tf->ops = (trace_op_t *)(hdr + 1);  /* replayed in place */
+		    tf->map = map;
+		    tf->maplen = st.st_size;
+		    map = NULL;                         /* now owned by tf */
+		    rc = 0;
+		}
+	    }
+	    if (rc == 0 && check_ops(tf) == 0)
+		return 0;
+	    trace_unload(tf);
+	    if (map != NULL)
+		munmap(map, st.st_size);
+	    errno = EINVAL;
+	    return -1;
+	}
+	munmap(map, st.st_size);
+    }
+
+    /* Anything else is parsed as text */
+    if ((fp = fdopen(fd, "r")) == NULL) {
+	close(fd);
+	return -1;
+    }
+    rc = load_text(fp, tf);
+    err = errno;
+    fclose(fp);
+    errno = err;
+    return rc;
+}
+
+/*
+ * trace_unload - Release what trace_load set up
+ */
+void trace_unload(trace_file_t *tf)
+{
+    if (tf->map != NULL)
+	munmap(tf->map, tf->maplen);
+    else
+	free(tf->ops);
+    memset(tf, 0, sizeof(*tf));
+}
+
+/*
+ * trace_write_text - Write the trace in the .rep format. Returns 0,
+ *     or -1 on a write error.
+ */
+int trace_write_text(FILE *fp, const trace_file_t *tf)
+{
+    trace_op_t *op;
+    int i, tid = 0;
+
+    fprintf(fp, "%d\n%d\n%d\n%d\n",
+	    tf->sugg_heapsize, tf->num_ids, tf->num_ops, tf->weight);
+    for (i = 0; i < tf->num_ops; i++) {
+	op = &tf->ops[i];
+	if (op->tid != tid)
+	    fprintf(fp, "t %d\n", tid = op->tid);
+	if (op->type == TRACE_FREE)
+	    fprintf(fp, "f %d\n", op->index);
+	else
+	    fprintf(fp, "%c %d %d\n", op->type == TRACE_ALLOC ? 'a' : 'r',
+		    op->index, op->size);
+    }
+    return ferror(fp) ? -1 : 0;
+}
+
+/*
+ * trace_write_binary - Write the trace in the binary format, with
+ *     varint records if flags has TRACE_F_VARINT. fp must be seekable
+ *     for varint output, whose length is only known at the end.
+ *     Returns 0, or -1 on a write error.
+ */
+int trace_write_binary(FILE *fp, const trace_file_t *tf, int flags)
+{
+    trace_hdr_t hdr;
+    unsigned char buf[16];
+    unsigned long long v;
+    int i, n, prev = 0;
+    long start;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = TRACE_MAGIC;
+    hdr.version = TRACE_VERSION;
+    hdr.flags = flags & TRACE_F_VARINT;
+    hdr.sugg_heapsize = tf->sugg_heapsize;
+    hdr.num_ids = tf->num_ids;
+    hdr.num_ops = tf->num_ops;
+    hdr.weight = tf->weight;
+    hdr.num_threads = tf->num_threads;
+    hdr.datalen = (uint64_t)tf->num_ops * sizeof(trace_op_t);
+
+    if (!(hdr.flags & TRACE_F_VARINT)) {
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(tf->ops, sizeof(trace_op_t), tf->num_ops, fp);
+	return ferror(fp) ? -1 : 0;
+    }
+
+    if ((start = ftell(fp)) < 0)
+	return -1;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    hdr.datalen = 0;
+    for (i = 0; i < tf->num_ops; i++) {
+	/* zigzag the id delta so small steps either way stay small */
+	v = (long long)tf->ops[i].index - prev;
+	v = (v << 1) ^ -(v >> 63);
+	v = (v << 2) | tf->ops[i].type;
+	prev = tf->ops[i].index;
+	for (n = 0; v >= 0x80; v >>= 7)
+	    buf[n++] = v | 0x80;
+	buf[n++] = v;
+	if (tf->ops[i].type != TRACE_FREE) {
+	    for (v = (unsigned)tf->ops[i].size; v >= 0x80; v >>= 7)
+		buf[n++] = v | 0x80;
+	    buf[n++] = v;
+	}
+	if (tf->num_threads > 1) {
+	    for (v = (unsigned)tf->ops[i].tid; v >= 0x80; v >>= 7)
+		buf[n++] = v | 0x80;
+	    buf[n++] = v;
+	}
+	fwrite(buf, 1, n, fp);
+	hdr.datalen += n;
+    }
+    if (fseek(fp, start, SEEK_SET) < 0)
+	return -1;
+    fwrite(&hdr, sizeof(hdr), 1, fp);
+    fseek(fp, 0, SEEK_END);
+    return ferror(fp) ? -1 : 0;
+}
+
+/*
+ * load_text - Parse a .rep trace into a malloc'd op array
+ */
+static int load_text(FILE *fp, trace_file_t *tf)
+{
+    int op_index = 0, rc, tid = 0, i;
+
+    if (fscanf(fp, "%d %d %d %d", &tf->sugg_heapsize, &tf->num_ids,
+	       &tf->num_ops, &tf->weight) != 4 || tf->num_ops < 0)
+	goto bad;
+    if ((tf->ops = malloc((tf->num_ops + 1) * sizeof(trace_op_t))) == NULL)
+	return -1;
+
+    while ((rc = get_text_op(fp, &tf->ops[op_index], &tid)) > 0)
+	if (++op_index > tf->num_ops)
+	    goto bad;
+    if (rc < 0)
+	goto bad;
+    for (i = 0; i < op_index; i++)
+	if (tf->ops[i].tid >= tf->num_threads)
+	    tf->num_threads = tf->ops[i].tid + 1;
+    if (op_index == tf->num_ops && check_ops(tf) == 0)
+	return 0;
+ bad:
+    free(tf->ops);
+    memset(tf, 0, sizeof(*tf));
+    errno = EINVAL;
+    return -1;
+}
+
+/*
+ * decode_ops - Decode num_ops varint records from p..end into a
+ *     malloc'd op array
+ */
+static int decode_ops(trace_file_t *tf, const unsigned char *p,
+		      const unsigned char *end)
+{
+    unsigned long long v;
+    int i, prev = 0;
+
+    if ((tf->ops = malloc((tf->num_ops + 1) * sizeof(trace_op_t))) == NULL)
+	return -1;
+    for (i = 0; i < tf->num_ops; i++) {
+	if (get_varint(&p, end, &v) < 0)
+	    return -1;
+	tf->ops[i].type = v & 3;
+	v >>= 2;
+	prev += (int)((v >> 1) ^ -(v & 1));
+	tf->ops[i].index = prev;
+	tf->ops[i].size = 0;
+	if (tf->ops[i].type != TRACE_FREE) {
+	    if (get_varint(&p, end, &v) < 0)
+		return -1;
+	    tf->ops[i].size = v;
+	}
+	tf->ops[i].tid = 0;
+	if (tf->num_threads > 1) {
+	    if (get_varint(&p, end, &v) < 0)
+		return -1;
+	    tf->ops[i].tid = v;
+	}
+    }
+    return 0;
+}
+
+/*
+ * get_varint - Read one varint at *pp, advancing it. Returns -1 if
+ *     the varint runs past end or is too long.
+ */
+static int get_varint(const unsigned char **pp, const unsigned char *end,
+		      unsigned long long *v)
+{
+    const unsigned char *p = *pp;
+    int shift;
+
+    *v = 0;
+    for (shift = 0; p < end && shift < 64; shift += 7) {
+	*v |= (unsigned long long)(*p & 0x7f) << shift;
+	if (!(*p++ & 0x80)) {
+	    *pp = p;
+	    return 0;
+	}
+    }
+    return -1;
+}
+
+/*
+ * check_ops - Make sure every op has a valid type, an id below
+ *     num_ids and a tid below num_threads (if known), so replay can
+ *     index its arrays without checking
+ */
+static int check_ops(const trace_file_t *tf)
+{
+    int i;
+
+    for (i = 0; i < tf->num_ops; i++)
+	if (tf->ops[i].type > TRACE_REALLOC || tf->ops[i].type < 0 ||
+	    tf->ops[i].index < 0 || tf->ops[i].index >= tf->num_ids ||
+	    tf->ops[i].tid < 0 ||
+	    (tf->num_threads > 0 && tf->ops[i].tid >= tf->num_threads))
+	    return -1;
+    return 0;
+}
+
+/*
+ * get_text_op - Parse the next request line of a text trace into op,
+ *     following "t <tid>" lines in *tid. Returns 1, 0 at the end of
+ *     the file, or -1 on a malformed line.
+ */
+static int get_text_op(FILE *fp, trace_op_t *op, int *tid)
+{
+    char type[MAXLINE];
+    unsigned index, size;
+
+    for (;;) {
+	if (fscanf(fp, "%1023s", type) == EOF)
+	    return 0;
+	if (type[0] != 't')
+	    break;
+	if (fscanf(fp, "%d", tid) != 1 || *tid < 0)
+	    return -1;
+    }
+    op->tid = *tid;
+    switch (type[0]) {
+    case 'a':
+    case 'r':
+	if (fscanf(fp, "%u %u", &index, &size) != 2)
+	    return -1;
+	op->type = (type[0] == 'a') ? TRACE_ALLOC : TRACE_REALLOC;
+	op->index = index;
+	op->size = size;
+	return 1;
+    case 'f':
+	if (fscanf(fp, "%u", &index) != 1)
+	    return -1;
+	op->type = TRACE_FREE;
+	op->index = index;
+	op->size = 0;
+	return 1;
+    default:
+	return -1;
+    }
+}
+
+/*
+ * get_varint_fp - get_varint for a stream. Returns 0, or -1 at the
+ *     end of the file or on an overlong varint.
+ */
+static int get_varint_fp(FILE *fp, unsigned long long *v)
+{
+    int c, shift;
+
+    *v = 0;
+    for (shift = 0; shift < 64 && (c = getc_unlocked(fp)) != EOF; shift += 7) {
+	*v |= (unsigned long long)(c & 0x7f) << shift;
+	if (!(c & 0x80))
+	    return 0;
+    }
+    return -1;
+}
+
+/*
+ * trace_stream_open - Open the trace at path for streaming and fill
+ *     in tf's header fields (tf->ops stays NULL). Returns NULL with
+ *     errno set on failure.
+ */
+trace_stream_t *trace_stream_open(const char *path, trace_file_t *tf)
+{
+    trace_stream_t *ts;
+    trace_hdr_t hdr;
+    int err;
+
+    memset(tf, 0, sizeof(*tf));
+    if ((ts = calloc(1, sizeof(*ts))) == NULL)
+	return NULL;
+    if ((ts->fp = fopen(path, "rb")) == NULL) {
+	free(ts);
+	return NULL;
+    }
+    setvbuf(ts->fp, NULL, _IOFBF, 1 << 20);
+
+    if (fread(&hdr, sizeof(hdr), 1, ts->fp) == 1 && hdr.magic == TRACE_MAGIC) {
+	if (hdr.version != TRACE_VERSION || hdr.num_ops < 0)
+	    goto bad;
+	ts->format = (hdr.flags & TRACE_F_VARINT) ? FMT_VARINT : FMT_PLAIN;
+	tf->sugg_heapsize = hdr.sugg_heapsize;
+	tf->num_ids = hdr.num_ids;
+	tf->num_ops = hdr.num_ops;
+	tf->weight = hdr.weight;
+	tf->num_threads = hdr.num_threads;
+    }
+    else {
+	rewind(ts->fp);
+	ts->format = FMT_TEXT;
+	if (fscanf(ts->fp, "%d %d %d %d", &tf->sugg_heapsize, &tf->num_ids,
+		   &tf->num_ops, &tf->weight) != 4 || tf->num_ops < 0)
+	    goto bad;
+    }
+    ts->num_ids = tf->num_ids;
+    ts->num_threads = tf->num_threads;
+    ts->left = tf->num_ops;
+    ts->cur = -1;
+
+    if ((ts->buf[0] = malloc(2 * TRACE_CHUNK * sizeof(trace_op_t))) == NULL)
+	goto fail;
+    ts->buf[1] = ts->buf[0] + TRACE_CHUNK;
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_cond_init(&ts->cond, NULL);
+    if ((err = pthread_create(&ts->reader, NULL, stream_reader, ts)) != 0) {
+	free(ts->buf[0]);
+	fclose(ts->fp);
+	free(ts);
+	errno = err;
+	return NULL;
+    }
+    return ts;
+
+ bad:
+    errno = EINVAL;
+ fail:
+    err = errno;
+    fclose(ts->fp);
+    free(ts);
+    errno = err;
+    return NULL;
+}
+
+/*
+ * trace_stream_next - Hand back the previous chunk and get the next
+ *     one in *ops. Returns the number of ops in it, 0 at the end of the
+ *     trace, or -1 if the trace is malformed.
+ */
+int trace_stream_next(trace_stream_t *ts, trace_op_t **ops)
+{
+    int n;
+
+    *ops = NULL;
+    pthread_mutex_lock(&ts->lock);
+    if (ts->cur >= 0) {
+	ts->full[ts->cur] = 0;
+	pthread_cond_broadcast(&ts->cond);
+    }
+    while (!ts->full[ts->next])
+	pthread_cond_wait(&ts->cond, &ts->lock);
+    ts->cur = ts->next;
+    if ((n = ts->count[ts->cur]) > 0) {
+	*ops = ts->buf[ts->cur];
+	ts->next ^= 1;
+    }
+    else
+	ts->cur = -1;            /* the end stays put for later calls */
+    pthread_mutex_unlock(&ts->lock);
+    return n;
+}
+
+/*
+ * trace_stream_close - Stop the reader and release the stream
+ */
+void trace_stream_close(trace_stream_t *ts)
+{
+    pthread_mutex_lock(&ts->lock);
+    ts->stop = 1;
+    pthread_cond_broadcast(&ts->cond);
+    pthread_mutex_unlock(&ts->lock);
+    pthread_join(ts->reader, NULL);
+    pthread_mutex_destroy(&ts->lock);
+    pthread_cond_destroy(&ts->cond);
+    fclose(ts->fp);
+    free(ts->buf[0]);
+    free(ts);
+}
+
+/*
+ * stream_reader - Reader thread: fill the two buffers in turn, each as
+ *     soon as the caller hands it back, until the end of the trace
+ */
+static void *stream_reader(void *arg)
+{
+    trace_stream_t *ts = arg;
+    int i = 0, n;
+
+    do {
+	pthread_mutex_lock(&ts->lock);
+	while (ts->full[i] && !ts->stop)
+	    pthread_cond_wait(&ts->cond, &ts->lock);
+	if (ts->stop) {
+	    pthread_mutex_unlock(&ts->lock);
+	    break;
+	}
+	pthread_mutex_unlock(&ts->lock);
+
+	n = fill_chunk(ts, ts->buf[i]);      /* buffer i is ours until full */
+
+	pthread_mutex_lock(&ts->lock);
+	ts->count[i] = n;
+	ts->full[i] = 1;
+	pthread_cond_broadcast(&ts->cond);
+	pthread_mutex_unlock(&ts->lock);
+	i ^= 1;
+    } while (n > 0);
+    return NULL;
+}
+
+/*
+ * fill_chunk - Read up to TRACE_CHUNK ops into buf. Returns their
+ *     number, 0 at the end of the trace, or -1 if it is malformed
+ *     (short, too long, bad type or id).
+ */
+static int fill_chunk(trace_stream_t *ts, trace_op_t *buf)
+{
+    trace_file_t chunk;
+    unsigned long long v;
+    int i, n = (ts->left < TRACE_CHUNK) ? ts->left : TRACE_CHUNK;
+
+    switch (ts->format) {
+    case FMT_PLAIN:
+	if ((int)fread(buf, sizeof(trace_op_t), n, ts->fp) != n)
+	    return -1;
+	break;
+    case FMT_VARINT:
+	for (i = 0; i < n; i++) {
+	    if (get_varint_fp(ts->fp, &v) < 0)
+		return -1;
+	    buf[i].type = v & 3;
+	    v >>= 2;
+	    ts->prev += (int)((v >> 1) ^ -(v & 1));
+	    buf[i].index = ts->prev;
+	    buf[i].size = 0;
+	    if (buf[i].type != TRACE_FREE) {
+		if (get_varint_fp(ts->fp, &v) < 0)
+		    return -1;
+		buf[i].size = v;
+	    }
+	    buf[i].tid = 0;
+	    if (ts->num_threads > 1) {
+		if (get_varint_fp(ts->fp, &v) < 0)
+		    return -1;
+		buf[i].tid = v;
+	    }
+	}
+	break;
+    default:
+	for (i = 0; i < n; i++)
+	    if (get_text_op(ts->fp, &buf[i], &ts->tid) <= 0)
+		return -1;
+	if (n == 0 && get_text_op(ts->fp, &buf[0], &ts->tid) != 0)
+	    return -1;       /* more requests than the header says */
+	break;
+    }
+    ts->left -= n;
+
+    chunk.num_ids = ts->num_ids;
+    chunk.num_threads = ts->num_threads;
+    chunk.num_ops = n;
+    chunk.ops = buf;
+    return check_ops(&chunk) == 0 ? n : -1;
+}
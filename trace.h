@@ -0,0 +1,66 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Trace files: the text .rep format, and a binary format of a fixed
+ * header followed by packed op records that can be replayed straight
+ * from an mmap of the file. A binary trace may instead carry varint
+ * records (TRACE_F_VARINT), which are smaller but decoded on load.
+ * Each op carries the id of the thread that made it; a text trace
+ * switches thread with a "t <tid>" line and starts in thread 0.
+ */
+#define TRACE_MAGIC    0x52544d4d  /* "MMTR" tags a binary trace */
+#define TRACE_VERSION  2
+#define TRACE_F_VARINT 0x1         /* records are delta/varint encoded */
+
+/* Op types, as stored in trace_op_t.type */
+#define TRACE_ALLOC    0
+#define TRACE_FREE     1
+#define TRACE_REALLOC  2
+
+/* One request; also the record layout of an unencoded binary trace */
+typedef struct {
+    int32_t type;   /* TRACE_ALLOC, TRACE_FREE or TRACE_REALLOC */
+    int32_t index;  /* block id */
+    int32_t size;   /* payload size, 0 for TRACE_FREE */
+    int32_t tid;    /* thread that made the request */
+} trace_op_t;
+
+/* Header of a binary trace, native byte order */
+typedef struct {
+    uint32_t magic;         /* TRACE_MAGIC */
+    uint32_t version;       /* TRACE_VERSION */
+    uint32_t flags;         /* TRACE_F_* */
+    int32_t sugg_heapsize;  /* as in the text header */
+    int32_t num_ids;
+    int32_t num_ops;
+    int32_t weight;
+    int32_t num_threads;    /* tids run from 0 to num_threads - 1 */
+    uint64_t datalen;       /* bytes of records after the header */
+} trace_hdr_t;
+
+/* A loaded trace */
+typedef struct {
+    int sugg_heapsize;      /* suggested heap size (unused) */
+    int num_ids;            /* number of alloc/realloc ids */
+    int num_ops;            /* number of requests */
+    int weight;             /* weight for this trace (unused) */
+    int num_threads;        /* highest tid + 1; 0 until known for a stream */
+    trace_op_t *ops;        /* the requests */
+    void *map;              /* mapping ops points into, NULL if ops is malloc'd */
+    size_t maplen;
+} trace_file_t;
+
+/* Streamed reading: ops arrive in chunks, the next one read ahead by a thread */
+typedef struct trace_stream trace_stream_t;
+
+#define TRACE_CHUNK    65536       /* ops per streamed chunk */
+
+int trace_load(const char *path, trace_file_t *tf);
+void trace_unload(trace_file_t *tf);
+int trace_write_text(FILE *fp, const trace_file_t *tf);
+int trace_write_binary(FILE *fp, const trace_file_t *tf, int flags);
+trace_stream_t *trace_stream_open(const char *path, trace_file_t *tf);
+int trace_stream_next(trace_stream_t *ts, trace_op_t **ops);
+void trace_stream_close(trace_stream_t *ts);
@@ -0,0 +1,81 @@
+/*
+ * tracecvt.c - Converts allocator traces between the text .rep format
+ *     and the binary format that mdriver maps without parsing (trace.h).
+ *     A text input is written out binary, a binary input as text.
+ *
+ *     usage: tracecvt [-z] <infile> <outfile>
+ *         -z  write varint records instead of plain ones (smaller,
+ *             but decoded rather than mapped on load)
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracecvt [-z] <infile> <outfile>\n");
+    fprintf(stderr, "\t-z         Write compressed (varint) binary records.\n");
+}
+
+/*
+ * is_binary - Is the trace at path in the binary format?
+ */
+static int is_binary(const char *path)
+{
+    FILE *fp;
+    unsigned int magic = 0;
+
+    if ((fp = fopen(path, "rb")) == NULL)
+	return 0;
+    if (fread(&magic, sizeof(magic), 1, fp) != 1)
+	magic = 0;
+    fclose(fp);
+    return magic == TRACE_MAGIC;
+}
+
+int main(int argc, char **argv)
+{
+    trace_file_t tf;
+    FILE *out;
+    int c, rc, flags = 0;
+
+    while ((c = getopt(argc, argv, "zh")) != EOF) {
+	switch (c) {
+	case 'z':
+	    flags |= TRACE_F_VARINT;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (argc - optind != 2) {
+	usage();
+	exit(1);
+    }
+
+    if (trace_load(argv[optind], &tf) < 0) {
+	perror(argv[optind]);
+	exit(1);
+    }
+    if ((out = fopen(argv[optind+1], "wb")) == NULL) {
+	perror(argv[optind+1]);
+	exit(1);
+    }
+    if (is_binary(argv[optind]))
+	rc = trace_write_text(out, &tf);
+    else
+	rc = trace_write_binary(out, &tf, flags);
+    if (fclose(out) != 0 || rc < 0) {
+	perror(argv[optind+1]);
+	exit(1);
+    }
+    trace_unload(&tf);
+    exit(0);
+}
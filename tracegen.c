@@ -0,0 +1,417 @@
+/*
+ * tracegen.c - Generates balanced allocator traces from parameterized
+ *     distributions, for stressing particular allocator paths at any
+ *     scale. The same options and seed always give the same trace.
+ *
+ *     The trace is a sequence of allocation steps. Each block gets a
+ *     size and a lifetime (in steps) drawn from distributions, and is
+ *     freed when its lifetime runs out; a share of the blocks instead
+ *     grows by a chain of reallocs spread over its lifetime. Phases
+ *     split the steps into stretches that alternate between two size
+ *     distributions, and free what they allocated when they end, as a
+ *     program stage would. A live-set cap frees the blocks due soonest
+ *     early. Whatever is live at the end is freed, so the trace is
+ *     balanced.
+ *
+ *     usage: tracegen [options] <outfile>      ("-" for stdout)
+ *
+ *     A distribution is one of
+ *         const:N          always N
+ *         uniform:LO:HI    uniform on LO..HI
+ *         exp:MEAN         exponential with mean MEAN
+ *         pow2:LO:HI       a power of two from LO..HI, each equally likely
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define MAXSIZE  (1 << 28)   /* largest request size generated */
+
+/* A distribution of positive integers */
+typedef struct {
+    enum {D_CONST, D_UNIFORM, D_EXP, D_POW2} kind;
+    double a, b;
+} dist_t;
+
+/* Generator state of a live block */
+typedef struct {
+    int size;      /* current payload size */
+    int tid;       /* thread that owns it */
+    int phase;     /* phase it was allocated in */
+    int survivor;  /* outlives its phase */
+    int steps;     /* reallocs still to come */
+    long gap;      /* steps between reallocs */
+    long death;    /* step it is freed at */
+} block_t;
+
+/* A pending realloc or free of a block, in a min-heap by step */
+typedef struct {
+    long when;
+    int id;
+} event_t;
+
+static unsigned long long rng_state;
+
+static block_t *blocks;
+static event_t *heap;
+static int heap_n;
+static trace_op_t *ops;
+static int ops_n, ops_max;
+static long live, peak, maxlive;
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: tracegen [-bz] [-n <allocs>] [-s <dist>] [-S <dist>] [-l <dist>] [-P <phases>] [-k <pct>] [-r <pct>[:<steps>[:<factor>]]] [-m <bytes>] [-T <threads>] [-x <seed>] <outfile>\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-b         Write a binary trace.\n");
+    fprintf(stderr, "\t-k <pct>   Percent of blocks that outlive their phase (default 0).\n");
+    fprintf(stderr, "\t-l <dist>  Lifetime in allocations (default exp:100).\n");
+    fprintf(stderr, "\t-m <bytes> Keep the live payload under <bytes> (default no limit).\n");
+    fprintf(stderr, "\t-n <n>     Number of allocations (default 10000).\n");
+    fprintf(stderr, "\t-P <n>     Number of phases (default 1).\n");
+    fprintf(stderr, "\t-r <spec>  Percent of blocks grown by <steps> reallocs (default 4)\n");
+    fprintf(stderr, "\t           of <factor> times their size (default 2.0).\n");
+    fprintf(stderr, "\t-S <dist>  Size in odd-numbered phases (default: as -s).\n");
+    fprintf(stderr, "\t-s <dist>  Size in bytes (default uniform:1:4096).\n");
+    fprintf(stderr, "\t-T <n>     Spread the blocks over <n> threads (default 1).\n");
+    fprintf(stderr, "\t-x <seed>  Random seed (default 1).\n");
+    fprintf(stderr, "\t-z         Write a compressed (varint) binary trace.\n");
+    fprintf(stderr, "Distributions: const:N, uniform:LO:HI, exp:MEAN, pow2:LO:HI\n");
+}
+
+/*
+ * parse_dist - Parse a distribution spec into d. Returns 0, or -1 if
+ *     the spec is malformed.
+ */
+static int parse_dist(const char *spec, dist_t *d)
+{
+    if (sscanf(spec, "const:%lf", &d->a) == 1)
+	d->kind = D_CONST;
+    else if (sscanf(spec, "uniform:%lf:%lf", &d->a, &d->b) == 2)
+	d->kind = D_UNIFORM;
+    else if (sscanf(spec, "exp:%lf", &d->a) == 1)
+	d->kind = D_EXP;
+    else if (sscanf(spec, "pow2:%lf:%lf", &d->a, &d->b) == 2)
+	d->kind = D_POW2;
+    else
+	return -1;
+    if (d->a < 1 || (d->kind != D_CONST && d->kind != D_EXP && d->b < d->a))
+	return -1;
+    return 0;
+}
+
+/* rng - xorshift64*, so traces don't depend on the libc's rand() */
+static unsigned long long rng(void)
+{
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return rng_state * 2685821657736338717ULL;
+}
+
+/* uniform - A double in [0, 1) */
+static double uniform(void)
+{
+    return (rng() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*
+ * sample - Draw from d, clamped to 1..MAXSIZE
+ */
+static long sample(const dist_t *d)
+{
+    double v = 0;
+    int lo, hi;
+
+    switch (d->kind) {
+    case D_CONST:
+	v = d->a;
+	break;
+    case D_UNIFORM:
+	v = floor(d->a + uniform() * (floor(d->b) - d->a + 1));
+	break;
+    case D_EXP:
+	v = ceil(-d->a * log(1 - uniform()));
+	break;
+    case D_POW2:
+	lo = (int)ceil(log2(d->a));
+	hi = (int)floor(log2(d->b));
+	if (hi < lo)
+	    hi = lo;
+	v = ldexp(1, lo + (int)(uniform() * (hi - lo + 1)));
+	break;
+    }
+    if (v < 1)
+	return 1;
+    return (v > MAXSIZE) ? MAXSIZE : (long)v;
+}
+
+/*
+ * emit - Append an op to the trace
+ */
+static void emit(int type, int id, int size)
+{
+    if (ops_n == ops_max) {
+	ops_max = ops_max ? 2 * ops_max : 65536;
+	if ((ops = realloc(ops, ops_max * sizeof(trace_op_t))) == NULL) {
+	    fprintf(stderr, "tracegen: out of memory\n");
+	    exit(1);
+	}
+    }
+    ops[ops_n].type = type;
+    ops[ops_n].index = id;
+    ops[ops_n].size = size;
+    ops[ops_n].tid = blocks[id].tid;
+    ops_n++;
+}
+
+/* Event heap ordered by step, then id, so the output is deterministic */
+#define EV_BEFORE(x, y) ((x).when < (y).when || \
+			 ((x).when == (y).when && (x).id < (y).id))
+
+static void heap_push(long when, int id)
+{
+    int i = heap_n++, parent;
+    event_t e = {when, id};
+
+    for (; i > 0 && EV_BEFORE(e, heap[parent = (i - 1) / 2]); i = parent)
+	heap[i] = heap[parent];
+    heap[i] = e;
+}
+
+/* heap_sift - Move the event at i down to its place */
+static void heap_sift(int i)
+{
+    event_t e = heap[i];
+    int child;
+
+    while ((child = 2 * i + 1) < heap_n) {
+	if (child + 1 < heap_n && EV_BEFORE(heap[child + 1], heap[child]))
+	    child++;
+	if (!EV_BEFORE(heap[child], e))
+	    break;
+	heap[i] = heap[child];
+	i = child;
+    }
+    heap[i] = e;
+}
+
+static event_t heap_pop(void)
+{
+    event_t top = heap[0];
+
+    heap[0] = heap[--heap_n];
+    if (heap_n > 0)
+	heap_sift(0);
+    return top;
+}
+
+/*
+ * free_block - Emit the free of a live block
+ */
+static void free_block(int id)
+{
+    emit(TRACE_FREE, id, 0);
+    live -= blocks[id].size;
+}
+
+/*
+ * make_room - Free the blocks due soonest until growing the live
+ *     payload by need bytes keeps it under maxlive
+ */
+static void make_room(long need)
+{
+    while (maxlive > 0 && live + need > maxlive && heap_n > 0)
+	free_block(heap_pop().id);
+}
+
+/*
+ * fire - Run a block's pending event: the next realloc of its chain,
+ *     rescheduling it, or its free
+ */
+static void fire(event_t e, double factor)
+{
+    block_t *b = &blocks[e.id];
+    double size;
+
+    if (b->steps == 0) {
+	free_block(e.id);
+	return;
+    }
+    size = ceil(b->size * factor);
+    size = (size < 1) ? 1 : (size > MAXSIZE) ? MAXSIZE : size;
+    make_room((long)size - b->size);
+    live += (long)size - b->size;
+    if (live > peak)
+	peak = live;
+    b->size = (int)size;
+    emit(TRACE_REALLOC, e.id, b->size);
+    b->steps--;
+    heap_push(b->steps ? e.when + b->gap :
+	      (b->death > e.when ? b->death : e.when + 1), e.id);
+}
+
+/*
+ * end_phase - Free the blocks allocated in phase that don't outlive it
+ */
+static void end_phase(int phase)
+{
+    int i, n = 0;
+
+    for (i = 0; i < heap_n; i++) {
+	if (blocks[heap[i].id].phase == phase && !blocks[heap[i].id].survivor)
+	    free_block(heap[i].id);
+	else
+	    heap[n++] = heap[i];
+    }
+    heap_n = n;
+    for (i = n / 2 - 1; i >= 0; i--)
+	heap_sift(i);
+}
+
+int main(int argc, char **argv)
+{
+    dist_t size_dist = {D_UNIFORM, 1, 4096}, size2_dist, life_dist = {D_EXP, 100, 0};
+    int have_size2 = 0, nthreads = 1, phases = 1, keep = 0;
+    int realloc_pct = 0, realloc_steps = 4, binary = 0, flags = 0;
+    double factor = 2.0;
+    long n = 10000, t, life, size;
+    int c, rc, phase, cur = 0;
+    trace_file_t tf;
+    block_t *b;
+    FILE *out;
+
+    rng_state = 1;
+    while ((c = getopt(argc, argv, "bzn:s:S:l:P:k:r:m:T:x:h")) != EOF) {
+	switch (c) {
+	case 'b':
+	    binary = 1;
+	    break;
+	case 'z':
+	    binary = 1;
+	    flags |= TRACE_F_VARINT;
+	    break;
+	case 'n':
+	    n = atol(optarg);
+	    break;
+	case 's':
+	    if (parse_dist(optarg, &size_dist) < 0)
+		goto bad;
+	    break;
+	case 'S':
+	    if (parse_dist(optarg, &size2_dist) < 0)
+		goto bad;
+	    have_size2 = 1;
+	    break;
+	case 'l':
+	    if (parse_dist(optarg, &life_dist) < 0)
+		goto bad;
+	    break;
+	case 'P':
+	    phases = atoi(optarg);
+	    break;
+	case 'k':
+	    keep = atoi(optarg);
+	    break;
+	case 'r':
+	    if (sscanf(optarg, "%d:%d:%lf", &realloc_pct, &realloc_steps,
+		       &factor) < 1 || realloc_steps < 1 || factor <= 0)
+		goto bad;
+	    break;
+	case 'm':
+	    maxlive = atol(optarg);
+	    break;
+	case 'T':
+	    nthreads = atoi(optarg);
+	    break;
+	case 'x':
+	    rng_state = strtoull(optarg, NULL, 0) * 0x9e3779b97f4a7c15ULL + 1;
+	    break;
+	case 'h':
+	    usage();
+	    exit(0);
+	default:
+	bad:
+	    usage();
+	    exit(1);
+	}
+    }
+    if (argc - optind != 1 || n < 1 || n > 0x7fffffff || phases < 1 ||
+	phases > n || nthreads < 1) {
+	usage();
+	exit(1);
+    }
+    if (!have_size2)
+	size2_dist = size_dist;
+
+    if ((blocks = calloc(n, sizeof(block_t))) == NULL ||
+	(heap = malloc(n * sizeof(event_t))) == NULL) {
+	fprintf(stderr, "tracegen: out of memory\n");
+	exit(1);
+    }
+
+    for (t = 0; t < n; t++) {
+	/* Crossing into a new phase ends the last one */
+	if ((phase = (int)(t * phases / n)) != cur)
+	    end_phase(cur);
+	cur = phase;
+
+	while (heap_n > 0 && heap[0].when <= t)
+	    fire(heap_pop(), factor);
+
+	size = sample((phase & 1) ? &size2_dist : &size_dist);
+	make_room(size);
+
+	b = &blocks[t];
+	b->size = (int)size;
+	b->tid = (nthreads > 1) ? (int)(rng() % nthreads) : 0;
+	b->phase = phase;
+	b->survivor = (int)(rng() % 100) < keep;
+	life = sample(&life_dist);
+	b->death = t + life;
+	if ((int)(rng() % 100) < realloc_pct) {
+	    b->steps = realloc_steps;
+	    b->gap = life / (realloc_steps + 1);
+	    if (b->gap < 1)
+		b->gap = 1;
+	}
+	emit(TRACE_ALLOC, (int)t, b->size);
+	if ((live += size) > peak)
+	    peak = live;
+	heap_push(b->steps ? t + b->gap : b->death, (int)t);
+    }
+    while (heap_n > 0)
+	fire(heap_pop(), factor);
+
+    tf.sugg_heapsize = (peak > 0x7fffffff) ? 0x7fffffff : (int)peak;
+    tf.num_ids = (int)n;
+    tf.num_ops = ops_n;
+    tf.weight = 1;
+    tf.num_threads = nthreads;
+    tf.ops = ops;
+    tf.map = NULL;
+    tf.maplen = 0;
+
+    if (strcmp(argv[optind], "-") == 0)
+	out = stdout;
+    else if ((out = fopen(argv[optind], "wb")) == NULL) {
+	perror(argv[optind]);
+	exit(1);
+    }
+    if (binary)
+	rc = trace_write_binary(out, &tf, flags);
+    else
+	rc = trace_write_text(out, &tf);
+    if (fclose(out) != 0 || rc < 0) {
+	perror(argv[optind]);
+	exit(1);
+    }
+    free(blocks);
+    free(heap);
+    free(ops);
+    exit(0);
+}